@@ -0,0 +1,136 @@
+// Compares the byte-per-cell boards with bitboards on the placement and shot
+// paths of the server, and reports the memory each layout needs.
+//
+// Build: gcc -O2 -pthread -o bench_bitboard src/bench_bitboard.c
+//        (add -mavx2 or -march=native for the AVX2 kernels)
+#define HW4_NO_MAIN
+#include "hw4.c"
+
+#include <time.h>
+
+#define PLACEMENTS 1000000
+
+volatile long bench_sink;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Marks roughly `density` of the cells as occupied, the same cells on both boards.
+void fill_boards(struct board *bytes, struct board *bits, double density, unsigned seed) {
+    size_t target = (size_t)(density * bytes->width * bytes->height);
+
+    srand(seed);
+    for (size_t i = 0; i < target; i++) {
+        int row = rand() % bytes->height;
+        int col = rand() % bytes->width;
+        board_set_ship(bytes, row, col, 1);
+        board_set_ship(bits, row, col, 1);
+    }
+}
+
+struct placement {
+    int piece_type;
+    int rotation;
+    int ref_row;
+    int ref_col;
+};
+
+struct placement placements[PLACEMENTS];
+
+// Draws the placements up front so that only validation is timed.
+void generate_placements(int width, int height, unsigned seed) {
+    srand(seed);
+    for (int i = 0; i < PLACEMENTS; i++) {
+        placements[i].piece_type = rand() % 7;
+        placements[i].rotation = rand() % 4;
+        placements[i].ref_row = rand() % height;
+        placements[i].ref_col = rand() % width;
+    }
+}
+
+double bench_validate(const struct board *board) {
+    long accepted = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < PLACEMENTS; i++) {
+        const struct placement *p = &placements[i];
+        accepted += validate_piece_placement(board, p->piece_type, p->rotation, p->ref_row, p->ref_col) == 0;
+    }
+    double elapsed = now_seconds() - start;
+    bench_sink = accepted;
+    return elapsed * 1e9 / PLACEMENTS;
+}
+
+// Fires at every `stride`-th cell, through the accessors for byte boards and
+// as one precomputed volley layer for bitboards.
+double bench_shots(struct board *board, int stride) {
+    double start, elapsed;
+
+    if (board->kind == BOARD_BITS) {
+        size_t words = bitboard_layer_words(board->width, board->height);
+        struct bitboard volley = board->bits;
+        volley.shots = calloc(words, sizeof(uint64_t));
+        for (size_t cell = 0; cell < (size_t)board->width * board->height; cell += stride) {
+            bitboard_set(volley.shots, &volley, cell / board->width, cell % board->width);
+        }
+        start = now_seconds();
+        bitboard_apply_shots(&board->bits, volley.shots, 0, words);
+        elapsed = now_seconds() - start;
+        free(volley.shots);
+    } else {
+        start = now_seconds();
+        for (size_t cell = 0; cell < (size_t)board->width * board->height; cell += stride) {
+            int row = cell / board->width;
+            int col = cell % board->width;
+            board_set_shot(board, row, col, board_get_ship(board, row, col) ? HIT : MISS);
+        }
+        elapsed = now_seconds() - start;
+    }
+    return elapsed * 1e3;
+}
+
+int main(void) {
+    int sizes[] = {10, 100, 1000, 4000};
+    double densities[] = {0.01, 0.2};
+
+    printf("Bitboard kernels: %s\n\n", BITBOARD_KERNEL);
+    printf("%-11s %7s %12s %12s %12s %14s %14s\n", "board", "density",
+           "int** MB", "bytes MB", "bits MB", "validate ns", "shots ms");
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        int n = sizes[s];
+
+        // The layout replaced by the byte boards: int rows plus char shot-history rows
+        double legacy_mb = (double)n * (2 * sizeof(void *) + (size_t)n * (sizeof(int) + sizeof(char))) / 1e6;
+        double bytes_mb = board_storage_size(BOARD_BYTES, n, n) / 1e6;
+        double bits_mb = board_storage_size(BOARD_BITS, n, n) / 1e6;
+
+        for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+            struct board bytes, bits;
+            if (initialize_board(&bytes, n, n, BOARD_BYTES) != 0 || initialize_board(&bits, n, n, BOARD_BITS) != 0) {
+                perror("Failed to allocate boards");
+                exit(EXIT_FAILURE);
+            }
+            fill_boards(&bytes, &bits, densities[d], 42);
+
+            generate_placements(n, n, 7);
+            double validate_bytes = bench_validate(&bytes);
+            double validate_bits = bench_validate(&bits);
+            double shots_bytes = bench_shots(&bytes, 3);
+            double shots_bits = bench_shots(&bits, 3);
+
+            char label[32];
+            snprintf(label, sizeof(label), "%dx%d", n, n);
+            printf("%-11s %7.2f %12.3f %12.3f %12.3f %6.1f /%6.1f %6.2f /%6.2f\n", label, densities[d],
+                   legacy_mb, bytes_mb, bits_mb, validate_bytes, validate_bits, shots_bytes, shots_bits);
+
+            free_board(&bytes);
+            free_board(&bits);
+        }
+    }
+    printf("\nTimings are byte boards / bitboards.\n");
+    return 0;
+}
@@ -0,0 +1,339 @@
+// Times the game kernels and packet handlers across board sizes and shot
+// densities, and prints one CSV row per measurement so that runs from two
+// builds can be compared.
+//
+// Handlers reply through a connection, which only appends to its write
+// buffer. They run here against a capture sink: a connection that is never
+// flushed and whose buffer is emptied after every call.
+//
+// Build: gcc -O2 -pthread -o bench_kernels src/bench_kernels.c
+// Usage: bench_kernels [-k auto|bytes|bits|sparse] [-m max_size] [-t min_seconds] [-r repetitions]
+#define HW4_NO_MAIN
+#include "hw4.c"
+
+#include <fcntl.h>
+#include <time.h>
+
+#define PLACEMENTS 4096              // Power of two
+#define MAX_SHOTS (1 << 20)          // Denser boards are capped
+#define QUERY_DELTA 16
+
+static const int sizes[] = {10, 100, 1000, 10000};
+static const double densities[] = {0, 0.01, 0.1};
+
+volatile long bench_sink;
+
+// Keeps the compiler from hoisting a call on an unchanged board out of a loop
+#define BENCH_BARRIER() __asm__ volatile("" ::: "memory")
+
+struct placement {
+    int piece_type;
+    int rotation;
+    int ref_row;
+    int ref_col;
+};
+
+struct bench_case {
+    struct board board;          // Fleet in the corner plus `shots` shots
+    struct engine_match match;   // Empty boards, Player 1 to initialize
+    struct placement placements[PLACEMENTS];
+    char fleet_text[64];
+    struct packet fleet;         // The I packet of the fleet, decoded
+    uint32_t shots;
+};
+
+typedef long (*bench_fn)(struct bench_case *bench, long iterations);
+
+static struct shard sink_shard;
+static struct conn sink;
+static unsigned long sink_bytes;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sink_init(void) {
+    sink.kind = ENDPOINT_CONN;
+    sink.fd = open("/dev/null", O_WRONLY);
+    sink.shard = &sink_shard;
+    sink.wire = WIRE_TEXT;
+    sink.framed = true;
+}
+
+// Drops whatever the handlers replied since the last call.
+void sink_reset(void) {
+    sink_bytes += conn_out_pending(&sink);
+    conn_discard_output(&sink);
+    sink.dirty = false;
+    sink_shard.dirty = NULL;
+}
+
+// The fleet every case uses, inside the 10x10 corner.
+static const int fleet[FLEET_SIZE][4] = {
+    {1, 1, 0, 0}, {2, 1, 0, 3}, {3, 1, 5, 5}, {4, 1, 5, 0}, {7, 1, 0, 7},
+};
+
+int setup_case(struct bench_case *bench, int size, double density, enum board_kind kind, unsigned seed) {
+    uint64_t cells = (uint64_t)size * size;
+    uint32_t shots = density * cells > MAX_SHOTS ? MAX_SHOTS : (uint32_t)(density * cells);
+
+    engine_match_init(&bench->match);
+    bench->match.phase = PHASE_INIT_P1;
+    bench->match.board_width = size;
+    bench->match.board_height = size;
+    if (initialize_boards(&bench->board, 1, size, size, kind) != 0 ||
+        initialize_boards(bench->match.boards, 2, size, size, kind) != 0) {
+        return -1;
+    }
+    board_reserve(&bench->board, FLEET_SIZE * 4);
+    int length = snprintf(bench->fleet_text, sizeof(bench->fleet_text), "I");
+    for (int i = 0; i < FLEET_SIZE; i++) {
+        length += snprintf(bench->fleet_text + length, sizeof(bench->fleet_text) - length, " %d %d %d %d",
+                           fleet[i][0], fleet[i][1], fleet[i][2], fleet[i][3]);
+        if (place_piece(&bench->board, fleet[i][0] - 1, fleet[i][1] - 1, fleet[i][2], fleet[i][3], i + 1) != 0) {
+            return -1;
+        }
+    }
+
+    decode_packet(bench->fleet_text, &bench->fleet);
+    if (!bench->fleet.well_formed) {
+        return -1;
+    }
+
+    srand(seed);
+    if (board_reserve_shots(&bench->board, shots) != 0) {
+        return -1;
+    }
+    while (bench->board.log.count < shots) {
+        char result;
+        fire_shot(&bench->board, rand() % size, rand() % size, &result);
+    }
+    bench->shots = shots;
+
+    for (int i = 0; i < PLACEMENTS; i++) {
+        bench->placements[i] = (struct placement){rand() % 7, rand() % 4, rand() % size, rand() % size};
+    }
+    return 0;
+}
+
+long bench_get_piece_coordinates(struct bench_case *bench, long iterations) {
+    long sum = 0;
+    int coords[4][2];
+
+    for (long i = 0; i < iterations; i++) {
+        const struct placement *p = &bench->placements[i & (PLACEMENTS - 1)];
+        get_piece_coordinates(p->piece_type, p->rotation, p->ref_row, p->ref_col, coords);
+        sum += coords[3][0] + coords[3][1];
+    }
+    return sum;
+}
+
+// A piece that fits is taken off again so the board stays the same.
+long bench_place_piece(struct bench_case *bench, long iterations) {
+    struct board *empty = &bench->match.boards[0];
+    long placed = 0;
+
+    board_reserve(empty, 4);
+    for (long i = 0; i < iterations; i++) {
+        const struct placement *p = &bench->placements[i & (PLACEMENTS - 1)];
+        if (place_piece(empty, p->piece_type, p->rotation, p->ref_row, p->ref_col, 1) == 0) {
+            remove_piece(empty, 1);
+            placed++;
+        }
+    }
+    return placed;
+}
+
+long bench_validate_piece_placement(struct bench_case *bench, long iterations) {
+    long accepted = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        const struct placement *p = &bench->placements[i & (PLACEMENTS - 1)];
+        accepted += validate_piece_placement(&bench->board, p->piece_type, p->rotation, p->ref_row, p->ref_col) == 0;
+    }
+    return accepted;
+}
+
+// Player 1's Initialize goes through the engine as the server applies it,
+// then the fleet is taken off again and the turn handed back.
+long bench_initialize(struct bench_case *bench, long iterations) {
+    struct engine_result result;
+    long accepted = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        engine_apply(&bench->match, 0, &bench->fleet, &result);
+        if (result.reply == ENGINE_REPLY_ACK) {
+            for (int id = 1; id <= FLEET_SIZE; id++) {
+                remove_piece(&bench->match.boards[0], id);
+            }
+            bench->match.phase = PHASE_INIT_P1;
+            accepted++;
+        }
+    }
+    return accepted;
+}
+
+long bench_is_ship_sunk(struct bench_case *bench, long iterations) {
+    long sunk = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        sunk += is_ship_sunk(&bench->board, i % FLEET_SIZE + 1);
+        BENCH_BARRIER();
+    }
+    return sunk;
+}
+
+long bench_count_remaining_ships(struct bench_case *bench, long iterations) {
+    long remaining = 0;
+
+    for (long i = 0; i < iterations; i++) {
+        remaining += count_remaining_ships(&bench->board);
+        BENCH_BARRIER();
+    }
+    return remaining;
+}
+
+static long run_queries(struct bench_case *bench, long iterations, enum wire_mode wire, uint32_t since) {
+    long bytes = 0;
+
+    sink.wire = wire;
+    for (long i = 0; i < iterations; i++) {
+        handle_query_packet(&sink, &bench->board, since);
+        bytes += conn_out_pending(&sink);
+        sink_reset();
+    }
+    sink.wire = WIRE_TEXT;
+    return bytes;
+}
+
+long bench_query_text(struct bench_case *bench, long iterations) {
+    return run_queries(bench, iterations, WIRE_TEXT, 0);
+}
+
+long bench_query_text_delta(struct bench_case *bench, long iterations) {
+    return run_queries(bench, iterations, WIRE_TEXT, bench->shots > QUERY_DELTA ? bench->shots - QUERY_DELTA : 0);
+}
+
+long bench_query_binary(struct bench_case *bench, long iterations) {
+    return run_queries(bench, iterations, WIRE_BINARY, 0);
+}
+
+struct benchmark {
+    const char *name;
+    bench_fn run;
+};
+
+static const struct benchmark benchmarks[] = {
+    {"get_piece_coordinates", bench_get_piece_coordinates},
+    {"place_piece", bench_place_piece},
+    {"validate_piece_placement", bench_validate_piece_placement},
+    {"engine_apply/initialize", bench_initialize},
+    {"is_ship_sunk", bench_is_ship_sunk},
+    {"count_remaining_ships", bench_count_remaining_ships},
+    {"handle_query_packet/text", bench_query_text},
+    {"handle_query_packet/text_delta", bench_query_text_delta},
+    {"handle_query_packet/binary", bench_query_binary},
+};
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Finds an iteration count that runs for at least `min_seconds`, then times
+// `repetitions` runs of it and reports the fastest and the median.
+void measure(const struct benchmark *benchmark, struct bench_case *bench, double min_seconds, int repetitions,
+             double *best, double *median, long *iterations) {
+    double times[repetitions];
+    long n = 1;
+
+    while (1) {
+        double start = now_seconds();
+        bench_sink += benchmark->run(bench, n);
+        double elapsed = now_seconds() - start;
+        if (elapsed >= min_seconds || n >= (1L << 40)) {
+            break;
+        }
+        n = elapsed > 0 && min_seconds / elapsed < 100 ? (long)(n * 1.2 * min_seconds / elapsed) + 1 : n * 100;
+    }
+    for (int r = 0; r < repetitions; r++) {
+        double start = now_seconds();
+        bench_sink += benchmark->run(bench, n);
+        times[r] = (now_seconds() - start) * 1e9 / n;
+    }
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    *best = times[0];
+    *median = times[repetitions / 2];
+    *iterations = n;
+}
+
+static const char *const kind_names[] = {"bytes", "bits", "sparse"};
+
+int main(int argc, char **argv) {
+    const char *kind_option = "auto";
+    int max_size = 10000;
+    double min_seconds = 0.02;
+    int repetitions = 5;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "k:m:t:r:")) != -1) {
+        switch (opt) {
+        case 'k':
+            kind_option = optarg;
+            break;
+        case 'm':
+            max_size = atoi(optarg);
+            break;
+        case 't':
+            min_seconds = atof(optarg);
+            break;
+        case 'r':
+            repetitions = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-k auto|bytes|bits|sparse] [-m max_size] [-t min_seconds] [-r repetitions]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (repetitions < 1) {
+        repetitions = 1;
+    }
+    log_set_level(LOG_OFF);
+    sink_init();
+
+    printf("benchmark,kind,width,height,density,shots,iterations,ns_min,ns_median\n");
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && sizes[s] <= max_size; s++) {
+        int size = sizes[s];
+        enum board_kind kind = board_kind_for(size, size);
+
+        for (int k = 0; k < 3; k++) {
+            if (strcmp(kind_option, kind_names[k]) == 0) {
+                kind = k;
+            }
+        }
+        for (size_t d = 0; d < sizeof(densities) / sizeof(densities[0]); d++) {
+            struct bench_case *bench = calloc(1, sizeof(struct bench_case));
+
+            if (!bench || setup_case(bench, size, densities[d], kind, 42) != 0) {
+                fprintf(stderr, "Cannot set up a %dx%d %s board\n", size, size, kind_names[kind]);
+                exit(EXIT_FAILURE);
+            }
+            for (size_t b = 0; b < sizeof(benchmarks) / sizeof(benchmarks[0]); b++) {
+                double best, median;
+                long iterations;
+
+                measure(&benchmarks[b], bench, min_seconds, repetitions, &best, &median, &iterations);
+                printf("%s,%s,%d,%d,%g,%u,%ld,%.2f,%.2f\n", benchmarks[b].name, kind_names[kind], size, size,
+                       densities[d], bench->shots, iterations, best, median);
+                fflush(stdout);
+            }
+            free_board(&bench->board);
+            engine_match_free(&bench->match);
+            free(bench);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,120 @@
+// Measures the cost of decoding one packet with decode_packet() against the
+// strcmp/sscanf classification and parsing the handlers used before.
+//
+// Build: gcc -O2 -pthread -o bench_parse src/bench_parse.c
+#define HW4_NO_MAIN
+#include "hw4.c"
+
+#include <time.h>
+
+#define ROUNDS 2000000
+
+volatile long bench_sink;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The previous path: classify with strcmp/strncmp, then parse with sscanf.
+// Initialize counted its tokens, then ran sscanf per piece and advanced by
+// re-printing the numbers.
+long sscanf_parse(const char *buffer) {
+    int a = 0, b = 0, c = 0, d = 0;
+    char extra;
+
+    if (strncmp(buffer, "B", 1) == 0) {
+        return sscanf(buffer, "B %d %d%c", &a, &b, &extra) == 2 ? a + b : -1;
+    }
+    if (strncmp(buffer, "I ", 2) == 0) {
+        int parameter_count = 0;
+        for (int i = 2; buffer[i] != '\0'; i++) {
+            if (!isspace(buffer[i]) && (i == 2 || isspace(buffer[i - 1]))) {
+                parameter_count++;
+            }
+        }
+        if (parameter_count != FLEET_SIZE * 4) {
+            return -1;
+        }
+        long sum = 0;
+        int offset = 2;
+        for (int i = 0; i < FLEET_SIZE; i++) {
+            if (sscanf(buffer + offset, "%d %d %d %d", &a, &b, &c, &d) != 4) {
+                return -1;
+            }
+            sum += a + b + c + d;
+            offset += snprintf(NULL, 0, "%d %d %d %d ", a, b, c, d);
+        }
+        return sum;
+    }
+    if (strncmp(buffer, "S ", 2) == 0) {
+        return sscanf(buffer, "S %d %d %c", &a, &b, &extra) == 2 ? a + b : -1;
+    }
+    if (strcmp(buffer, "Q\n") == 0 || strcmp(buffer, "Q") == 0) {
+        return 1;
+    }
+    if (strcmp(buffer, "F\n") == 0 || strcmp(buffer, "F") == 0) {
+        return 2;
+    }
+    return 0;
+}
+
+long decoder_parse(const char *buffer) {
+    struct packet packet;
+
+    decode_packet(buffer, &packet);
+    if (!packet.well_formed) {
+        return packet.kind;
+    }
+    switch (packet.kind) {
+    case PACKET_BEGIN:
+        return packet.begin.width + packet.begin.height;
+    case PACKET_INITIALIZE: {
+        long sum = 0;
+        for (int i = 0; i < FLEET_SIZE; i++) {
+            sum += packet.pieces[i].piece_type + packet.pieces[i].rotation + packet.pieces[i].ref_row + packet.pieces[i].ref_col;
+        }
+        return sum;
+    }
+    case PACKET_SHOOT:
+        return packet.shot.row + packet.shot.col;
+    default:
+        return packet.kind;
+    }
+}
+
+double bench(long (*parse)(const char *), const char *packet) {
+    long sum = 0;
+
+    double start = now_seconds();
+    for (int i = 0; i < ROUNDS; i++) {
+        sum += parse(packet);
+    }
+    double elapsed = now_seconds() - start;
+    bench_sink = sum;
+    return elapsed * 1e9 / ROUNDS;
+}
+
+int main(void) {
+    const char *packets[] = {
+        "B 10 10",
+        "B 100000 100000",
+        "I 1 1 0 0 1 1 0 2 1 1 0 4 1 1 2 2 1 1 2 0",
+        "I 7 4 12 30 2 3 100 4 5 1 40 40 6 2 9 9 3 4 70 1",
+        "S 3 4",
+        "S 1234 5678",
+        "Q",
+        "F",
+        "S 1 2 3",
+        "X",
+    };
+
+    printf("%-52s %12s %12s %8s\n", "packet", "sscanf ns", "decode ns", "speedup");
+    for (size_t i = 0; i < sizeof(packets) / sizeof(packets[0]); i++) {
+        double before = bench(sscanf_parse, packets[i]);
+        double after = bench(decoder_parse, packets[i]);
+        printf("%-52s %12.1f %12.1f %7.1fx\n", packets[i], before, after, before / after);
+    }
+    return 0;
+}
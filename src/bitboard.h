@@ -0,0 +1,124 @@
+#ifndef BITBOARD_H
+#define BITBOARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BITBOARD_KERNEL "avx2"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define BITBOARD_KERNEL "sse2"
+#else
+#define BITBOARD_KERNEL "scalar"
+#endif
+
+/*
+ * One bit per cell, rows padded to whole 64-bit words. A board uses two such
+ * layers: the occupied cells of the fleet and the cells that were shot at.
+ * The kernels are picked at compile time: AVX2 when built with -mavx2 (or
+ * -march=native), SSE2 on any x86-64 build, plain C elsewhere.
+ */
+struct bitboard {
+    int width;
+    int height;
+    size_t words_per_row;
+    uint64_t *occupied;
+    uint64_t *shots;
+};
+
+static inline size_t bitboard_words_per_row(int width) {
+    return ((size_t)width + 63) / 64;
+}
+
+// Words in one layer, rounded up to a whole 256-bit vector.
+static inline size_t bitboard_layer_words(int width, int height) {
+    size_t words = bitboard_words_per_row(width) * (size_t)height;
+    return (words + 3) & ~(size_t)3;
+}
+
+static inline size_t bitboard_word(const struct bitboard *board, int row, int col) {
+    return (size_t)row * board->words_per_row + (size_t)col / 64;
+}
+
+static inline uint64_t bitboard_bit(int col) {
+    return (uint64_t)1 << (col & 63);
+}
+
+static inline bool bitboard_test(const uint64_t *layer, const struct bitboard *board, int row, int col) {
+    return (layer[bitboard_word(board, row, col)] & bitboard_bit(col)) != 0;
+}
+
+static inline void bitboard_set(uint64_t *layer, const struct bitboard *board, int row, int col) {
+    layer[bitboard_word(board, row, col)] |= bitboard_bit(col);
+}
+
+static inline void bitboard_clear(uint64_t *layer, const struct bitboard *board, int row, int col) {
+    layer[bitboard_word(board, row, col)] &= ~bitboard_bit(col);
+}
+
+// Returns whether any of the first `count` cells of a tetromino footprint is
+// set in `layer`. The cells must be in bounds. Each cell is one 64-bit lane:
+// its word is gathered and tested against its bit in a single vector step.
+static inline bool bitboard_footprint_overlaps(const struct bitboard *board, const uint64_t *layer, const int coords[4][2], int count) {
+    int64_t index[4];
+    uint64_t mask[4];
+
+    if (count == 0) {
+        return false;
+    }
+    for (int i = 0; i < 4; i++) {
+        int cell = i < count ? i : 0;
+        index[i] = bitboard_word(board, coords[cell][0], coords[cell][1]);
+        mask[i] = i < count ? bitboard_bit(coords[cell][1]) : 0;
+    }
+
+#if defined(__AVX2__)
+    __m256i words = _mm256_i64gather_epi64((const long long *)layer, _mm256_loadu_si256((const __m256i *)index), 8);
+    return !_mm256_testz_si256(words, _mm256_loadu_si256((const __m256i *)mask));
+#elif defined(__SSE2__)
+    __m128i low = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(layer + index[0])), _mm_loadl_epi64((const __m128i *)(layer + index[1])));
+    __m128i high = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i *)(layer + index[2])), _mm_loadl_epi64((const __m128i *)(layer + index[3])));
+    low = _mm_and_si128(low, _mm_loadu_si128((const __m128i *)mask));
+    high = _mm_and_si128(high, _mm_loadu_si128((const __m128i *)(mask + 2)));
+    __m128i any = _mm_or_si128(low, high);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(any, _mm_setzero_si128())) != 0xFFFF;
+#else
+    uint64_t any = 0;
+    for (int i = 0; i < 4; i++) {
+        any |= layer[index[i]] & mask[i];
+    }
+    return any != 0;
+#endif
+}
+
+static inline void bitboard_place(struct bitboard *board, const int coords[4][2]) {
+    for (int i = 0; i < 4; i++) {
+        bitboard_set(board->occupied, board, coords[i][0], coords[i][1]);
+    }
+}
+
+// ORs words [first, last) of a layer of shots into the board's shot layer.
+static inline void bitboard_apply_shots(struct bitboard *board, const uint64_t *volley, size_t first, size_t last) {
+    uint64_t *shots = board->shots;
+    size_t i = first;
+
+#if defined(__AVX2__)
+    for (; i + 4 <= last; i += 4) {
+        __m256i merged = _mm256_or_si256(_mm256_loadu_si256((const __m256i *)(shots + i)), _mm256_loadu_si256((const __m256i *)(volley + i)));
+        _mm256_storeu_si256((__m256i *)(shots + i), merged);
+    }
+#elif defined(__SSE2__)
+    for (; i + 2 <= last; i += 2) {
+        __m128i merged = _mm_or_si128(_mm_loadu_si128((const __m128i *)(shots + i)), _mm_loadu_si128((const __m128i *)(volley + i)));
+        _mm_storeu_si128((__m128i *)(shots + i), merged);
+    }
+#endif
+    for (; i < last; i++) {
+        shots[i] |= volley[i];
+    }
+}
+
+#endif
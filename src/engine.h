@@ -0,0 +1,1186 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bitboard.h"
+#include "log.h"
+#include "pool.h"
+#include "shot_log.h"
+#include "sparse_board.h"
+
+/*
+ * The game without the network: boards, pieces, shots and the rules of a
+ * match. Nothing here reads or writes a socket, so the server, the tools and
+ * in-process simulations all play by the same code.
+ */
+
+#define HIT 'H'
+#define MISS 'M'
+#define EMPTY 0
+#define FLEET_SIZE 5
+#define SPARSE_AREA_THRESHOLD (1LL << 24)  // Cells above which boards go sparse
+#define VOLLEY_MAX_SHOTS 256      // More than fit in one text packet; a binary V frame holds them all
+
+enum match_phase {
+    PHASE_BEGIN_P1,
+    PHASE_BEGIN_P2,
+    PHASE_INIT_P1,
+    PHASE_INIT_P2,
+    PHASE_TURN_P1,
+    PHASE_TURN_P2,
+    PHASE_HALT
+};
+
+enum packet_kind {
+    PACKET_BEGIN,                // Starts with 'B'
+    PACKET_INITIALIZE,           // "I " and parameters
+    PACKET_SHOOT,                // "S " and parameters
+    PACKET_VOLLEY,               // "V " and pairs of parameters
+    PACKET_QUERY,                // "Q", or "Q <seq>" for the shots since seq
+    PACKET_FORFEIT,              // "F"
+    PACKET_OTHER,
+    PACKET_KINDS
+};
+
+enum board_kind {
+    BOARD_BYTES,
+    BOARD_BITS,
+    BOARD_SPARSE
+};
+
+// A player's board: the fleet and the shots fired at it. Byte boards keep one
+// byte per cell for each layer (piece id 1-5, and HIT or MISS); bitboards keep
+// one bit per cell and find piece ids through the recorded piece cells. The
+// layers of all dense boards of a match share one allocation. Sparse boards
+// keep only the cells with a piece or a shot, each in its own hash table, so
+// their memory does not depend on the area. The fleet counters are
+// kept up to date as pieces are placed and hit, so sinking is detected without
+// a scan.
+struct board {
+    enum board_kind kind;
+    int width;
+    int height;
+    uint8_t *ships;
+    uint8_t *shots;
+    struct bitboard bits;
+    struct sparse_board sparse;
+    struct shot_log log;         // Shots fired at this board, in order
+    void *allocation;            // Set on the board that owns the memory
+    int piece_coords[FLEET_SIZE][4][2];
+    unsigned placed_pieces;      // Bit i is set once piece i + 1 is placed
+    int piece_cells[FLEET_SIZE]; // Cells of each piece not hit yet
+    int ships_afloat;
+};
+
+struct piece_placement {
+    int piece_type;              // 1-7 as sent, not validated
+    int rotation;                // 1-4 as sent, not validated
+    int ref_row;
+    int ref_col;
+};
+
+// A packet as the phase rules read it, decoded from either protocol.
+struct packet {
+    enum packet_kind kind;
+    const char *text;            // The packet as received, for logging
+    bool bare;                   // The opcode alone
+    bool has_parameters;         // The opcode followed by a space
+    bool well_formed;            // The parameters match the packet kind
+    union {
+        struct {
+            int width;
+            int height;
+        } begin;
+        struct piece_placement pieces[FLEET_SIZE];
+        struct {
+            int row;
+            int col;
+        } shot;
+        struct {
+            int count;
+            int cells[VOLLEY_MAX_SHOTS][2];
+        } volley;
+        uint32_t since;          // First shot a query asks for
+    };
+};
+
+static enum board_kind board_storage = BOARD_BYTES;
+static long long sparse_area_threshold = SPARSE_AREA_THRESHOLD;
+
+/*
+ * Board storage. Cells are only ever touched through the accessors below.
+ */
+
+static inline size_t board_index(const struct board *board, int row, int col) {
+    return (size_t)row * board->width + col;
+}
+
+static inline bool board_in_bounds(const struct board *board, int row, int col) {
+    return row >= 0 && row < board->height && col >= 0 && col < board->width;
+}
+
+// Looks up which piece covers an occupied cell of a bitboard.
+static inline int bitboard_piece_at(const struct board *board, int row, int col) {
+    for (int piece = 0; piece < FLEET_SIZE; piece++) {
+        if (!(board->placed_pieces & (1u << piece))) {
+            continue;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (board->piece_coords[piece][i][0] == row && board->piece_coords[piece][i][1] == col) {
+                return piece + 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static inline int board_get_ship(const struct board *board, int row, int col) {
+    if (board->kind == BOARD_SPARSE) {
+        const struct sparse_cell *cell = sparse_board_find(&board->sparse, row, col);
+        return cell ? cell->ship : 0;
+    }
+    if (board->kind == BOARD_BITS) {
+        return bitboard_test(board->bits.occupied, &board->bits, row, col) ? bitboard_piece_at(board, row, col) : 0;
+    }
+    return board->ships[board_index(board, row, col)];
+}
+
+static inline bool board_is_occupied(const struct board *board, int row, int col) {
+    if (board->kind == BOARD_SPARSE) {
+        const struct sparse_cell *cell = sparse_board_find(&board->sparse, row, col);
+        return cell && cell->ship != 0;
+    }
+    if (board->kind == BOARD_BITS) {
+        return bitboard_test(board->bits.occupied, &board->bits, row, col);
+    }
+    return board->ships[board_index(board, row, col)] != 0;
+}
+
+// Setting a cell of a sparse board can add an entry; board_reserve() makes
+// room beforehand so that the setters cannot fail.
+static inline void board_set_ship(struct board *board, int row, int col, int piece_id) {
+    if (board->kind == BOARD_SPARSE) {
+        if (piece_id != 0) {
+            sparse_board_insert(&board->sparse, row, col)->ship = piece_id;
+            return;
+        }
+        // A cleared cell that was never shot at is dropped, so a rejected
+        // fleet leaves nothing behind
+        struct sparse_cell *cell = sparse_board_slot(&board->sparse, row, col);
+        if (cell->row == -1) {
+            return;
+        }
+        if (cell->shot == 0) {
+            sparse_board_erase(&board->sparse, row, col);
+        } else {
+            cell->ship = 0;
+        }
+        return;
+    }
+    if (board->kind == BOARD_BITS) {
+        if (piece_id) {
+            bitboard_set(board->bits.occupied, &board->bits, row, col);
+        } else {
+            bitboard_clear(board->bits.occupied, &board->bits, row, col);
+        }
+        return;
+    }
+    board->ships[board_index(board, row, col)] = piece_id;
+}
+
+static inline int board_get_shot(const struct board *board, int row, int col) {
+    if (board->kind == BOARD_SPARSE) {
+        const struct sparse_cell *cell = sparse_board_find(&board->sparse, row, col);
+        return cell ? cell->shot : EMPTY;
+    }
+    if (board->kind == BOARD_BITS) {
+        if (!bitboard_test(board->bits.shots, &board->bits, row, col)) {
+            return EMPTY;
+        }
+        return bitboard_test(board->bits.occupied, &board->bits, row, col) ? HIT : MISS;
+    }
+    return board->shots[board_index(board, row, col)];
+}
+
+static inline void board_set_shot(struct board *board, int row, int col, int result) {
+    if (board->kind == BOARD_SPARSE) {
+        sparse_board_insert(&board->sparse, row, col)->shot = result;
+        return;
+    }
+    if (board->kind == BOARD_BITS) {
+        bitboard_set(board->bits.shots, &board->bits, row, col);
+        return;
+    }
+    board->shots[board_index(board, row, col)] = result;
+}
+
+// Makes room for `cells` more cells to be set. Only sparse boards can fail.
+static inline int board_reserve(struct board *board, size_t cells) {
+    if (board->kind != BOARD_SPARSE) {
+        return 0;
+    }
+    return sparse_board_reserve(&board->sparse, cells);
+}
+
+// Scratch layer that a volley at a bitboard is marked in before it is merged
+// into the board. There is one per thread, as large as the largest bitboard
+// it fired at, and it is left clear between volleys. The key frees it when
+// the thread exits.
+static _Thread_local uint64_t *bitboard_volley;
+static _Thread_local size_t bitboard_volley_words;
+static pthread_key_t bitboard_volley_key;
+static pthread_once_t bitboard_volley_once = PTHREAD_ONCE_INIT;
+
+static void bitboard_volley_create_key(void) {
+    pthread_key_create(&bitboard_volley_key, free);
+}
+
+static inline int bitboard_volley_reserve(const struct bitboard *board) {
+    size_t words = bitboard_layer_words(board->width, board->height);
+    if (words <= bitboard_volley_words) {
+        return 0;
+    }
+    uint64_t *layer = calloc(words, sizeof(uint64_t));
+    if (!layer) {
+        return -1;
+    }
+    pthread_once(&bitboard_volley_once, bitboard_volley_create_key);
+    free(bitboard_volley);
+    pthread_setspecific(bitboard_volley_key, layer);
+    bitboard_volley = layer;
+    bitboard_volley_words = words;
+    return 0;
+}
+
+// Makes room for `shots` more shots to be fired at the board.
+static inline int board_reserve_shots(struct board *board, size_t shots) {
+    if (board_reserve(board, shots) != 0) {
+        return -1;
+    }
+    return shot_log_reserve(&board->log, shots);
+}
+
+// Picks the storage for a new board: sparse above the area threshold,
+// otherwise the layout chosen on the command line.
+static inline enum board_kind board_kind_for(int width, int height) {
+    if ((long long)width * height > sparse_area_threshold) {
+        return BOARD_SPARSE;
+    }
+    return board_storage;
+}
+
+// Bytes used by the two layers of one board, or by an empty sparse board.
+static inline size_t board_storage_size(enum board_kind kind, int width, int height) {
+    if (kind == BOARD_SPARSE) {
+        return SPARSE_BOARD_MIN_CAPACITY * sizeof(struct sparse_cell);
+    }
+    if (kind == BOARD_BITS) {
+        return 2 * bitboard_layer_words(width, height) * sizeof(uint64_t);
+    }
+    return 2 * (size_t)width * height;
+}
+
+// Lays out `count` dense boards back to back in a single zeroed allocation,
+// taken from `pool` unless it is NULL. Sparse boards get one table each.
+static inline int initialize_boards_in(struct buffer_pool *pool, struct board *boards, int count, int width, int height,
+                                       enum board_kind kind) {
+    if (width <= 0 || height <= 0) {
+        return -1;
+    }
+    if (kind == BOARD_SPARSE) {
+        for (int i = 0; i < count; i++) {
+            memset(&boards[i], 0, sizeof(boards[i]));
+            boards[i].kind = kind;
+            boards[i].width = width;
+            boards[i].height = height;
+            if (sparse_board_init(&boards[i].sparse, SPARSE_BOARD_MIN_CAPACITY) != 0) {
+                while (i-- > 0) {
+                    sparse_board_free(&boards[i].sparse);
+                }
+                return -1;
+            }
+        }
+        return 0;
+    }
+    if ((size_t)width * height > SIZE_MAX / 4 / count) {
+        return -1;
+    }
+    size_t size = board_storage_size(kind, width, height);
+    uint8_t *memory = pool ? buffer_pool_get(pool, count * size) : calloc(count, size);
+    if (!memory) {
+        return -1;
+    }
+    for (int i = 0; i < count; i++) {
+        struct board *board = &boards[i];
+        uint8_t *base = memory + i * size;
+
+        memset(board, 0, sizeof(*board));
+        board->kind = kind;
+        board->width = width;
+        board->height = height;
+        board->allocation = i == 0 ? memory : NULL;
+        if (kind == BOARD_BITS) {
+            size_t words = bitboard_layer_words(width, height);
+            board->bits.width = width;
+            board->bits.height = height;
+            board->bits.words_per_row = bitboard_words_per_row(width);
+            board->bits.occupied = (uint64_t *)base;
+            board->bits.shots = board->bits.occupied + words;
+        } else {
+            board->ships = base;
+            board->shots = base + size / 2;
+        }
+    }
+    return 0;
+}
+
+static inline int initialize_boards(struct board *boards, int count, int width, int height, enum board_kind kind) {
+    return initialize_boards_in(NULL, boards, count, width, height, kind);
+}
+
+static inline int initialize_board(struct board *board, int width, int height, enum board_kind kind) {
+    return initialize_boards(board, 1, width, height, kind);
+}
+
+// Empties a board for another game of the same size, keeping its memory. Only
+// the cells the last game wrote are cleared, the fleet's and those in the
+// shot log, so a large board costs no more to reuse than a small one.
+static inline void clear_board(struct board *board) {
+    if (board->kind == BOARD_SPARSE) {
+        sparse_board_clear(&board->sparse);
+    } else {
+        for (uint32_t seq = 0; seq < board->log.count; seq++) {
+            const uint8_t *record = board->log.records + (size_t)seq * WIRE_SHOT_SIZE;
+            int row = (int)(wire_get_u32(record) & ~WIRE_SHOT_HIT);
+            int col = wire_get_i32(record + 4);
+
+            if (board->kind == BOARD_BITS) {
+                bitboard_clear(board->bits.shots, &board->bits, row, col);
+            } else {
+                board->shots[board_index(board, row, col)] = EMPTY;
+            }
+        }
+        for (int piece = 0; piece < FLEET_SIZE; piece++) {
+            if (board->placed_pieces & (1u << piece)) {
+                for (int i = 0; i < 4; i++) {
+                    board_set_ship(board, board->piece_coords[piece][i][0], board->piece_coords[piece][i][1], 0);
+                }
+            }
+        }
+    }
+    board->log.count = 0;
+    board->log.text_length = 0;
+    board->log.text_count = 0;
+    board->placed_pieces = 0;
+    memset(board->piece_cells, 0, sizeof(board->piece_cells));
+    board->ships_afloat = 0;
+}
+
+// Logs the board at debug level, one message per row (split when a row is
+// longer than a message).
+static inline void print_board(const struct board *board) {
+    char line[LOG_MESSAGE_SIZE];
+    size_t length = 0;
+
+    if (!log_enabled(LOG_DEBUG)) {
+        return;
+    }
+    log_debug("Current Board State:");
+    if (board->kind == BOARD_SPARSE) {
+        // Far too large to draw, so list the cells of each piece instead
+        for (int piece = 0; piece < FLEET_SIZE; piece++) {
+            if (board->placed_pieces & (1u << piece)) {
+                const int (*cells)[2] = board->piece_coords[piece];
+                log_debug("Piece %d: (%d, %d) (%d, %d) (%d, %d) (%d, %d)", piece + 1, cells[0][0], cells[0][1],
+                          cells[1][0], cells[1][1], cells[2][0], cells[2][1], cells[3][0], cells[3][1]);
+            }
+        }
+        log_debug("%s", "");
+        return;
+    }
+    for (int i = 0; i < board->height; i++) {
+        for (int j = 0; j < board->width; j++) {
+            if (length + 4 > sizeof(line)) {
+                log_debug("%s", line);
+                length = 0;
+            }
+            length += snprintf(line + length, sizeof(line) - length, "%2d ", board_get_ship(board, i, j));
+        }
+        log_debug("%s", line);
+        length = 0;
+    }
+    log_debug("%s", "");
+}
+
+static inline void free_board(struct board *board) {
+    if (board->kind == BOARD_SPARSE) {
+        sparse_board_free(&board->sparse);
+    }
+    shot_log_free(&board->log);
+    free(board->allocation);
+    memset(board, 0, sizeof(*board));
+}
+
+// Every orientation of every piece, indexed by 0-based piece type and
+// rotation. Rotations 0 and 1 are both the base shape, and each further one
+// turns it a quarter (row, col) -> (col, -row), as placements always have.
+// The bounds of each orientation let a placement be checked against the board
+// edges with four comparisons.
+struct piece_shape {
+    int8_t cells[4][2];          // (row, col) offsets from the reference cell
+    int8_t min_row;
+    int8_t max_row;
+    int8_t min_col;
+    int8_t max_col;
+};
+
+static const struct piece_shape piece_shapes[7][4] = {
+    {   // O-piece
+        {{{0, 0}, {0, 1}, {1, 0}, {1, 1}}, 0, 1, 0, 1},
+        {{{0, 0}, {0, 1}, {1, 0}, {1, 1}}, 0, 1, 0, 1},
+        {{{0, 0}, {1, 0}, {0, -1}, {1, -1}}, 0, 1, -1, 0},
+        {{{0, 0}, {0, -1}, {-1, 0}, {-1, -1}}, -1, 0, -1, 0},
+    },
+    {   // I-piece
+        {{{0, 0}, {1, 0}, {2, 0}, {3, 0}}, 0, 3, 0, 0},
+        {{{0, 0}, {1, 0}, {2, 0}, {3, 0}}, 0, 3, 0, 0},
+        {{{0, 0}, {0, -1}, {0, -2}, {0, -3}}, 0, 0, -3, 0},
+        {{{0, 0}, {-1, 0}, {-2, 0}, {-3, 0}}, -3, 0, 0, 0},
+    },
+    {   // S-piece
+        {{{0, 0}, {0, 1}, {1, 1}, {1, 2}}, 0, 1, 0, 2},
+        {{{0, 0}, {0, 1}, {1, 1}, {1, 2}}, 0, 1, 0, 2},
+        {{{0, 0}, {1, 0}, {1, -1}, {2, -1}}, 0, 2, -1, 0},
+        {{{0, 0}, {0, -1}, {-1, -1}, {-1, -2}}, -1, 0, -2, 0},
+    },
+    {   // L-piece
+        {{{0, 0}, {1, 0}, {2, 0}, {2, 1}}, 0, 2, 0, 1},
+        {{{0, 0}, {1, 0}, {2, 0}, {2, 1}}, 0, 2, 0, 1},
+        {{{0, 0}, {0, -1}, {0, -2}, {1, -2}}, 0, 1, -2, 0},
+        {{{0, 0}, {-1, 0}, {-2, 0}, {-2, -1}}, -2, 0, -1, 0},
+    },
+    {   // Z-piece
+        {{{0, 1}, {0, 0}, {1, 1}, {1, 2}}, 0, 1, 0, 2},
+        {{{0, 1}, {0, 0}, {1, 1}, {1, 2}}, 0, 1, 0, 2},
+        {{{1, 0}, {0, 0}, {1, -1}, {2, -1}}, 0, 2, -1, 0},
+        {{{0, -1}, {0, 0}, {-1, -1}, {-1, -2}}, -1, 0, -2, 0},
+    },
+    {   // J-piece
+        {{{0, 0}, {1, 0}, {2, 0}, {2, -1}}, 0, 2, -1, 0},
+        {{{0, 0}, {1, 0}, {2, 0}, {2, -1}}, 0, 2, -1, 0},
+        {{{0, 0}, {0, -1}, {0, -2}, {-1, -2}}, -1, 0, -2, 0},
+        {{{0, 0}, {-1, 0}, {-2, 0}, {-2, 1}}, -2, 0, 0, 1},
+    },
+    {   // T-piece
+        {{{0, 0}, {1, -1}, {1, 0}, {1, 1}}, 0, 1, -1, 1},
+        {{{0, 0}, {1, -1}, {1, 0}, {1, 1}}, 0, 1, -1, 1},
+        {{{0, 0}, {-1, -1}, {0, -1}, {1, -1}}, -1, 1, -1, 0},
+        {{{0, 0}, {-1, 1}, {-1, 0}, {-1, -1}}, -1, 0, -1, 1},
+    },
+};
+
+static inline void get_piece_coordinates(int piece_type, int rotation, int ref_row, int ref_col, int coords[4][2]) {
+    const struct piece_shape *shape = &piece_shapes[piece_type][rotation];
+
+    for (int i = 0; i < 4; i++) {
+        coords[i][0] = ref_row + shape->cells[i][0];
+        coords[i][1] = ref_col + shape->cells[i][1];
+    }
+}
+
+// Whether the whole piece lies on a `width` x `height` board.
+static inline bool piece_in_bounds(int piece_type, int rotation, int ref_row, int ref_col, int width, int height) {
+    const struct piece_shape *shape = &piece_shapes[piece_type][rotation];
+
+    return ref_row + shape->min_row >= 0 && ref_row + shape->max_row < height &&
+           ref_col + shape->min_col >= 0 && ref_col + shape->max_col < width;
+}
+
+// Checks a piece's footprint against the board. Returns 302 or 303 for the
+// first block that is out of bounds or overlaps a placed piece (stored in
+// `block`), or 0 if the piece fits. `fits` says the whole piece is known to be
+// on the board, which skips the per-block bounds checks. Bitboards test all
+// in-bounds blocks at once and only look for the offending block when there
+// is one.
+static inline int check_footprint(const struct board *board, const int coords[4][2], bool fits, int *block) {
+    int in_bounds = fits ? 4 : 0;
+    while (in_bounds < 4 && board_in_bounds(board, coords[in_bounds][0], coords[in_bounds][1])) {
+        in_bounds++;
+    }
+
+    if (board->kind != BOARD_BITS || bitboard_footprint_overlaps(&board->bits, board->bits.occupied, coords, in_bounds)) {
+        for (int i = 0; i < in_bounds; i++) {
+            if (board_is_occupied(board, coords[i][0], coords[i][1])) {
+                *block = i;
+                return 303;
+            }
+        }
+    }
+
+    *block = in_bounds;
+    return in_bounds < 4 ? 302 : 0;
+}
+
+static inline int place_piece(struct board *board, int piece_type, int rotation, int ref_row, int ref_col, int piece_id) {
+    int coords[4][2];
+    int block;
+    get_piece_coordinates(piece_type, rotation, ref_row, ref_col, coords);
+
+    // First pass: Validate the piece's placement
+    bool fits = piece_in_bounds(piece_type, rotation, ref_row, ref_col, board->width, board->height);
+    int error_code = check_footprint(board, coords, fits, &block);
+    if (error_code == 302) {
+        log_debug("[Server] Block %d of piece %d is out of bounds at (%d, %d)", block, piece_type, coords[block][0], coords[block][1]);
+        return 302;  // Return error if even one block is out of bounds
+    }
+    if (error_code == 303) {
+        log_debug("[Server] Block %d of piece %d overlaps at (%d, %d)", block, piece_type, coords[block][0], coords[block][1]);
+        return 303;  // Return error if the block overlaps an existing piece
+    }
+
+    // Second pass: Place the piece on the board
+    for (int i = 0; i < 4; i++) {
+        int row = coords[i][0];
+        int col = coords[i][1];
+        board_set_ship(board, row, col, piece_id);
+        board->piece_coords[piece_id - 1][i][0] = row;
+        board->piece_coords[piece_id - 1][i][1] = col;
+        log_debug("[Server] Placed block %d of piece %d at (%d, %d)", i, piece_type, row, col);
+    }
+
+    // Track the new piece in the fleet
+    board->placed_pieces |= 1u << (piece_id - 1);
+    if (board->piece_cells[piece_id - 1] == 0) {
+        board->ships_afloat++;
+    }
+    board->piece_cells[piece_id - 1] += 4;
+
+    return 0;  // Success
+}
+
+// Returns 0 if the piece can be placed, 302 if any block is off the board and
+// otherwise 303. Unlike place_piece(), off-board pieces are rejected from the
+// piece bounds alone, before the board is read.
+static inline int validate_piece_placement(const struct board *board, int piece_type, int rotation, int ref_row, int ref_col) {
+    int coords[4][2];
+    int block;
+
+    if (!piece_in_bounds(piece_type, rotation, ref_row, ref_col, board->width, board->height)) {
+        return 302;
+    }
+    get_piece_coordinates(piece_type, rotation, ref_row, ref_col, coords);
+    return check_footprint(board, coords, true, &block);
+}
+
+// Takes the piece with `piece_id` off the board again.
+static inline void remove_piece(struct board *board, int piece_id) {
+    for (int i = 0; i < 4; i++) {
+        board_set_ship(board, board->piece_coords[piece_id - 1][i][0], board->piece_coords[piece_id - 1][i][1], 0);
+    }
+    board->placed_pieces &= ~(1u << (piece_id - 1));
+    if (board->piece_cells[piece_id - 1] != 0) {
+        board->ships_afloat--;
+    }
+    board->piece_cells[piece_id - 1] = 0;
+}
+
+/*
+ * Fleets and shots.
+ */
+
+// Places the fleet straight on the player's empty board and takes it off again
+// if any piece is rejected, so no scratch board is needed. Returns 0, or the
+// lowest error code over all pieces.
+static inline int initialize_fleet(struct board *board, const struct packet *packet) {
+    const struct piece_placement *pieces = packet->pieces;
+    int lowest_error = 0;
+
+    // Validate the number and format of the parameters
+    if (!packet->well_formed) {
+        return 201;
+    }
+
+    // Validate each piece
+    for (int i = 0; i < FLEET_SIZE; i++) {
+        int piece_type = pieces[i].piece_type - 1;
+        int rotation = pieces[i].rotation - 1;
+        int error_code = 0;
+
+        if (piece_type < 0 || piece_type >= 7) {
+            error_code = 300;
+        } else if (rotation < 0 || rotation >= 4) {
+            error_code = 301;
+        } else {
+            error_code = place_piece(board, piece_type, rotation, pieces[i].ref_row, pieces[i].ref_col, i + 1);
+        }
+        if (error_code && (lowest_error == 0 || lowest_error > error_code)) {
+            lowest_error = error_code;
+        }
+    }
+
+    // If any validation error occurred, undo the placed pieces
+    if (lowest_error != 0) {
+        for (int i = 0; i < FLEET_SIZE; i++) {
+            if (board->placed_pieces & (1u << i)) {
+                remove_piece(board, i + 1);
+            }
+        }
+    }
+    return lowest_error;
+}
+
+static inline int is_ship_sunk(const struct board *board, int piece_id) {
+    return board->piece_cells[piece_id - 1] == 0;
+}
+
+static inline int count_remaining_ships(const struct board *opponent_board) {
+    return opponent_board->ships_afloat;
+}
+
+// Fires one shot at the opponent's board, which has room reserved for it.
+// Returns 0 and stores 'H' or 'M' in `*result`, or the error code of a shot
+// that cannot be taken.
+static inline int fire_shot(struct board *opponent_board, int row, int col, char *result) {
+    // Check if the coordinates are out of bounds
+    if (!board_in_bounds(opponent_board, row, col)) {
+        log_debug("[Server] Out-of-bounds coordinates: row=%d, col=%d (board: %dx%d)", row, col, opponent_board->width, opponent_board->height);
+        return 400;  // Shot is out of bounds
+    }
+
+    // Check if the cell has already been shot at
+    if (board_get_shot(opponent_board, row, col) != EMPTY) {
+        log_debug("[Server] Cell already shot at: row=%d, col=%d", row, col);
+        return 401;  // Shot already taken
+    }
+
+    // Determine the result of the shot
+    int piece_id = board_get_ship(opponent_board, row, col);
+    if (piece_id != 0) {
+        // It's a hit
+        *result = 'H';
+        board_set_shot(opponent_board, row, col, HIT);
+        shot_log_append(&opponent_board->log, row, col, true);
+        opponent_board->piece_cells[piece_id - 1]--;
+        log_debug("[Server] Hit detected at row=%d, col=%d (Piece ID: %d)", row, col, piece_id);
+
+        // Check if the hit ship is sunk
+        if (is_ship_sunk(opponent_board, piece_id)) {
+            opponent_board->ships_afloat--;  // Decrement remaining ships if the ship is sunk
+            log_debug("[Server] Ship with ID %d is sunk! Remaining ships: %d", piece_id, opponent_board->ships_afloat);
+        }
+    } else {
+        // It's a miss
+        *result = 'M';
+        board_set_shot(opponent_board, row, col, MISS);
+        shot_log_append(&opponent_board->log, row, col, false);
+        log_debug("[Server] Miss at row=%d, col=%d", row, col);
+    }
+    return 0;
+}
+
+// Fires a volley at a bitboard, which has room reserved for it and for the
+// scratch layer, stopping like a run of fire_shot() calls would. The shots
+// are marked in the scratch layer as they are checked and merged into the board in one pass over the words
+// they touched. Returns the error code of the shot that stopped the volley.
+static inline int fire_volley_bits(struct board *target, const int (*cells)[2], int count, char *results, int *fired) {
+    struct bitboard *bits = &target->bits;
+    size_t first = SIZE_MAX, last = 0;
+    int error = 0;
+
+    while (*fired < count && target->ships_afloat > 0) {
+        int row = cells[*fired][0];
+        int col = cells[*fired][1];
+
+        if (!board_in_bounds(target, row, col)) {
+            log_debug("[Server] Out-of-bounds coordinates: row=%d, col=%d (board: %dx%d)", row, col, target->width, target->height);
+            error = 400;
+            break;
+        }
+        if (bitboard_test(bits->shots, bits, row, col) || bitboard_test(bitboard_volley, bits, row, col)) {
+            log_debug("[Server] Cell already shot at: row=%d, col=%d", row, col);
+            error = 401;
+            break;
+        }
+        bitboard_set(bitboard_volley, bits, row, col);
+        size_t word = bitboard_word(bits, row, col);
+        first = word < first ? word : first;
+        last = word + 1 > last ? word + 1 : last;
+
+        bool hit = bitboard_test(bits->occupied, bits, row, col);
+        results[*fired] = hit ? 'H' : 'M';
+        shot_log_append(&target->log, row, col, hit);
+        if (hit) {
+            int piece_id = bitboard_piece_at(target, row, col);
+            if (--target->piece_cells[piece_id - 1] == 0) {
+                target->ships_afloat--;
+            }
+        }
+        (*fired)++;
+    }
+    if (*fired == 0) {
+        return error;
+    }
+    bitboard_apply_shots(bits, bitboard_volley, first, last);
+    for (int i = 0; i < *fired; i++) {
+        bitboard_clear(bitboard_volley, bits, cells[i][0], cells[i][1]);
+    }
+    return error;
+}
+
+/*
+ * Match rules. A match is driven by applying the players' packets to it in
+ * the order the phases expect them: Player 1 begins, then Player 2, both
+ * initialize in turn, and shooting alternates until a forfeit or until a
+ * fleet is sunk. Each packet yields a struct engine_result telling what to
+ * answer and whether the match is over; nothing is sent or freed here, so a
+ * match can be played in-process as well as over a socket.
+ */
+
+enum engine_reply {
+    ENGINE_REPLY_NONE,           // Nothing to answer; see loser
+    ENGINE_REPLY_ACK,
+    ENGINE_REPLY_ERROR,          // error holds the code
+    ENGINE_REPLY_SHOT,           // remaining_ships and shot
+    ENGINE_REPLY_VOLLEY,         // remaining_ships, error (0 if none), fired and results
+    ENGINE_REPLY_SHOTS           // remaining_ships, and the shots in target's log from since on
+};
+
+struct engine_result {
+    enum engine_reply reply;
+    int error;
+    int remaining_ships;         // Of the opponent's fleet
+    char shot;                   // HIT or MISS
+    int fired;
+    char results[VOLLEY_MAX_SHOTS];
+    struct board *target;
+    uint32_t since;
+    int loser;                   // The player who lost if the packet ended the match, -1 otherwise
+    bool sunk;                   // The loser's fleet was sunk, rather than forfeited
+    bool out_of_memory;          // The packet could not be applied; the match is unchanged
+};
+
+struct engine_match {
+    enum match_phase phase;
+    int board_width;
+    int board_height;
+    struct board boards[2];      // Each player's fleet and the shots it received
+    struct buffer_pool *pool;    // Board storage comes from here, or the heap if NULL
+};
+
+typedef void (*engine_rule)(struct engine_match *match, int player, const struct packet *packet,
+                            struct engine_result *result);
+
+static inline void engine_match_init(struct engine_match *match) {
+    memset(match, 0, sizeof(*match));
+    match->phase = PHASE_BEGIN_P1;
+}
+
+// Frees the boards but keeps the buffers of their shot logs, emptied, for the
+// next game or the next match played in this struct. Storage from the pool
+// goes back to it cleared.
+static inline void engine_match_recycle(struct engine_match *match) {
+    struct board *boards = match->boards;
+
+    if (match->pool && boards[0].allocation) {
+        size_t size = 2 * board_storage_size(boards[0].kind, boards[0].width, boards[0].height);
+        if (buffer_pool_class(size) >= 0) {
+            clear_board(&boards[0]);
+            clear_board(&boards[1]);
+        }
+        buffer_pool_put(match->pool, boards[0].allocation, size);
+        boards[0].allocation = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct shot_log log = boards[i].log;
+
+        log.count = 0;
+        log.text_length = 0;
+        log.text_count = 0;
+        boards[i].log = (struct shot_log){0};
+        free_board(&boards[i]);
+        boards[i].log = log;
+    }
+}
+
+static inline void engine_match_free(struct engine_match *match) {
+    engine_match_recycle(match);
+    for (int i = 0; i < 2; i++) {
+        shot_log_free(&match->boards[i].log);
+    }
+}
+
+// Starts another game in the same match. The boards are kept, and reused if
+// the next game is played on the same size.
+static inline void engine_match_reset(struct engine_match *match) {
+    match->phase = PHASE_BEGIN_P1;
+}
+
+// The player whose packet the match is waiting for, or -1 once it is over.
+static inline int engine_expected_player(const struct engine_match *match) {
+    switch (match->phase) {
+    case PHASE_BEGIN_P1:
+    case PHASE_INIT_P1:
+    case PHASE_TURN_P1:
+        return 0;
+    case PHASE_BEGIN_P2:
+    case PHASE_INIT_P2:
+    case PHASE_TURN_P2:
+        return 1;
+    default:
+        return -1;
+    }
+}
+
+static inline void engine_reply_error(struct engine_result *result, int code) {
+    result->reply = ENGINE_REPLY_ERROR;
+    result->error = code;
+}
+
+static inline void apply_begin_p1(struct engine_match *match, int player, const struct packet *packet,
+                                  struct engine_result *result) {
+    (void)player;
+    if (!packet->well_formed) {  // Malformed "B" packet
+        engine_reply_error(result, 200);
+        log_warn("[Server] Malformed Begin packet received from Player 1");
+        return;
+    }
+    if (packet->begin.width < 10 || packet->begin.height < 10) {  // Invalid dimensions
+        engine_reply_error(result, 200);
+        log_warn("[Server] Invalid board dimensions received from Player 1");
+        return;
+    }
+
+    match->board_width = packet->begin.width;
+    match->board_height = packet->begin.height;
+    result->reply = ENGINE_REPLY_ACK;
+    log_info("[Server] Board initialized with size %dx%d", match->board_width, match->board_height);
+    match->phase = PHASE_BEGIN_P2;
+    log_info("[Server] Waiting for valid Begin or Forfeit packet from Player 2...");
+}
+
+static inline void apply_begin_p2(struct engine_match *match, int player, const struct packet *packet,
+                                  struct engine_result *result) {
+    (void)player;
+    // Validate Player 2's packet strictly: "B" alone
+    if (packet->has_parameters) {
+        engine_reply_error(result, 200);
+        log_warn("[Server] Invalid Begin packet format for Player 2: extra parameters");
+        return;
+    }
+    if (!packet->bare) {
+        engine_reply_error(result, 100);
+        log_warn("[Server] Invalid packet type received from Player 2 during Begin phase");
+        return;
+    }
+
+    // Initialize the boards after both players send valid Begin packets. The
+    // boards of an earlier game in the match are reused if the size matches.
+    enum board_kind kind = board_kind_for(match->board_width, match->board_height);
+    const struct board *previous = &match->boards[0];
+    if (previous->width == match->board_width && previous->height == match->board_height && previous->kind == kind) {
+        clear_board(&match->boards[0]);
+        clear_board(&match->boards[1]);
+    } else {
+        struct shot_log logs[2];
+
+        engine_match_recycle(match);
+        for (int i = 0; i < 2; i++) {
+            logs[i] = match->boards[i].log;
+        }
+        int status = initialize_boards_in(match->pool, match->boards, 2, match->board_width, match->board_height, kind);
+        for (int i = 0; i < 2; i++) {
+            match->boards[i].log = logs[i];
+        }
+        if (status != 0) {
+            result->out_of_memory = true;
+            return;
+        }
+    }
+    result->reply = ENGINE_REPLY_ACK;
+    log_info("[Server] Valid Begin packet received from Player 2");
+    if (kind == BOARD_SPARSE) {
+        log_info("[Server] Using sparse boards for %dx%d", match->board_width, match->board_height);
+    }
+    match->phase = PHASE_INIT_P1;
+    log_info("[Server] Waiting for valid Initialize or Forfeit packet from Player 1...");
+}
+
+static inline void apply_setup_forfeit(struct engine_match *match, int player, const struct packet *packet,
+                                       struct engine_result *result) {
+    (void)packet;
+    log_info("[Server] Player %d forfeited during %s phase. Game halted.", player + 1,
+           match->phase <= PHASE_BEGIN_P2 ? "Begin" : "Initialize");
+    result->loser = player;
+    match->phase = PHASE_HALT;
+}
+
+static inline void apply_setup_initialize(struct engine_match *match, int player, const struct packet *packet,
+                                          struct engine_result *result) {
+    // A sparse board may need room for the fleet
+    if (board_reserve(&match->boards[player], FLEET_SIZE * 4) != 0) {
+        result->out_of_memory = true;
+        return;
+    }
+    int error = initialize_fleet(&match->boards[player], packet);
+    if (error != 0) {
+        engine_reply_error(result, error);
+        return;
+    }
+    result->reply = ENGINE_REPLY_ACK;
+    log_info("[Server] Player %d's board initialized successfully.", player + 1);
+    print_board(&match->boards[player]);
+
+    if (player == 0) {
+        match->phase = PHASE_INIT_P2;
+        log_info("[Server] Waiting for valid Initialize or Forfeit packet from Player 2...");
+        return;
+    }
+
+    log_info("[Server] Both players have successfully initialized their boards.");
+    match->phase = PHASE_TURN_P1;
+}
+
+// Passes the turn once shots were fired, or ends the match if they sank the
+// last ship.
+static inline void engine_after_shots(struct engine_match *match, int player, struct engine_result *result) {
+    int opponent = 1 - player;
+
+    if (result->remaining_ships == 0) {
+        log_info("[Server] All ships sunk. Ending game.");
+        result->loser = opponent;
+        result->sunk = true;
+        match->phase = PHASE_HALT;
+        return;
+    }
+    match->phase = opponent == 0 ? PHASE_TURN_P1 : PHASE_TURN_P2;
+}
+
+static inline void apply_turn_shoot(struct engine_match *match, int player, const struct packet *packet,
+                                    struct engine_result *result) {
+    struct board *target = &match->boards[1 - player];
+
+    // Validate the format of the parameters
+    if (!packet->well_formed) {
+        log_debug("[Server] Invalid shoot packet format: '%s'", packet->text);
+        engine_reply_error(result, 202);  // Invalid number of parameters
+        return;
+    }
+    // Make room to record the shot
+    if (board_reserve_shots(target, 1) != 0) {
+        result->out_of_memory = true;
+        return;
+    }
+
+    int error = fire_shot(target, packet->shot.row, packet->shot.col, &result->shot);
+    if (error != 0) {
+        engine_reply_error(result, error);
+        return;
+    }
+    result->reply = ENGINE_REPLY_SHOT;
+    result->remaining_ships = count_remaining_ships(target);
+    log_debug("[Server] Shot result: R %d %c", result->remaining_ships, result->shot);
+    engine_after_shots(match, player, result);
+}
+
+// Fires the shots of a volley in order, stopping at the first one that cannot
+// be taken or once the last ship is sunk. The turn passes only if at least one
+// shot was fired.
+static inline void apply_turn_volley(struct engine_match *match, int player, const struct packet *packet,
+                                     struct engine_result *result) {
+    struct board *target = &match->boards[1 - player];
+
+    if (!packet->well_formed) {
+        log_debug("[Server] Invalid volley packet format: '%s'", packet->text);
+        engine_reply_error(result, 202);  // Invalid number of parameters
+        return;
+    }
+    // Make room to record every shot, and to mark them on a bitboard
+    if (board_reserve_shots(target, packet->volley.count) != 0 ||
+        (target->kind == BOARD_BITS && bitboard_volley_reserve(&target->bits) != 0)) {
+        result->out_of_memory = true;
+        return;
+    }
+
+    if (target->kind == BOARD_BITS) {
+        result->error = fire_volley_bits(target, packet->volley.cells, packet->volley.count, result->results, &result->fired);
+    } else {
+        while (result->fired < packet->volley.count && count_remaining_ships(target) > 0) {
+            const int *cell = packet->volley.cells[result->fired];
+            result->error = fire_shot(target, cell[0], cell[1], &result->results[result->fired]);
+            if (result->error != 0) {
+                break;
+            }
+            result->fired++;
+        }
+    }
+    result->reply = ENGINE_REPLY_VOLLEY;
+    result->remaining_ships = count_remaining_ships(target);
+    log_debug("[Server] Volley of %d shots stopped after %d (error %d)", packet->volley.count, result->fired, result->error);
+    if (result->fired > 0) {
+        engine_after_shots(match, player, result);
+    }
+}
+
+static inline void apply_turn_query(struct engine_match *match, int player, const struct packet *packet,
+                                    struct engine_result *result) {
+    result->reply = ENGINE_REPLY_SHOTS;
+    result->target = &match->boards[1 - player];
+    result->remaining_ships = count_remaining_ships(result->target);
+    result->since = packet->since;
+}
+
+static inline void apply_turn_forfeit(struct engine_match *match, int player, const struct packet *packet,
+                                      struct engine_result *result) {
+    (void)packet;
+    log_info("[Server] Player %d forfeited. Game halted.", player + 1);
+    result->loser = player;
+    match->phase = PHASE_HALT;
+}
+
+// What each phase does with each kind of packet. A kind without a rule is
+// answered with the error of the phase.
+static const engine_rule phase_rules[PHASE_HALT][PACKET_KINDS] = {
+    [PHASE_BEGIN_P1] = {
+        [PACKET_BEGIN] = apply_begin_p1,
+        [PACKET_FORFEIT] = apply_setup_forfeit,
+    },
+    [PHASE_BEGIN_P2] = {
+        [PACKET_BEGIN] = apply_begin_p2,
+        [PACKET_FORFEIT] = apply_setup_forfeit,
+    },
+    [PHASE_INIT_P1] = {
+        [PACKET_INITIALIZE] = apply_setup_initialize,
+        [PACKET_FORFEIT] = apply_setup_forfeit,
+    },
+    [PHASE_INIT_P2] = {
+        [PACKET_INITIALIZE] = apply_setup_initialize,
+        [PACKET_FORFEIT] = apply_setup_forfeit,
+    },
+    [PHASE_TURN_P1] = {
+        [PACKET_SHOOT] = apply_turn_shoot,
+        [PACKET_VOLLEY] = apply_turn_volley,
+        [PACKET_QUERY] = apply_turn_query,
+        [PACKET_FORFEIT] = apply_turn_forfeit,
+    },
+    [PHASE_TURN_P2] = {
+        [PACKET_SHOOT] = apply_turn_shoot,
+        [PACKET_VOLLEY] = apply_turn_volley,
+        [PACKET_QUERY] = apply_turn_query,
+        [PACKET_FORFEIT] = apply_turn_forfeit,
+    },
+};
+
+static const int phase_errors[PHASE_HALT] = {
+    [PHASE_BEGIN_P1] = 100,
+    [PHASE_BEGIN_P2] = 100,
+    [PHASE_INIT_P1] = 101,
+    [PHASE_INIT_P2] = 101,
+    [PHASE_TURN_P1] = 102,
+    [PHASE_TURN_P2] = 102,
+};
+
+// Applies a packet from `player`, who must be the expected player, and
+// describes the outcome in `result`. Nothing is applied once the match is over.
+static inline void engine_apply(struct engine_match *match, int player, const struct packet *packet,
+                                struct engine_result *result) {
+    result->reply = ENGINE_REPLY_NONE;
+    result->error = 0;
+    result->fired = 0;
+    result->loser = -1;
+    result->sunk = false;
+    result->out_of_memory = false;
+    if (match->phase == PHASE_HALT) {
+        return;
+    }
+
+    engine_rule rule = phase_rules[match->phase][packet->kind];
+    if (rule) {
+        rule(match, player, packet, result);
+        return;
+    }
+    engine_reply_error(result, phase_errors[match->phase]);
+    if (match->phase <= PHASE_BEGIN_P2) {
+        log_warn("[Server] Invalid packet type received from Player %d during Begin phase", player + 1);
+    }
+}
+
+/*
+ * Typed entry points for callers that do not decode packets, such as bots and
+ * simulations. Each fills in the packet a well-formed message decodes to.
+ */
+
+static inline void engine_packet(struct packet *packet, enum packet_kind kind, const char *text, bool bare) {
+    packet->kind = kind;
+    packet->text = text;
+    packet->bare = bare;
+    packet->has_parameters = !bare;
+    packet->well_formed = true;
+}
+
+// Player 2's Begin carries no dimensions; width and height are ignored.
+static inline void engine_begin(struct engine_match *match, int player, int width, int height,
+                                struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_BEGIN, "B", player == 1);
+    packet.well_formed = player == 0;
+    packet.begin.width = width;
+    packet.begin.height = height;
+    engine_apply(match, player, &packet, result);
+}
+
+static inline void engine_initialize(struct engine_match *match, int player,
+                                     const struct piece_placement pieces[FLEET_SIZE], struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_INITIALIZE, "I", false);
+    memcpy(packet.pieces, pieces, sizeof(packet.pieces));
+    engine_apply(match, player, &packet, result);
+}
+
+static inline void engine_shoot(struct engine_match *match, int player, int row, int col,
+                                struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_SHOOT, "S", false);
+    packet.shot.row = row;
+    packet.shot.col = col;
+    engine_apply(match, player, &packet, result);
+}
+
+// Takes from 1 to VOLLEY_MAX_SHOTS cells.
+static inline void engine_volley(struct engine_match *match, int player, const int (*cells)[2], int count,
+                                 struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_VOLLEY, "V", false);
+    packet.well_formed = count > 0 && count <= VOLLEY_MAX_SHOTS;
+    packet.volley.count = packet.well_formed ? count : 0;
+    memcpy(packet.volley.cells, cells, packet.volley.count * sizeof(cells[0]));
+    engine_apply(match, player, &packet, result);
+}
+
+// Asks for the shots fired at the opponent from sequence number `since` on.
+static inline void engine_query(struct engine_match *match, int player, uint32_t since,
+                                struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_QUERY, "Q", since == 0);
+    packet.since = since;
+    engine_apply(match, player, &packet, result);
+}
+
+static inline void engine_forfeit(struct engine_match *match, int player, struct engine_result *result) {
+    struct packet packet;
+
+    engine_packet(&packet, PACKET_FORFEIT, "F", true);
+    engine_apply(match, player, &packet, result);
+}
+
+#endif
@@ -0,0 +1,87 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear histogram in the style of HDR histograms. Values are grouped by
+ * power of two, and each power of two is split into HISTOGRAM_SUB_BUCKETS
+ * linear buckets, so a reported percentile is within 1/HISTOGRAM_SUB_BUCKETS
+ * (about 3%) of the recorded value. Recording is a handful of instructions
+ * and the size is fixed whatever the range of the values.
+ */
+
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline int histogram_index(uint64_t value) {
+    if (value < HISTOGRAM_SUB_BUCKETS) {
+        return (int)value;
+    }
+    int shift = 63 - __builtin_clzll(value) - HISTOGRAM_SUB_BITS;
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS + (int)((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+}
+
+// The largest value that falls in bucket `index`.
+static inline uint64_t histogram_bucket_limit(int index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+        return index;
+    }
+    int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    uint64_t sub = index % HISTOGRAM_SUB_BUCKETS + HISTOGRAM_SUB_BUCKETS;
+    return ((sub + 1) << shift) - 1;
+}
+
+static inline void histogram_reset(struct histogram *histogram) {
+    memset(histogram, 0, sizeof(*histogram));
+}
+
+static inline void histogram_record(struct histogram *histogram, uint64_t value) {
+    histogram->buckets[histogram_index(value)]++;
+    histogram->count++;
+    histogram->sum += value;
+    if (value > histogram->max) {
+        histogram->max = value;
+    }
+}
+
+static inline void histogram_merge(struct histogram *into, const struct histogram *from) {
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        into->buckets[i] += from->buckets[i];
+    }
+    into->count += from->count;
+    into->sum += from->sum;
+    if (from->max > into->max) {
+        into->max = from->max;
+    }
+}
+
+// The value below which `percentile` percent of the recorded values fall,
+// rounded up to the end of its bucket.
+static inline uint64_t histogram_percentile(const struct histogram *histogram, double percentile) {
+    uint64_t rank = (uint64_t)(histogram->count * percentile / 100.0 + 0.5);
+    uint64_t seen = 0;
+
+    if (rank == 0) {
+        rank = 1;
+    }
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t limit = histogram_bucket_limit(i);
+            return limit < histogram->max ? limit : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+#endif
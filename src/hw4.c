@@ -1,738 +1,2658 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <asm-generic/socket.h>
 
+#include "engine.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
+#include "record.h"
+#include "shot_log.h"
+#include "uring.h"
+#include "wire.h"
+
+#define PORT_LOBBY 2200
 #define PORT_PLAYER1 2201
 #define PORT_PLAYER2 2202
+#define SEAT_LOBBY -1      // Listener seat of the lobby port
 #define BUFFER_SIZE 1024
-#define HIT 'H'
-#define MISS 'M'
-#define EMPTY 0
+#define CONN_BUFFER_SIZE 4096
+#define CONN_RING_SIZE 4096  // Must be a power of two
+#define CONN_CHUNK_SIZE 65536        // Output queued behind the inline buffer
+#define CONN_OUTPUT_LIMIT (64u << 20)  // Unsent backlog that drops a connection
+#define CONN_IOV_MAX 16
+#define MAX_EVENTS 256
+#define ACCEPT_BATCH 64      // Connections accepted per listener event
+#define LOBBY_CLASSES 29     // Any size, then one per power of two from 8
+#define URING_ENTRIES 1024           // Submission slots of a worker's ring
+#define URING_RECV_BUFFERS 1024      // Provided receive buffers per worker, a power of two
+#define URING_RECV_BUFFER_SIZE 2048
+#define URING_RECV_GROUP 0
+
+enum endpoint_kind {
+    ENDPOINT_LISTENER,
+    ENDPOINT_CONN
+};
 
-int **initialize_board(int width, int height) {
-    int **board = malloc(height * sizeof(int *));
-    if (!board) {
-        return NULL;
+enum io_backend {
+    IO_EPOLL,          // Readiness events, then recv() and sendmsg() per socket
+    IO_URING           // Multishot receives and batched sends through io_uring
+};
+
+// What an io_uring completion is for, kept in the low bits of its user data
+// next to the listener or connection it concerns
+enum uring_op {
+    URING_ACCEPT,
+    URING_RECV,
+    URING_SEND,
+    URING_CANCEL       // Carries no pointer
+};
+#define URING_OP_MASK 3
+
+
+enum halt_state {
+    HALT_DONE,
+    HALT_AWAIT_ACK,    // The next packet is swallowed as an acknowledgment
+    HALT_AWAIT_REPLY   // The next packet is answered with a win
+};
+
+enum lobby_state {
+    LOBBY_NONE,        // Connected to a seat port
+    LOBBY_HELLO,       // Waiting for the lobby hello
+    LOBBY_READY,       // Hello received; queued once its shard lets go of it
+    LOBBY_QUEUED,
+    LOBBY_PLAYING,     // In a match the lobby paired
+    LOBBY_AFTER_MATCH, // Match over; waiting for a rematch request or a hello
+    LOBBY_REMATCH      // Asked for a rematch; waiting for the opponent to ask
+};
+
+enum lobby_pairing {
+    LOBBY_PAIR_ANY,    // First come, first paired
+    LOBBY_PAIR_SIZE    // Only clients preferring boards of a similar size meet
+};
+
+enum wire_mode {
+    WIRE_UNKNOWN,      // Nothing received yet
+    WIRE_TEXT,
+    WIRE_BINARY        // The client opened with the binary hello
+};
+
+
+struct shard;
+struct match;
+
+
+// Byte ring holding received data until complete packets can be taken out.
+// head and tail run freely and are masked on access.
+struct ring {
+    char data[CONN_RING_SIZE];
+    uint32_t head;
+    uint32_t tail;
+    uint32_t scanned;            // Bytes from head already searched for '\n'
+};
+
+struct listener {
+    enum endpoint_kind kind;
+    int fd;
+    int player;                  // Seat of the connections it accepts, or SEAT_LOBBY
+};
+
+// Output that did not fit the inline buffer, sent after it in order.
+struct out_chunk {
+    struct out_chunk *next;
+    size_t len;
+    size_t off;
+    size_t capacity;
+    char data[];
+};
+
+struct conn {
+    enum endpoint_kind kind;
+    int fd;
+    int player;                  // 0 for Player 1, 1 for Player 2
+    struct shard *shard;
+    struct match *match;
+    struct conn *next;           // Link in the pairing queue
+    struct conn *dirty_next;
+    struct conn *graveyard_next;
+    uint32_t events;             // Events currently registered with epoll
+    bool recv_armed;             // io_uring: a multishot receive is posted
+    bool recv_cancelled;         // io_uring: and asked to stop
+    bool send_busy;              // io_uring: a sendmsg of the write queue is in flight
+    bool released;               // io_uring: closed, freed by its last completion
+    bool dirty;
+    enum wire_mode wire;
+    bool framed;                 // Text packets and replies are newline-terminated
+    char held_halt;              // '0' or '1': a halt waiting for the client's first bytes
+    bool eof;                    // The client will not send anything more
+    bool closing;
+    bool shut_down;
+    bool broken;
+    bool answering;              // One of its packets is being handled
+    enum lobby_state lobby;
+    int lobby_class;             // Matchmaking class asked for in the lobby hello
+    struct ring input;
+    char in[WIRE_FRAME_MAX];     // The packet being handled: a text line or a frame
+    size_t out_len;
+    size_t out_off;
+    struct out_chunk *chunks;    // Queued behind `out` while a large reply drains
+    struct out_chunk *chunks_last;
+    size_t chunks_pending;       // Bytes in the chunks not sent yet
+    char out[CONN_BUFFER_SIZE];  // Small replies, sent ahead of the chunks
+
+    // io_uring: received bytes that did not fit the input ring, and the
+    // message of the send in flight
+    char *backlog;
+    size_t backlog_len;
+    size_t backlog_capacity;
+    struct msghdr send_message;
+    struct iovec send_iov[CONN_IOV_MAX];
+};
+
+// A game in progress and the connections playing it. The rules live in the
+// engine; the match only carries its outcome to the players.
+struct match {
+    struct shard *shard;
+    struct engine_match game;
+    struct conn *players[2];
+    enum halt_state halt[2];
+    uint64_t started_ns;
+    uint32_t id;                 // Numbers the matches of a server run, for the recording
+};
+
+#define ERROR_CLASSES 4          // Error codes run from 100 to 401
+#define ERROR_DETAILS 4
+
+// What a shard has handled, for the stats file. Written by the owning worker
+// only, read by the main thread.
+struct shard_metrics {
+    atomic_ulong bytes_in;
+    atomic_ulong bytes_out;
+    atomic_ulong errors[ERROR_CLASSES][ERROR_DETAILS];  // By code / 100 - 1 and code % 100
+    atomic_ulong phase_matches[PHASE_HALT + 1];         // Live matches in each phase
+    atomic_ulong ended_in[PHASE_HALT];                  // Matches by the phase they ended in
+    atomic_ulong slow_readers;                          // Dropped for not reading their replies
+    struct metrics_histogram packet_ns[PACKET_KINDS];   // Time to handle each packet
+    struct metrics_histogram match_us;                  // From pairing to the last player leaving
+};
+
+// One event loop per worker thread. Every shard owns its listeners, and a
+// match stays on the shard that accepted the connection completing its pair,
+// so nothing past the accept path is shared between threads.
+struct shard {
+    int id;
+    pthread_t thread;
+    int epoll_fd;
+    struct uring ring;           // In place of epoll_fd with the io_uring backend
+    struct uring_buffers recv_buffers;
+    struct listener listeners[3];  // Player 1, Player 2 and the lobby
+    struct conn *dirty;          // Connections to flush after the current batch
+    struct conn *graveyard;      // Connections to free after the current batch
+
+    // Load counters: written by the owning worker only, read by the reporter
+    atomic_ulong active_matches;
+    atomic_ulong total_matches;
+    atomic_ulong connections;
+    atomic_ulong packets;
+    struct shard_metrics metrics;
+    struct record_ring *record;  // NULL unless matches are recorded
+
+    // Matches and their board storage are recycled within the shard
+    struct object_pool matches;
+    struct buffer_pool buffers;
+};
+
+// Accepted connections waiting for an opponent, shared by all shards
+struct pairing_queue {
+    pthread_mutex_t lock;
+    struct conn *head[2];
+    struct conn *tail[2];
+};
+
+struct pairing_queue pairing = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+// Lobby connections waiting for an opponent, at most one per class: the next
+// client of the class takes the waiting one instead of queueing behind it, so
+// no class ever has two clients waiting
+_Atomic(struct conn *) lobby_waiting[LOBBY_CLASSES];
+enum lobby_pairing lobby_pairing = LOBBY_PAIR_ANY;
+enum io_backend io_backend = IO_EPOLL;
+
+atomic_uint next_match_id = 1;
+struct recorder recorder;
+
+
+static void conn_append(struct conn *conn, const void *data, size_t length, bool terminate);
+void conn_send(struct conn *conn, const char *message);
+void conn_send_frame(struct conn *conn, const uint8_t *frame, size_t length);
+void reply_ack(struct conn *conn);
+void reply_error(struct conn *conn, int code);
+void reply_shot(struct conn *conn, int remaining_ships, char result);
+void reply_volley(struct conn *conn, int remaining_ships, int error, const char *results, int fired);
+void reply_halt(struct conn *conn, bool won);
+void reply_seat(struct conn *conn, int player);
+void conn_mark_dirty(struct conn *conn);
+void conn_close(struct conn *conn);
+void match_free(struct match *match);
+void match_restart(struct match *match);
+void match_mark_dirty(struct match *match);
+void match_player_lost(struct match *match, int player);
+struct packet;
+void handle_halt_packet(struct match *match, int player, const struct packet *packet);
+void match_handle_packet(struct match *match, int player, const struct packet *packet);
+void record_match_start(struct match *match);
+void record_match_end(struct match *match);
+void record_event(struct match *match, char type, int player);
+
+/*
+ * Packet decoding. Each packet is decoded once, without allocating, into a
+ * struct packet that the phase handlers read. The rules follow the sscanf
+ * formats the handlers used to apply, so the same packets are accepted.
+ */
+
+
+static inline const char *skip_spaces(const char *p) {
+    while (isspace((unsigned char)*p)) {
+        p++;
+    }
+    return p;
+}
+
+// Parses a decimal integer with an optional sign, like %d once leading
+// whitespace is skipped, and moves `*cursor` past it.
+bool parse_int(const char **cursor, int *value) {
+    const char *p = *cursor;
+    bool negative = false;
+    long long result = 0;
+
+    if (*p == '+' || *p == '-') {
+        negative = *p++ == '-';
+    }
+    if (!isdigit((unsigned char)*p)) {
+        return false;
+    }
+    while (isdigit((unsigned char)*p)) {
+        result = result * 10 + (*p++ - '0');
+        if (result > (long long)INT_MAX + 1) {
+            return false;
+        }
+    }
+    if (negative) {
+        result = -result;
+    }
+    if (result > INT_MAX || result < INT_MIN) {
+        return false;
+    }
+    *value = (int)result;
+    *cursor = p;
+    return true;
+}
+
+// Reads `count` integers, each after optional whitespace.
+static bool parse_ints(const char **cursor, int *const *values, int count) {
+    for (int i = 0; i < count; i++) {
+        *cursor = skip_spaces(*cursor);
+        if (!parse_int(cursor, values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// "B <width> <height>" with nothing after the height.
+static bool decode_begin(const char *params, struct packet *packet) {
+    int *values[2] = {&packet->begin.width, &packet->begin.height};
+    return parse_ints(&params, values, 2) && *params == '\0';
+}
+
+// Exactly FLEET_SIZE * 4 integers separated by whitespace.
+static bool decode_initialize(const char *params, struct packet *packet) {
+    for (int i = 0; i < FLEET_SIZE; i++) {
+        struct piece_placement *piece = &packet->pieces[i];
+        int *values[4] = {&piece->piece_type, &piece->rotation, &piece->ref_row, &piece->ref_col};
+
+        for (int j = 0; j < 4; j++) {
+            if (!parse_ints(&params, &values[j], 1) || (*params != '\0' && !isspace((unsigned char)*params))) {
+                return false;
+            }
+        }
+    }
+    return *skip_spaces(params) == '\0';
+}
+
+// "S <row> <col>" with nothing but whitespace after the column.
+static bool decode_shoot(const char *params, struct packet *packet) {
+    int *values[2] = {&packet->shot.row, &packet->shot.col};
+    return parse_ints(&params, values, 2) && *skip_spaces(params) == '\0';
+}
+
+// "V <row> <col> [<row> <col> ...]": one or more shots.
+static bool decode_volley(const char *params, struct packet *packet) {
+    packet->volley.count = 0;
+    for (params = skip_spaces(params); *params != '\0'; params = skip_spaces(params)) {
+        if (packet->volley.count == VOLLEY_MAX_SHOTS) {
+            return false;
+        }
+        int *cell = packet->volley.cells[packet->volley.count++];
+        int *values[2] = {&cell[0], &cell[1]};
+        if (!parse_ints(&params, values, 2)) {
+            return false;
+        }
+    }
+    return packet->volley.count > 0;
+}
+
+// "Q <seq>" with a non-negative sequence number.
+static bool decode_query(const char *params, struct packet *packet) {
+    int since;
+
+    params = skip_spaces(params);
+    if (*params == '-' || !parse_int(&params, &since) || *skip_spaces(params) != '\0') {
+        return false;
+    }
+    packet->since = since;
+    return true;
+}
+
+void decode_packet(const char *text, struct packet *packet) {
+    char opcode = text[0];
+
+    packet->text = text;
+    packet->bare = opcode != '\0' && (text[1] == '\0' || strcmp(text + 1, "\n") == 0);
+    packet->has_parameters = opcode != '\0' && text[1] == ' ';
+    packet->well_formed = false;
+
+    switch (opcode) {
+    case 'B':
+        packet->kind = PACKET_BEGIN;
+        packet->well_formed = decode_begin(text + 1, packet);
+        break;
+    case 'I':
+        packet->kind = packet->has_parameters ? PACKET_INITIALIZE : PACKET_OTHER;
+        packet->well_formed = packet->has_parameters && decode_initialize(text + 2, packet);
+        break;
+    case 'S':
+        packet->kind = packet->has_parameters ? PACKET_SHOOT : PACKET_OTHER;
+        packet->well_formed = packet->has_parameters && decode_shoot(text + 2, packet);
+        break;
+    case 'V':
+        packet->kind = packet->has_parameters ? PACKET_VOLLEY : PACKET_OTHER;
+        packet->well_formed = packet->has_parameters && decode_volley(text + 2, packet);
+        break;
+    case 'Q':
+        packet->since = 0;
+        packet->well_formed = packet->bare || (packet->has_parameters && decode_query(text + 2, packet));
+        packet->kind = packet->well_formed ? PACKET_QUERY : PACKET_OTHER;
+        break;
+    case 'F':
+        packet->kind = packet->bare ? PACKET_FORFEIT : PACKET_OTHER;
+        break;
+    default:
+        packet->kind = PACKET_OTHER;
+        break;
+    }
+}
+
+_Static_assert(WIRE_VOLLEY_MAX == VOLLEY_MAX_SHOTS, "A V frame must carry every volley the engine takes");
+
+// Decodes a binary frame (see wire.h) into the same struct packet. Payloads
+// of the wrong size are malformed, like text packets with the wrong number
+// of parameters.
+void wire_decode_packet(const uint8_t *frame, size_t size, struct packet *packet) {
+    const uint8_t *payload = frame + WIRE_HEADER_SIZE;
+    size_t length = size - WIRE_HEADER_SIZE;
+
+    packet->text = "(binary frame)";
+    packet->bare = length == 0;
+    packet->has_parameters = length > 0;
+    packet->well_formed = false;
+
+    switch (frame[0]) {
+    case 'B':
+        packet->kind = PACKET_BEGIN;
+        if (length == 8) {
+            packet->begin.width = wire_get_i32(payload);
+            packet->begin.height = wire_get_i32(payload + 4);
+            packet->well_formed = true;
+        }
+        break;
+    case 'I':
+        packet->kind = PACKET_INITIALIZE;
+        if (length == FLEET_SIZE * 16) {
+            for (int i = 0; i < FLEET_SIZE; i++, payload += 16) {
+                packet->pieces[i].piece_type = wire_get_i32(payload);
+                packet->pieces[i].rotation = wire_get_i32(payload + 4);
+                packet->pieces[i].ref_row = wire_get_i32(payload + 8);
+                packet->pieces[i].ref_col = wire_get_i32(payload + 12);
+            }
+            packet->well_formed = true;
+        }
+        break;
+    case 'S':
+        packet->kind = PACKET_SHOOT;
+        if (length == 8) {
+            packet->shot.row = wire_get_i32(payload);
+            packet->shot.col = wire_get_i32(payload + 4);
+            packet->well_formed = true;
+        }
+        break;
+    case 'V':
+        packet->kind = PACKET_VOLLEY;
+        if (length >= 4) {
+            uint32_t count = wire_get_u32(payload);
+            if (count > 0 && count <= VOLLEY_MAX_SHOTS && length == 4 + count * 8) {
+                packet->volley.count = count;
+                for (uint32_t i = 0; i < count; i++) {
+                    packet->volley.cells[i][0] = wire_get_i32(payload + 4 + i * 8);
+                    packet->volley.cells[i][1] = wire_get_i32(payload + 8 + i * 8);
+                }
+                packet->well_formed = true;
+            }
+        }
+        break;
+    case 'Q':
+        packet->since = length == 4 ? wire_get_u32(payload) : 0;
+        packet->well_formed = length == 0 || length == 4;
+        packet->kind = packet->well_formed ? PACKET_QUERY : PACKET_OTHER;
+        break;
+    case 'F':
+        packet->kind = packet->bare ? PACKET_FORFEIT : PACKET_OTHER;
+        break;
+    default:
+        packet->kind = PACKET_OTHER;
+        break;
+    }
+}
+
+// Decodes the lobby hello a client sends before it is paired: "L", or
+// "L <width> <height>" for the board size it prefers, or an L frame with an
+// empty or 8-byte payload. Returns 0 with the size (0 x 0 for any), 100 for
+// any other packet or 200 for a malformed hello.
+int decode_lobby_hello(const char *in, int length, bool binary, int *width, int *height) {
+    struct packet packet;
+
+    *width = 0;
+    *height = 0;
+    if (binary) {
+        if (in[0] != 'L') {
+            return 100;
+        }
+        if (length == WIRE_HEADER_SIZE) {
+            return 0;
+        }
+        if (length != WIRE_HEADER_SIZE + 8) {
+            return 200;
+        }
+        packet.begin.width = wire_get_i32((const uint8_t *)in + WIRE_HEADER_SIZE);
+        packet.begin.height = wire_get_i32((const uint8_t *)in + WIRE_HEADER_SIZE + 4);
+    } else {
+        if (in[0] != 'L') {
+            return 100;
+        }
+        if (in[1] == '\0' || strcmp(in + 1, "\n") == 0) {
+            return 0;
+        }
+        if (in[1] != ' ' || !decode_begin(in + 1, &packet)) {
+            return 200;
+        }
+    }
+    if (packet.begin.width < 10 || packet.begin.height < 10) {
+        return 200;
+    }
+    *width = packet.begin.width;
+    *height = packet.begin.height;
+    return 0;
+}
+
+// Answers a query with the shots fired at the opponent's board from sequence
+// number `since` on, all of them for a plain query. Replies are never cut
+// short: a long list is buffered in full.
+void handle_query_packet(struct conn *conn, struct board *opponent_board, uint32_t since) {
+    struct shot_log *log = &opponent_board->log;
+    int remaining_ships = count_remaining_ships(opponent_board);
+    uint32_t count = since < log->count ? log->count - since : 0;
+
+    if (conn->wire == WIRE_BINARY) {
+        uint8_t head[WIRE_HEADER_SIZE + 8];
+        uint8_t *p = head + wire_put_header(head, 'G', 8 + count * WIRE_SHOT_SIZE);
+        p[0] = remaining_ships;
+        p[1] = 0;
+        wire_put_u16(p + 2, 0);
+        wire_put_u32(p + 4, count);
+        conn_append(conn, head, sizeof(head), false);
+        if (count > 0) {
+            conn_append(conn, log->records + (size_t)since * WIRE_SHOT_SIZE, (size_t)count * WIRE_SHOT_SIZE, false);
+        }
+        return;
+    }
+
+    char response[BUFFER_SIZE];
+    size_t length = snprintf(response, sizeof(response), "G %d", remaining_ships);
+
+    if (since == 0) {
+        // The full list is kept encoded between queries
+        if (shot_log_encode_text(log) != 0) {
+            log_error("[Server] Out of memory encoding a query reply, dropping connection");
+            conn_close(conn);
+            return;
+        }
+        conn_append(conn, response, length, false);
+        conn_append(conn, log->text, log->text_length, conn->framed);
+        return;
+    }
+    for (uint32_t seq = since; seq < log->count; seq++) {
+        if (length > sizeof(response) - SHOT_LOG_ENTRY_TEXT) {
+            conn_append(conn, response, length, false);
+            length = 0;
+        }
+        length += shot_log_format(log, seq, response + length);
+    }
+    conn_append(conn, response, length, conn->framed);
+}
+
+/*
+ * Ring buffer used for per-connection input framing.
+ */
+
+#define RING_NO_LINE -1
+#define RING_LINE_TOO_LONG -2
+
+static inline uint32_t ring_used(const struct ring *ring) {
+    return ring->tail - ring->head;
+}
+
+static inline uint32_t ring_space(const struct ring *ring) {
+    return CONN_RING_SIZE - ring_used(ring);
+}
+
+// Reads as much as fits into the ring while leaving `reserve` bytes free.
+ssize_t ring_recv(struct ring *ring, int fd, uint32_t reserve) {
+    uint32_t space = ring_space(ring) - reserve;
+    uint32_t start = ring->tail & (CONN_RING_SIZE - 1);
+    uint32_t first = CONN_RING_SIZE - start;
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    iov[0].iov_base = ring->data + start;
+    iov[0].iov_len = first < space ? first : space;
+    if (first < space) {
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = space - first;
+        iovcnt = 2;
+    }
+
+    ssize_t bytes_received = readv(fd, iov, iovcnt);
+    if (bytes_received > 0) {
+        ring->tail += bytes_received;
+    }
+    return bytes_received;
+}
+
+// Appends `length` bytes, which must fit.
+void ring_write(struct ring *ring, const char *data, uint32_t length) {
+    uint32_t start = ring->tail & (CONN_RING_SIZE - 1);
+    uint32_t first = CONN_RING_SIZE - start < length ? CONN_RING_SIZE - start : length;
+
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, data + first, length - first);
+    ring->tail += length;
+}
+
+void ring_push(struct ring *ring, char c) {
+    ring->data[ring->tail & (CONN_RING_SIZE - 1)] = c;
+    ring->tail++;
+}
+
+// Returns whether `c` occurs between position `from` and the tail.
+bool ring_find(const struct ring *ring, uint32_t from, char c) {
+    for (uint32_t pos = from; pos != ring->tail; pos++) {
+        if (ring->data[pos & (CONN_RING_SIZE - 1)] == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Copies `length` bytes from the head of the ring into `out`.
+static void ring_peek(const struct ring *ring, void *out, uint32_t length) {
+    uint32_t start = ring->head & (CONN_RING_SIZE - 1);
+    uint32_t first = CONN_RING_SIZE - start;
+
+    if (first >= length) {
+        memcpy(out, ring->data + start, length);
+    } else {
+        memcpy(out, ring->data + start, first);
+        memcpy((char *)out + first, ring->data, length - first);
     }
-    for (int i = 0; i < height; i++) {
-        board[i] = calloc(width, sizeof(int));
-        if (!board[i]) {
-            for (int j = 0; j < i; j++) {
-                free(board[j]);
+}
+
+// Copies `length` bytes from the head of the ring into `out` and
+// null-terminates them, dropping a trailing '\r'.
+static int ring_copy_out(struct ring *ring, char *out, uint32_t length) {
+    ring_peek(ring, out, length);
+    if (length > 0 && out[length - 1] == '\r') {
+        length--;
+    }
+    out[length] = '\0';
+    return length;
+}
+
+// Takes the next '\n'-terminated packet out of the ring. Returns its length,
+// RING_NO_LINE if no complete packet is buffered yet, or RING_LINE_TOO_LONG
+// if the packet cannot fit in `size` bytes.
+int ring_take_line(struct ring *ring, char *out, size_t size) {
+    while (ring->head + ring->scanned != ring->tail) {
+        uint32_t pos = (ring->head + ring->scanned) & (CONN_RING_SIZE - 1);
+        uint32_t contiguous = ring->tail - (ring->head + ring->scanned);
+        if (contiguous > CONN_RING_SIZE - pos) {
+            contiguous = CONN_RING_SIZE - pos;
+        }
+
+        char *newline = memchr(ring->data + pos, '\n', contiguous);
+        if (!newline) {
+            ring->scanned += contiguous;
+            continue;
+        }
+
+        uint32_t length = ring->scanned + (newline - (ring->data + pos));
+        if (length >= size) {
+            return RING_LINE_TOO_LONG;
+        }
+        int packet_length = ring_copy_out(ring, out, length);
+        ring->head += length + 1;
+        ring->scanned = 0;
+        return packet_length;
+    }
+
+    return ring->scanned >= size ? RING_LINE_TOO_LONG : RING_NO_LINE;
+}
+
+// Takes the next binary frame out of the ring. Returns its length including
+// the header, RING_NO_LINE if the frame is not complete yet, or
+// RING_LINE_TOO_LONG if it cannot fit in `size` bytes.
+int ring_take_frame(struct ring *ring, void *out, size_t size) {
+    uint8_t header[WIRE_HEADER_SIZE];
+
+    if (ring_used(ring) < WIRE_HEADER_SIZE) {
+        return RING_NO_LINE;
+    }
+    ring_peek(ring, header, WIRE_HEADER_SIZE);
+    uint64_t length = (uint64_t)WIRE_HEADER_SIZE + wire_get_u32(header + 4);
+    if (length > size) {
+        return RING_LINE_TOO_LONG;
+    }
+    if (ring_used(ring) < length) {
+        return RING_NO_LINE;
+    }
+    ring_peek(ring, out, length);
+    ring->head += length;
+    return length;
+}
+
+// Takes whatever is left in the ring as a packet.
+int ring_take_rest(struct ring *ring, char *out, size_t size) {
+    uint32_t length = ring_used(ring);
+
+    if (length >= size) {
+        return RING_LINE_TOO_LONG;
+    }
+    int packet_length = ring_copy_out(ring, out, length);
+    ring->head = ring->tail;
+    ring->scanned = 0;
+    return packet_length;
+}
+
+/*
+ * Connection plumbing. Every socket is non-blocking and owned by the event
+ * loop: handlers only append replies to the connection's write buffer, which
+ * is flushed once the current batch of events has been processed.
+ */
+
+static inline size_t conn_out_pending(const struct conn *conn) {
+    return conn->out_len - conn->out_off + conn->chunks_pending;
+}
+
+// Copies bytes into the write queue: into the inline buffer while nothing is
+// queued behind it, then into heap chunks. Only a reply larger than the
+// inline buffer, such as the shot list of a long game, needs a chunk: no
+// packet is handled while that much output is pending.
+static int conn_queue_output(struct conn *conn, const char *data, size_t length) {
+    if (!conn->chunks) {
+        // Reclaim the space of already flushed bytes first, unless a send in
+        // flight still reads the rest where it is
+        if (conn->out_off > 0 && !conn->send_busy && conn->out_len + length > CONN_BUFFER_SIZE) {
+            memmove(conn->out, conn->out + conn->out_off, conn->out_len - conn->out_off);
+            conn->out_len -= conn->out_off;
+            conn->out_off = 0;
+        }
+        size_t copied = length < CONN_BUFFER_SIZE - conn->out_len ? length : CONN_BUFFER_SIZE - conn->out_len;
+        memcpy(conn->out + conn->out_len, data, copied);
+        conn->out_len += copied;
+        data += copied;
+        length -= copied;
+    }
+
+    while (length > 0) {
+        struct out_chunk *last = conn->chunks_last;
+        if (!conn->chunks || last->len == last->capacity) {
+            size_t capacity = length > CONN_CHUNK_SIZE ? length : CONN_CHUNK_SIZE;
+            struct out_chunk *chunk = malloc(sizeof(struct out_chunk) + capacity);
+            if (!chunk) {
+                return -1;
+            }
+            *chunk = (struct out_chunk){ .capacity = capacity };
+            if (conn->chunks) {
+                last->next = chunk;
+            } else {
+                conn->chunks = chunk;
+            }
+            conn->chunks_last = last = chunk;
+        }
+        size_t copied = length < last->capacity - last->len ? length : last->capacity - last->len;
+        memcpy(last->data + last->len, data, copied);
+        last->len += copied;
+        conn->chunks_pending += copied;
+        data += copied;
+        length -= copied;
+    }
+    return 0;
+}
+
+// Drops `sent` bytes from the front of the write queue.
+static void conn_consume_output(struct conn *conn, size_t sent) {
+    size_t from_inline = sent < conn->out_len - conn->out_off ? sent : conn->out_len - conn->out_off;
+
+    conn->out_off += from_inline;
+    sent -= from_inline;
+    while (sent > 0) {
+        struct out_chunk *chunk = conn->chunks;
+        size_t taken = sent < chunk->len - chunk->off ? sent : chunk->len - chunk->off;
+
+        chunk->off += taken;
+        conn->chunks_pending -= taken;
+        sent -= taken;
+        if (chunk->off == chunk->len) {
+            conn->chunks = chunk->next;
+            free(chunk);
+        }
+    }
+    if (conn_out_pending(conn) == 0) {
+        conn->out_off = 0;
+        conn->out_len = 0;
+    }
+}
+
+// Empties the write queue without sending it.
+void conn_discard_output(struct conn *conn) {
+    while (conn->chunks) {
+        struct out_chunk *chunk = conn->chunks;
+        conn->chunks = chunk->next;
+        free(chunk);
+    }
+    conn->chunks_pending = 0;
+    conn->out_off = 0;
+    conn->out_len = 0;
+}
+
+// Appends bytes to the write queue, plus a '\n' if `terminate` is set. Once
+// the match is over only a held halt is still sent.
+//
+// A reply is never cut short, however large. A client's packets are only
+// handled while little of its output is pending, so the reply to one of them
+// always goes through whole. Anything queued for it otherwise, while more
+// than CONN_OUTPUT_LIMIT is still unsent, drops the client instead: a slow
+// reader cannot hold on to more than one reply on top of that.
+static void conn_append(struct conn *conn, const void *data, size_t length, bool terminate) {
+    if (conn->fd == -1 || (conn->closing && !conn->held_halt) || conn->broken) {
+        return;
+    }
+    if (!conn->answering && conn_out_pending(conn) > CONN_OUTPUT_LIMIT) {
+        log_warn("[Server] Client on fd %d is not reading its replies, dropping connection", conn->fd);
+        metrics_add(&conn->shard->metrics.slow_readers, 1);
+        conn->broken = true;
+        conn_mark_dirty(conn);
+        return;
+    }
+    if (conn_queue_output(conn, data, length) != 0 || (terminate && conn_queue_output(conn, "\n", 1) != 0)) {
+        log_warn("[Server] Cannot buffer %zu bytes on fd %d, dropping connection", conn_out_pending(conn) + length, conn->fd);
+        conn->broken = true;
+        conn_mark_dirty(conn);
+        return;
+    }
+    conn_mark_dirty(conn);
+}
+
+// Sends a text reply.
+void conn_send(struct conn *conn, const char *message) {
+    conn_append(conn, message, strlen(message), conn->framed);
+}
+
+// Sends a complete binary frame.
+void conn_send_frame(struct conn *conn, const uint8_t *frame, size_t length) {
+    conn_append(conn, frame, length, false);
+}
+
+/*
+ * Replies, in the protocol the connection negotiated.
+ */
+
+void reply_ack(struct conn *conn) {
+    uint8_t frame[WIRE_HEADER_SIZE];
+
+    if (conn->wire == WIRE_BINARY) {
+        conn_send_frame(conn, frame, wire_put_header(frame, 'A', 0));
+        return;
+    }
+    conn_send(conn, "A");
+}
+
+void reply_error(struct conn *conn, int code) {
+    uint8_t frame[WIRE_HEADER_SIZE + 2];
+    char message[16];
+
+    if (code >= 100 && code / 100 <= ERROR_CLASSES && code % 100 < ERROR_DETAILS) {
+        metrics_add(&conn->shard->metrics.errors[code / 100 - 1][code % 100], 1);
+    }
+    if (conn->wire == WIRE_BINARY) {
+        wire_put_header(frame, 'E', 2);
+        wire_put_u16(frame + WIRE_HEADER_SIZE, code);
+        conn_send_frame(conn, frame, sizeof(frame));
+        return;
+    }
+    snprintf(message, sizeof(message), "E %d", code);
+    conn_send(conn, message);
+}
+
+void reply_shot(struct conn *conn, int remaining_ships, char result) {
+    uint8_t frame[WIRE_HEADER_SIZE + 2];
+    char message[16];
+
+    if (conn->wire == WIRE_BINARY) {
+        wire_put_header(frame, 'R', 2);
+        frame[WIRE_HEADER_SIZE] = remaining_ships;
+        frame[WIRE_HEADER_SIZE + 1] = result;
+        conn_send_frame(conn, frame, sizeof(frame));
+        return;
+    }
+    snprintf(message, sizeof(message), "R %d %c", remaining_ships, result);
+    conn_send(conn, message);
+}
+
+// Answers a volley: the error code that stopped it (0 if none) and whether
+// each shot fired hit or missed.
+void reply_volley(struct conn *conn, int remaining_ships, int error, const char *results, int fired) {
+    if (conn->wire == WIRE_BINARY) {
+        uint8_t frame[WIRE_HEADER_SIZE + 8 + VOLLEY_MAX_SHOTS / 8];
+        uint8_t *p = frame + wire_put_header(frame, 'V', 8 + (fired + 7) / 8);
+
+        p[0] = remaining_ships;
+        p[1] = 0;
+        wire_put_u16(p + 2, error);
+        wire_put_u32(p + 4, fired);
+        memset(p + 8, 0, (fired + 7) / 8);
+        for (int i = 0; i < fired; i++) {
+            if (results[i] == 'H') {
+                p[8 + i / 8] |= 1u << (i % 8);
+            }
+        }
+        conn_send_frame(conn, frame, WIRE_HEADER_SIZE + 8 + (fired + 7) / 8);
+        return;
+    }
+
+    char message[32 + VOLLEY_MAX_SHOTS];
+    int length = snprintf(message, sizeof(message), "V %d %d", remaining_ships, error);
+    if (fired > 0) {
+        message[length++] = ' ';
+        memcpy(message + length, results, fired);
+        message[length + fired] = '\0';
+    }
+    conn_send(conn, message);
+}
+
+// A client that has not sent anything yet cannot be told in a way it will
+// read: whether its replies are binary or newline-terminated depends on its
+// first bytes. Its halt is held until they arrive.
+void reply_halt(struct conn *conn, bool won) {
+    uint8_t frame[WIRE_HEADER_SIZE + 1];
+
+    if (conn->wire == WIRE_UNKNOWN) {
+        conn->held_halt = won ? '1' : '0';
+        return;
+    }
+    if (conn->wire == WIRE_BINARY) {
+        wire_put_header(frame, 'H', 1);
+        frame[WIRE_HEADER_SIZE] = won;
+        conn_send_frame(conn, frame, sizeof(frame));
+        return;
+    }
+    conn_send(conn, won ? "H 1" : "H 0");
+}
+
+// Tells a lobby client which seat it was paired into.
+void reply_seat(struct conn *conn, int player) {
+    uint8_t frame[WIRE_HEADER_SIZE + 1];
+
+    if (conn->wire == WIRE_BINARY) {
+        wire_put_header(frame, 'P', 1);
+        frame[WIRE_HEADER_SIZE] = player + 1;
+        conn_send_frame(conn, frame, sizeof(frame));
+        return;
+    }
+    conn_send(conn, player == 0 ? "P 1" : "P 2");
+}
+
+size_t conn_out_space(struct conn *conn) {
+    size_t pending = conn_out_pending(conn);
+    return pending < CONN_BUFFER_SIZE ? CONN_BUFFER_SIZE - pending : 0;
+}
+
+void conn_mark_dirty(struct conn *conn) {
+    if (!conn->dirty) {
+        conn->dirty = true;
+        conn->dirty_next = conn->shard->dirty;
+        conn->shard->dirty = conn;
+    }
+}
+
+// Whether the socket should be read: packets are buffered ahead of the
+// player's turn until the input ring fills up. One byte is kept spare so an
+// unframed packet can be terminated in place.
+bool conn_wants_input(struct conn *conn) {
+    if (conn->closing) {
+        return true;  // Keep reading so the peer's EOF is noticed
+    }
+    return !conn->eof && conn->backlog_len == 0 && ring_space(&conn->input) > 1;
+}
+
+// Whether the match is waiting for a packet from this connection.
+bool conn_has_turn(struct conn *conn) {
+    struct match *match = conn->match;
+
+    if (conn->closing) {
+        return false;
+    }
+    if (conn->lobby == LOBBY_HELLO || conn->lobby == LOBBY_AFTER_MATCH) {
+        return true;  // Only lobby requests are read before pairing and after a match
+    }
+    if (!match) {
+        return false;
+    }
+    if (match->game.phase == PHASE_HALT) {
+        return match->halt[conn->player] != HALT_DONE;
+    }
+    return engine_expected_player(&match->game) == conn->player;
+}
+
+/*
+ * io_uring requests of a connection. A multishot receive stays posted while
+ * the connection wants input, and at most one sendmsg of the write queue is in
+ * flight; the queue only moves once its completion says how much was sent.
+ * Requests are queued here and go out with the worker's next wait.
+ */
+
+static inline uint64_t uring_data(void *target, enum uring_op op) {
+    return (uintptr_t)target | op;
+}
+
+void uring_cancel(struct conn *conn, enum uring_op op) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&conn->shard->ring);
+
+    if (!sqe) {
+        perror("[Server] io_uring_enter() failed");
+        return;
+    }
+    uring_prep_cancel(sqe, uring_data(conn, op), URING_CANCEL);
+    if (op == URING_RECV) {
+        conn->recv_cancelled = true;
+    }
+}
+
+// Posts or stops the receive. A stopped receive is only gone with its last
+// completion, which marks the connection dirty again.
+void uring_update(struct conn *conn) {
+    bool wanted = conn_wants_input(conn);
+
+    if (wanted && !conn->recv_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(&conn->shard->ring);
+        if (!sqe) {
+            perror("[Server] io_uring_enter() failed");
+            conn->broken = true;
+            return;
+        }
+        uring_prep_recv_multishot(sqe, conn->fd, URING_RECV_GROUP, uring_data(conn, URING_RECV));
+        conn->recv_armed = true;
+    } else if (!wanted && conn->recv_armed && !conn->recv_cancelled) {
+        uring_cancel(conn, URING_RECV);
+    }
+}
+
+// Posts the write queue, inline buffer and chunks, as one sendmsg.
+void uring_send(struct conn *conn) {
+    struct msghdr *message = &conn->send_message;
+
+    if (conn->send_busy || conn_out_pending(conn) == 0) {
+        return;
+    }
+    *message = (struct msghdr){ .msg_iov = conn->send_iov };
+    if (conn->out_off < conn->out_len) {
+        conn->send_iov[message->msg_iovlen++] = (struct iovec){ conn->out + conn->out_off, conn->out_len - conn->out_off };
+    }
+    for (struct out_chunk *chunk = conn->chunks; chunk && message->msg_iovlen < CONN_IOV_MAX; chunk = chunk->next) {
+        conn->send_iov[message->msg_iovlen++] = (struct iovec){ chunk->data + chunk->off, chunk->len - chunk->off };
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(&conn->shard->ring);
+    if (!sqe) {
+        perror("[Server] io_uring_enter() failed");
+        conn->broken = true;
+        return;
+    }
+    uring_prep_sendmsg(sqe, conn->fd, message, MSG_NOSIGNAL, uring_data(conn, URING_SEND));
+    conn->send_busy = true;
+}
+
+void conn_update_events(struct conn *conn) {
+    uint32_t events = 0;
+
+    if (io_backend == IO_URING) {
+        uring_update(conn);
+        return;
+    }
+
+    if (conn_wants_input(conn)) {
+        events |= EPOLLIN;
+    }
+    if (conn_out_pending(conn) > 0) {
+        events |= EPOLLOUT;
+    }
+    if (events == conn->events) {
+        return;
+    }
+
+    struct epoll_event event = { .events = events, .data.ptr = conn };
+    if (epoll_ctl(conn->shard->epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) == -1) {
+        perror("[Server] epoll_ctl() failed");
+        conn->broken = true;
+        return;
+    }
+    conn->events = events;
+}
+
+// Detaches a connection from its match and lets it drain: the remaining
+// replies are flushed, then the write side is shut down and the socket is
+// closed once the client hangs up.
+void conn_finish(struct conn *conn) {
+    struct match *match = conn->match;
+
+    if (match) {
+        match->players[conn->player] = NULL;
+        conn->match = NULL;
+        if (!match->players[0] && !match->players[1]) {
+            match_free(match);
+        }
+    }
+    conn->closing = true;
+    conn_mark_dirty(conn);
+}
+
+// Ends a player's part in a halted match. Seat-port connections are closed
+// as before; lobby clients stay connected and may ask for a rematch or go
+// back to the lobby.
+void conn_end_match(struct conn *conn) {
+    if (conn->lobby == LOBBY_NONE) {
+        conn_finish(conn);
+        return;
+    }
+    conn->lobby = LOBBY_AFTER_MATCH;
+    conn_mark_dirty(conn);
+}
+
+void conn_close(struct conn *conn) {
+    struct shard *shard = conn->shard;
+    struct match *match = conn->match;
+
+    if (conn->fd == -1) {
+        return;
+    }
+    if (io_backend == IO_URING) {
+        // The requests keep the socket open until they are cancelled
+        if (conn->recv_armed && !conn->recv_cancelled) {
+            uring_cancel(conn, URING_RECV);
+        }
+        if (conn->send_busy) {
+            uring_cancel(conn, URING_SEND);
+        }
+    } else {
+        epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    close(conn->fd);
+    conn->fd = -1;
+
+    if (match) {
+        match->players[conn->player] = NULL;
+        conn->match = NULL;
+        if (!match->players[0] && !match->players[1]) {
+            match_free(match);
+        } else {
+            match_player_lost(match, conn->player);
+        }
+    }
+
+    // The connection may still be referenced by events later in this batch
+    conn->graveyard_next = shard->graveyard;
+    shard->graveyard = conn;
+}
+
+// Frees a closed connection once nothing refers to it any more.
+void conn_free(struct conn *conn) {
+    conn_discard_output(conn);
+    free(conn->backlog);
+    free(conn);
+}
+
+// Sends the write queue, inline buffer and chunks together in one sendmsg()
+// per pass, so all the replies of a batch usually leave in a single syscall.
+// The socket is never corked: a flush is already one write, and a cork would
+// only add two syscalls around it. With io_uring the sendmsg is posted to the
+// ring instead and shares the worker's wait.
+void conn_flush(struct conn *conn) {
+    if (io_backend == IO_URING) {
+        uring_send(conn);
+    }
+    while (io_backend == IO_EPOLL && conn_out_pending(conn) > 0) {
+        struct iovec iov[CONN_IOV_MAX];
+        struct msghdr message = { .msg_iov = iov };
+
+        if (conn->out_off < conn->out_len) {
+            iov[message.msg_iovlen++] = (struct iovec){ conn->out + conn->out_off, conn->out_len - conn->out_off };
+        }
+        for (struct out_chunk *chunk = conn->chunks; chunk && message.msg_iovlen < CONN_IOV_MAX; chunk = chunk->next) {
+            iov[message.msg_iovlen++] = (struct iovec){ chunk->data + chunk->off, chunk->len - chunk->off };
+        }
+        ssize_t sent = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            conn->broken = true;
+            return;
+        }
+        conn_consume_output(conn, sent);
+        metrics_add(&conn->shard->metrics.bytes_out, sent);
+    }
+
+    if (conn_out_pending(conn) == 0) {
+        if (conn->closing && !conn->shut_down && !conn->held_halt) {
+            shutdown(conn->fd, SHUT_WR);
+            conn->shut_down = true;
+        }
+    }
+}
+
+// Turns off Nagle's algorithm once the client is known to frame its replies:
+// they are coalesced per batch and sent in one write already, so Nagle could
+// only hold them back. Older text clients keep it, since they take each read
+// as one reply and the delay keeps consecutive replies in separate reads.
+void conn_set_nodelay(struct conn *conn) {
+    int nodelay = 1;
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+}
+
+// Settles the protocol from the first bytes received. A client that opens
+// with the binary hello is answered with the server's hello and speaks binary
+// from then on; anything else is text. Returns false while the hello is
+// incomplete or after a hello for another version closed the connection.
+bool conn_negotiate(struct conn *conn) {
+    uint8_t hello[WIRE_HELLO_SIZE];
+
+    if ((uint8_t)conn->input.data[conn->input.head & (CONN_RING_SIZE - 1)] != WIRE_HELLO_BYTE) {
+        conn->wire = WIRE_TEXT;
+        return true;
+    }
+    if (ring_used(&conn->input) < WIRE_HELLO_SIZE) {
+        return false;
+    }
+    ring_peek(&conn->input, hello, WIRE_HELLO_SIZE);
+    conn->input.head += WIRE_HELLO_SIZE;
+    conn->wire = WIRE_BINARY;
+    conn_set_nodelay(conn);
+    conn_send_frame(conn, wire_hello, WIRE_HELLO_SIZE);
+    if (memcmp(hello, wire_hello, WIRE_HELLO_SIZE) != 0) {
+        struct match *match = conn->match;
+        int player = conn->player;
+
+        // The reply tells the client which version to speak; the opponent wins
+        log_warn("[Server] Player %d sent an unsupported binary hello, dropping connection", player + 1);
+        conn_finish(conn);
+        if (match && match->players[1 - player]) {
+            match_player_lost(match, player);
+        }
+        return false;
+    }
+    return true;
+}
+
+// Settles the protocol and the framing of the bytes added to the input ring
+// from `start` on, which arrived in one read.
+void conn_input_arrived(struct conn *conn, uint32_t start) {
+    // The first byte picks the protocol
+    if (conn->wire == WIRE_UNKNOWN && !conn_negotiate(conn)) {
+        return;
+    }
+    if (conn->wire == WIRE_BINARY) {
+        conn_mark_dirty(conn);
+        return;
+    }
+
+    // Clients that terminate packets with '\n' get stream framing. Older
+    // clients send one packet per write, so each read is taken as a packet.
+    if (!conn->framed && ring_find(&conn->input, start, '\n')) {
+        conn->framed = true;
+        conn_set_nodelay(conn);
+    }
+    if (!conn->framed) {
+        ring_push(&conn->input, '\n');
+    }
+    conn_mark_dirty(conn);
+}
+
+// Sends a held halt once the client's first bytes show how it reads replies.
+// They are not answered otherwise: the match is over.
+void conn_release_halt(struct conn *conn, const char *data, size_t length) {
+    if (!conn->held_halt || length == 0) {
+        return;
+    }
+    // Part of a binary hello may already be in the input ring
+    char first = ring_used(&conn->input) > 0 ? conn->input.data[conn->input.head & (CONN_RING_SIZE - 1)] : data[0];
+    if ((uint8_t)first == WIRE_HELLO_BYTE) {
+        conn->wire = WIRE_BINARY;
+        conn_send_frame(conn, wire_hello, WIRE_HELLO_SIZE);
+    } else {
+        conn->wire = WIRE_TEXT;
+        conn->framed = memchr(data, '\n', length) != NULL;
+    }
+    reply_halt(conn, conn->held_halt == '1');
+    conn->held_halt = 0;
+}
+
+void conn_handle_readable(struct conn *conn) {
+    if (conn->closing) {
+        // Nothing more is answered once the match is over
+        char discard[BUFFER_SIZE];
+        ssize_t bytes_received = recv(conn->fd, discard, sizeof(discard), 0);
+        if (bytes_received > 0) {
+            metrics_add(&conn->shard->metrics.bytes_in, bytes_received);
+            conn_release_halt(conn, discard, bytes_received);
+        }
+        if (bytes_received == 0 || (bytes_received == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            conn_close(conn);
+        }
+        return;
+    }
+    if (!conn_wants_input(conn)) {
+        return;
+    }
+
+    uint32_t start = conn->input.tail;
+    ssize_t bytes_received = ring_recv(&conn->input, conn->fd, 1);
+
+    if (bytes_received == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        return;
+    }
+    if (bytes_received == -1) {
+        perror("[Server] recv() failed");
+        conn_close(conn);
+        return;
+    }
+    if (bytes_received == 0) {
+        // Packets already received are still answered before the hangup counts
+        conn->eof = true;
+        conn_mark_dirty(conn);
+        return;
+    }
+    metrics_add(&conn->shard->metrics.bytes_in, bytes_received);
+    conn_input_arrived(conn, start);
+}
+
+// Moves what fits from the backlog into the input ring, keeping one byte
+// spare like a read. Returns whether anything moved.
+bool conn_refill_input(struct conn *conn) {
+    uint32_t space = ring_space(&conn->input);
+    uint32_t start = conn->input.tail;
+
+    if (conn->backlog_len == 0 || space <= 1) {
+        return false;
+    }
+    uint32_t length = conn->backlog_len < space - 1 ? conn->backlog_len : space - 1;
+    ring_write(&conn->input, conn->backlog, length);
+    conn->backlog_len -= length;
+    memmove(conn->backlog, conn->backlog + length, conn->backlog_len);
+    conn_input_arrived(conn, start);
+    return true;
+}
+
+// Takes the bytes of a receive completion. What does not fit the input ring
+// waits in the backlog, which stops the receive until the packets ahead of it
+// are taken out.
+void conn_received(struct conn *conn, const char *data, size_t length) {
+    metrics_add(&conn->shard->metrics.bytes_in, length);
+    if (conn->closing) {
+        conn_release_halt(conn, data, length);
+        return;  // Nothing more is answered once the match is over
+    }
+    if (conn->backlog_len == 0 && length < ring_space(&conn->input)) {
+        uint32_t start = conn->input.tail;
+        ring_write(&conn->input, data, length);
+        conn_input_arrived(conn, start);
+        return;
+    }
+
+    if (conn->backlog_len + length > conn->backlog_capacity) {
+        size_t capacity = conn->backlog_capacity ? conn->backlog_capacity : CONN_RING_SIZE;
+        while (capacity < conn->backlog_len + length) {
+            capacity *= 2;
+        }
+        char *backlog = realloc(conn->backlog, capacity);
+        if (!backlog) {
+            log_warn("[Server] Cannot buffer %zu received bytes on fd %d, dropping connection", conn->backlog_len + length, conn->fd);
+            conn->broken = true;
+            conn_mark_dirty(conn);
+            return;
+        }
+        conn->backlog = backlog;
+        conn->backlog_capacity = capacity;
+    }
+    memcpy(conn->backlog + conn->backlog_len, data, length);
+    conn->backlog_len += length;
+    conn_refill_input(conn);
+    conn_mark_dirty(conn);
+}
+
+// The matchmaking class of a lobby client preferring `width` x `height`.
+int lobby_class_for(int width, int height) {
+    int side = width > height ? width : height;
+
+    if (lobby_pairing == LOBBY_PAIR_ANY || side == 0) {
+        return 0;
+    }
+    return 1 + (31 - __builtin_clz(side)) - 3;  // 10-15 is class 1, 16-31 class 2, ...
+}
+
+// Detaches a lobby client from its finished match and sends it back to
+// matchmaking. An opponent waiting for a rematch with it goes back too.
+void lobby_leave_match(struct conn *conn) {
+    struct match *match = conn->match;
+
+    if (match) {
+        struct conn *opponent = match->players[1 - conn->player];
+
+        match->players[conn->player] = NULL;
+        conn->match = NULL;
+        if (opponent && opponent->lobby == LOBBY_REMATCH) {
+            lobby_leave_match(opponent);  // Frees the match as the last player out
+            conn_mark_dirty(opponent);
+        } else if (!opponent) {
+            match_free(match);
+        }
+    }
+    conn->lobby = LOBBY_READY;
+}
+
+// Whether a lobby client's packet asks for a rematch: "M", or an empty M frame.
+static bool is_rematch_request(const char *in, int length, bool binary) {
+    if (binary) {
+        return in[0] == 'M' && length == WIRE_HEADER_SIZE;
+    }
+    return strcmp(in, "M") == 0 || strcmp(in, "M\n") == 0;
+}
+
+// Asks the last opponent for another game in the same match. It restarts
+// once both players asked; without an opponent the client goes back to the
+// lobby for the board size it asked for before.
+void lobby_rematch(struct conn *conn) {
+    struct match *match = conn->match;
+    struct conn *opponent = match->players[1 - conn->player];
+
+    if (!opponent) {
+        log_info("[Server] Rematch requested, but the opponent left; back to the lobby");
+        lobby_leave_match(conn);
+        return;
+    }
+    conn->lobby = LOBBY_REMATCH;
+    if (opponent->lobby == LOBBY_REMATCH) {
+        match_restart(match);
+    }
+}
+
+// Takes the lobby hello of a connection that is not paired yet, or whose
+// match is over. Anything else is answered with an error and the client may
+// try again.
+void lobby_read_hello(struct conn *conn, int length) {
+    int width, height;
+    int error = decode_lobby_hello(conn->in, length, conn->wire == WIRE_BINARY, &width, &height);
+
+    if (error != 0) {
+        reply_error(conn, error);
+        log_warn("[Server] Invalid lobby hello received");
+        return;
+    }
+    conn->lobby_class = lobby_class_for(width, height);
+    lobby_leave_match(conn);
+    if (width > 0) {
+        log_info("[Server] Lobby client waiting for a %dx%d board", width, height);
+    } else {
+        log_info("[Server] Lobby client waiting for any board");
+    }
+}
+
+// Handles the buffered packets of a connection for as long as the match is
+// waiting on it, so pipelined packets are answered in order without another
+// read. Stops early when the write buffer cannot take a full reply.
+void conn_process_input(struct conn *conn) {
+    while (conn->fd != -1 && conn_has_turn(conn) && conn_out_space(conn) > BUFFER_SIZE + 1) {
+        if (conn_refill_input(conn)) {
+            continue;  // The bytes may have settled the protocol, or closed the connection
+        }
+        bool binary = conn->wire == WIRE_BINARY;
+        int length = binary ? ring_take_frame(&conn->input, conn->in, WIRE_FRAME_MAX)
+                            : ring_take_line(&conn->input, conn->in, BUFFER_SIZE + 1);
+
+        if (length == RING_LINE_TOO_LONG) {
+            log_warn("[Server] Packet from Player %d exceeds %d bytes, dropping connection", conn->player + 1, binary ? WIRE_FRAME_MAX : BUFFER_SIZE);
+            conn_close(conn);
+            return;
+        }
+        if (length == RING_NO_LINE) {
+            if (!conn->eof) {
+                return;
+            }
+            // A final text packet may lack its terminator
+            length = binary ? 0 : ring_take_rest(&conn->input, conn->in, BUFFER_SIZE + 1);
+            if (length <= 0) {
+                log_info("[Server] Player %d disconnected", conn->player + 1);
+                conn_close(conn);
+                return;
+            }
+        }
+
+        if (length == 0 && conn->framed) {
+            continue;  // Blank lines carry no packet
+        }
+        if (conn->lobby == LOBBY_PLAYING && conn->match->game.phase == PHASE_HALT && (conn->in[0] == 'L' || conn->in[0] == 'M')) {
+            // A lobby client may move on without acknowledging the halt first
+            handle_halt_packet(conn->match, conn->player, NULL);
+        }
+        if (conn->lobby == LOBBY_AFTER_MATCH && is_rematch_request(conn->in, length, binary)) {
+            lobby_rematch(conn);
+            continue;
+        }
+        if (conn->lobby == LOBBY_HELLO || conn->lobby == LOBBY_AFTER_MATCH) {
+            lobby_read_hello(conn, length);
+            continue;
+        }
+
+        struct packet packet;
+        if (binary) {
+            wire_decode_packet((const uint8_t *)conn->in, length, &packet);
+        } else {
+            decode_packet(conn->in, &packet);
+        }
+        struct shard *shard = conn->shard;
+        uint64_t start = metrics_now_ns();
+        metrics_add(&shard->packets, 1);
+        conn->answering = true;
+        match_handle_packet(conn->match, conn->player, &packet);
+        conn->answering = false;
+        metrics_record(&shard->metrics.packet_ns[packet.kind], metrics_now_ns() - start);
+    }
+}
+
+/*
+ * Match recording, see record.h. Every record is built on the stack and
+ * copied into the shard's ring in one piece.
+ */
+
+#define RECORD_PACKET_MAX (RECORD_HEADER_SIZE + 8 + VOLLEY_MAX_SHOTS * WIRE_SHOT_SIZE + VOLLEY_MAX_SHOTS / 8)
+
+static inline uint32_t record_time_us(const struct match *match) {
+    return (uint32_t)((metrics_now_ns() - match->started_ns) / 1000);
+}
+
+void record_match_start(struct match *match) {
+    uint8_t record[RECORD_HEADER_SIZE + 12];
+
+    if (!match->shard->record) {
+        return;
+    }
+    record_put_header(record, 'M', 0, 0, match->id, 0, 12);
+    wire_put_u32(record + RECORD_HEADER_SIZE, match->shard->id);
+    record_put_u64(record + RECORD_HEADER_SIZE + 4, record_wall_clock_ns());
+    record_ring_put(match->shard->record, record, sizeof(record));
+}
+
+void record_match_end(struct match *match) {
+    uint8_t record[RECORD_HEADER_SIZE + 1];
+
+    if (!match->shard->record) {
+        return;
+    }
+    record_put_header(record, 'X', 0, 0, match->id, record_time_us(match), 1);
+    record[RECORD_HEADER_SIZE] = match->game.phase;
+    record_ring_put(match->shard->record, record, sizeof(record));
+}
+
+// Records an event without a payload, such as a player's disconnection.
+void record_event(struct match *match, char type, int player) {
+    uint8_t record[RECORD_HEADER_SIZE];
+
+    if (!match->shard->record) {
+        return;
+    }
+    record_put_header(record, type, player ? RECORD_PLAYER2 : 0, 0, match->id, record_time_us(match), 0);
+    record_ring_put(match->shard->record, record, sizeof(record));
+}
+
+// Records a packet the engine applied, with the outcome it answered.
+void record_packet(struct match *match, int player, const struct packet *packet, const struct engine_result *result) {
+    static const char types[PACKET_KINDS] = {
+        [PACKET_BEGIN] = 'B', [PACKET_INITIALIZE] = 'I', [PACKET_SHOOT] = 'S',
+        [PACKET_VOLLEY] = 'V', [PACKET_FORFEIT] = 'F',
+    };
+    uint32_t fired = result->reply == ENGINE_REPLY_VOLLEY ? result->fired : 0;
+    uint16_t error = result->reply == ENGINE_REPLY_ERROR || result->reply == ENGINE_REPLY_VOLLEY ? result->error : 0;
+    uint8_t record[RECORD_PACKET_MAX];
+    uint8_t *p = record + RECORD_HEADER_SIZE;
+    uint8_t flags = (player ? RECORD_PLAYER2 : 0) | (packet->bare ? RECORD_BARE : 0) |
+                    (packet->has_parameters ? RECORD_HAS_PARAMETERS : 0) | (packet->well_formed ? RECORD_WELL_FORMED : 0);
+
+    if (!types[packet->kind]) {
+        return;
+    }
+    memset(p, 0, RECORD_PACKET_MAX - RECORD_HEADER_SIZE);
+    switch (packet->kind) {
+    case PACKET_BEGIN:
+        if (packet->well_formed) {
+            wire_put_u32(p, packet->begin.width);
+            wire_put_u32(p + 4, packet->begin.height);
+        }
+        p += 8;
+        break;
+    case PACKET_INITIALIZE:
+        for (int i = 0; i < FLEET_SIZE && packet->well_formed; i++) {
+            const struct piece_placement *piece = &packet->pieces[i];
+            wire_put_u32(p + i * 16, piece->piece_type);
+            wire_put_u32(p + i * 16 + 4, piece->rotation);
+            wire_put_u32(p + i * 16 + 8, piece->ref_row);
+            wire_put_u32(p + i * 16 + 12, piece->ref_col);
+        }
+        p += FLEET_SIZE * 16;
+        break;
+    case PACKET_SHOOT:
+        if (packet->well_formed) {
+            wire_put_u32(p, packet->shot.row);
+            wire_put_u32(p + 4, packet->shot.col);
+        }
+        if (result->reply == ENGINE_REPLY_SHOT) {
+            p[8] = result->shot;
+        }
+        p += 9;
+        break;
+    case PACKET_VOLLEY: {
+        int count = packet->well_formed ? packet->volley.count : 0;
+
+        wire_put_u32(p, count);
+        for (int i = 0; i < count; i++) {
+            wire_put_u32(p + 4 + i * 8, packet->volley.cells[i][0]);
+            wire_put_u32(p + 8 + i * 8, packet->volley.cells[i][1]);
+        }
+        p += 4 + count * 8;
+        wire_put_u32(p, fired);
+        for (uint32_t i = 0; i < fired; i++) {
+            if (result->results[i] == HIT) {
+                p[4 + i / 8] |= 1u << (i % 8);
             }
-            free(board);
-            return NULL;
         }
+        p += 4 + (fired + 7) / 8;
+        break;
+    }
+    default:
+        break;
     }
-    return board;
+    uint32_t length = p - record - RECORD_HEADER_SIZE;
+    record_put_header(record, types[packet->kind], flags, error, match->id, record_time_us(match), length);
+    record_ring_put(match->shard->record, record, RECORD_HEADER_SIZE + length);
 }
 
-void print_board(int **board, int width, int height) {
-    printf("Current Board State:\n");
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            printf("%2d ", board[i][j]);
-        }
-        printf("\n");
+/*
+ * Matches. The engine decides what each packet does; the server answers the
+ * player, tells both players how the match ended and closes it. Packets from
+ * the player who is not expected to move stay buffered until its turn.
+ */
+
+struct match *match_create(struct shard *shard, struct conn *conn1, struct conn *conn2) {
+    struct match *match = object_pool_get(&shard->matches);
+    if (!match) {
+        return NULL;
     }
-    printf("\n");
+    match->shard = shard;
+    engine_match_reset(&match->game);  // A recycled match still holds its shot log buffers
+    match->game.pool = &shard->buffers;
+    match->halt[0] = HALT_DONE;
+    match->halt[1] = HALT_DONE;
+    match->started_ns = metrics_now_ns();
+    match->id = atomic_fetch_add_explicit(&next_match_id, 1, memory_order_relaxed);
+    match->players[0] = conn1;
+    match->players[1] = conn2;
+    conn1->match = match;
+    conn1->player = 0;
+    conn2->match = match;
+    conn2->player = 1;
+    metrics_add(&shard->active_matches, 1);
+    metrics_add(&shard->total_matches, 1);
+    metrics_add(&shard->metrics.phase_matches[PHASE_BEGIN_P1], 1);
+    record_match_start(match);
+    return match;
+}
+
+void match_free(struct match *match) {
+    struct shard *shard = match->shard;
+
+    metrics_add(&shard->active_matches, -1);
+    metrics_add(&shard->metrics.phase_matches[match->game.phase], -1);
+    metrics_record(&shard->metrics.match_us, (metrics_now_ns() - match->started_ns) / 1000);
+    record_match_end(match);
+    engine_match_recycle(&match->game);
+    object_pool_put(&shard->matches, match);
 }
 
-void free_board(int **board, int height) {
-    for (int i = 0; i < height; i++) {
-        free(board[i]);
+// Starts another game in a finished match, for two lobby clients that both
+// asked for a rematch. The players keep their seats and the engine keeps the
+// boards; to the metrics and the recording it is a new match.
+void match_restart(struct match *match) {
+    struct shard *shard = match->shard;
+    uint64_t now = metrics_now_ns();
+
+    record_match_end(match);
+    metrics_record(&shard->metrics.match_us, (now - match->started_ns) / 1000);
+    metrics_add(&shard->metrics.phase_matches[PHASE_HALT], -1);
+    metrics_add(&shard->metrics.phase_matches[PHASE_BEGIN_P1], 1);
+    metrics_add(&shard->total_matches, 1);
+
+    engine_match_reset(&match->game);
+    match->halt[0] = HALT_DONE;
+    match->halt[1] = HALT_DONE;
+    match->started_ns = now;
+    match->id = atomic_fetch_add_explicit(&next_match_id, 1, memory_order_relaxed);
+    record_match_start(match);
+    for (int i = 0; i < 2; i++) {
+        match->players[i]->lobby = LOBBY_PLAYING;
+        reply_seat(match->players[i], i);
     }
-    free(board);
+    log_info("[Server] Rematch started on shard %d", shard->id);
+    match_mark_dirty(match);
 }
 
-int base_shapes[7][4][2] = {
-    {{0, 0}, {0, 1}, {1, 0}, {1, 1}},  // O-piece
-    {{0, 0}, {1, 0}, {2, 0}, {3, 0}},  // I-piece
-    {{0, 0}, {0, 1}, {1, 1}, {1, 2}},  // S-piece
-    {{0, 0}, {1, 0}, {2, 0}, {2, 1}},  // L-piece
-    {{0, 1}, {0, 0}, {1, 1}, {1, 2}},  // Z-piece
-    {{0, 0}, {1, 0}, {2, 0}, {2, -1}}, // J-piece
-    {{0, 0}, {1, -1}, {1, 0}, {1, 1}}  // T-piece
-};
+// Keeps the per-phase counts in step after the match left phase `before`.
+void match_phase_changed(struct match *match, enum match_phase before) {
+    struct shard_metrics *metrics = &match->shard->metrics;
 
-void rotate_90(int *x, int *y) {
-    int temp = *x;
-    *x = *y;
-    *y = -temp;
+    if (match->game.phase == before) {
+        return;
+    }
+    metrics_add(&metrics->phase_matches[before], -1);
+    metrics_add(&metrics->phase_matches[match->game.phase], 1);
+    if (match->game.phase == PHASE_HALT) {
+        metrics_add(&metrics->ended_in[before], 1);
+    }
 }
 
-void get_piece_coordinates(int piece_type, int rotation, int ref_row, int ref_col, int coords[4][2]) {
-    for (int i = 0; i < 4; i++) {
-        int x = base_shapes[piece_type][i][0];
-        int y = base_shapes[piece_type][i][1];
-
-        if (rotation > 1) {
-            for (int r = 0; r < rotation - 1; r++) {
-                rotate_90(&x, &y);
-            }
+void match_mark_dirty(struct match *match) {
+    for (int i = 0; i < 2; i++) {
+        if (match->players[i]) {
+            conn_mark_dirty(match->players[i]);
         }
-        coords[i][0] = ref_row + x;
-        coords[i][1] = ref_col + y;
     }
 }
 
-int place_piece(int **board, int board_width, int board_height, int piece_type, int rotation, int ref_row, int ref_col, int piece_id) {
-    int coords[4][2];
-    get_piece_coordinates(piece_type, rotation, ref_row, ref_col, coords);
+// Ends the match during the Begin or Initialize phase: both players are told
+// the outcome right away.
+void match_halt_now(struct match *match, int loser) {
+    struct conn *loser_conn = match->players[loser];
+    struct conn *winner_conn = match->players[1 - loser];
+
+    if (loser_conn) {
+        reply_halt(loser_conn, false);
+        conn_end_match(loser_conn);
+    }
+    if (winner_conn) {
+        reply_halt(winner_conn, true);
+        conn_end_match(winner_conn);
+    }
+}
+
+// Ends the match during the shooting phase. The loser learns the outcome
+// immediately; the winner receives "H 1" in reply to its next packet.
+// When the fleet was sunk the loser's next packet is consumed as an
+// acknowledgment, as the blocking server did.
+void match_halt_after_ack(struct match *match, int loser, bool loser_acks) {
+    struct conn *loser_conn = match->players[loser];
 
-    // First pass: Validate the piece's placement
-    for (int i = 0; i < 4; i++) {
-        int row = coords[i][0];
-        int col = coords[i][1];
+    match->halt[1 - loser] = HALT_AWAIT_REPLY;
+    match->halt[loser] = HALT_DONE;
+
+    reply_halt(loser_conn, false);
+    if (loser_acks) {
+        match->halt[loser] = HALT_AWAIT_ACK;
+        conn_mark_dirty(loser_conn);
+    } else {
+        conn_end_match(loser_conn);
+    }
+    match_mark_dirty(match);
+}
 
-        // Debugging: Print the coordinates being checked
-        printf("[Server] Checking block %d of piece %d at (%d, %d)\n", i, piece_type, row, col);
+// A player's connection went away: the opponent wins.
+void match_player_lost(struct match *match, int player) {
+    struct conn *opponent = match->players[1 - player];
 
-        // Check for out-of-bounds coordinates
-        if (row < 0 || row >= board_height || col < 0 || col >= board_width) {
-            printf("[Server] Block %d of piece %d is out of bounds at (%d, %d)\n", i, piece_type, row, col);
-            return 302;  // Return error if even one block is out of bounds
-        }
+    enum match_phase before = match->game.phase;
 
-        // Check for overlapping cells
-        if (board[row][col] != 0) {
-            printf("[Server] Block %d of piece %d overlaps at (%d, %d)\n", i, piece_type, row, col);
-            return 303;  // Return error if the block overlaps an existing piece
+    if (before == PHASE_HALT) {
+        // The outcome is already decided; a rematch is off
+        if (opponent->lobby == LOBBY_REMATCH) {
+            log_info("[Server] Rematch opponent left; back to the lobby");
+            lobby_leave_match(opponent);
+            conn_mark_dirty(opponent);
         }
+        return;
     }
+    record_event(match, 'D', player);
+    match->game.phase = PHASE_HALT;
+    match_phase_changed(match, before);
+    reply_halt(opponent, true);
+    conn_end_match(opponent);
+}
 
-    // Second pass: Place the piece on the board
-    for (int i = 0; i < 4; i++) {
-        int row = coords[i][0];
-        int col = coords[i][1];
-        board[row][col] = piece_id;
-        printf("[Server] Placed block %d of piece %d at (%d, %d)\n", i, piece_type, row, col);
-    }
+void handle_halt_packet(struct match *match, int player, const struct packet *packet) {
+    struct conn *conn = match->players[player];
 
-    return 0;  // Success
+    (void)packet;
+    if (match->halt[player] == HALT_AWAIT_REPLY) {
+        reply_halt(conn, true);
+    }
+    match->halt[player] = HALT_DONE;
+    conn_end_match(conn);
 }
 
-int validate_piece_placement(int **board, int board_width, int board_height, int piece_type, int rotation, int ref_row, int ref_col) {
-    int coords[4][2];
-    get_piece_coordinates(piece_type, rotation, ref_row, ref_col, coords);
+void match_handle_packet(struct match *match, int player, const struct packet *packet) {
+    struct conn *conn = match->players[player];
+    enum match_phase before = match->game.phase;
+    struct engine_result result;
 
-    for (int i = 0; i < 4; i++) {
-        int row = coords[i][0];
-        int col = coords[i][1];
+    // The phase may change below, so both players' epoll interest is refreshed
+    // after the batch. This is done first because a halt can free the match.
+    match_mark_dirty(match);
 
-        if (row < 0 || row >= board_height || col < 0 || col >= board_width) {
-            return 302;
-        }
+    if (before == PHASE_HALT) {
+        handle_halt_packet(match, player, packet);
+        return;
+    }
+    engine_apply(&match->game, player, packet, &result);
+    if (result.out_of_memory) {
+        log_error("[Server] Out of memory applying a packet from Player %d, dropping connection", player + 1);
+        // Player 1 set the board size that could not be allocated
+        conn_close(before == PHASE_BEGIN_P2 && match->players[0] ? match->players[0] : conn);
+        return;
+    }
+    // Packets out of phase and queries leave the match as it was
+    if (match->shard->record && phase_rules[before][packet->kind] && packet->kind != PACKET_QUERY) {
+        record_packet(match, player, packet, &result);
+    }
+    match_phase_changed(match, before);
+
+    switch (result.reply) {
+    case ENGINE_REPLY_ACK:
+        reply_ack(conn);
+        break;
+    case ENGINE_REPLY_ERROR:
+        reply_error(conn, result.error);
+        break;
+    case ENGINE_REPLY_SHOT:
+        reply_shot(conn, result.remaining_ships, result.shot);
+        break;
+    case ENGINE_REPLY_VOLLEY:
+        reply_volley(conn, result.remaining_ships, result.error, result.results, result.fired);
+        break;
+    case ENGINE_REPLY_SHOTS:
+        handle_query_packet(conn, result.target, result.since);
+        break;
+    case ENGINE_REPLY_NONE:
+        break;
+    }
 
-        if (board[row][col] != 0) {
-            return 303;
+    if (result.loser >= 0) {
+        if (before <= PHASE_INIT_P2) {
+            match_halt_now(match, result.loser);
+        } else {
+            match_halt_after_ack(match, result.loser, result.sunk);
         }
     }
-
-    return 0;
 }
 
-int handle_initialize_packet(int conn_fd, int **board, int board_width, int board_height, char *packet) {
-    int piece_type, rotation, ref_row, ref_col;
-    int num_pieces = 5;
-    int offset = 2;
-    int lowest_error = 0;
+/*
+ * Event loop. Accepted connections wait in a per-seat queue until a connection
+ * for the other seat arrives, then the pair is registered with the epoll
+ * instance of the shard that completed it as a new match.
+ */
+
+int create_listener(int port, const char *role) {
+    int listen_fd;
+    struct sockaddr_in address;
+    int opt = 1;
 
-    // Validate the packet header
-    if (strncmp(packet, "I ", 2) != 0) {
-        send(conn_fd, "E 101", strlen("E 101"), 0);
+    // Socket creation
+    if ((listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0)) == -1) {
+        fprintf(stderr, "[Server] socket() failed for %s: %s\n", role, strerror(errno));
         return -1;
     }
 
-    // Validate the number of parameters
-    int parameter_count = 0;
-    for (int i = 2; packet[i] != '\0'; i++) {
-        if (!isspace(packet[i]) && (i == 2 || isspace(packet[i - 1]))) {
-            parameter_count++;
-        }
+    // Set socket options; SO_REUSEPORT lets every shard bind its own listener
+    if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1 ||
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
+        fprintf(stderr, "[Server] setsockopt() failed for %s: %s\n", role, strerror(errno));
+        close(listen_fd);
+        return -1;
     }
-    if (parameter_count != (num_pieces * 4)) {
-        send(conn_fd, "E 201", strlen("E 201"), 0);
+
+    // Initialize address structure
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    // Bind socket to port
+    if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1) {
+        fprintf(stderr, "[Server] bind() failed for %s: %s\n", role, strerror(errno));
+        close(listen_fd);
         return -1;
     }
 
-    // Temporary board for validation
-    int **temp_board = initialize_board(board_width, board_height);
-    if (!temp_board) {
-        perror("Failed to allocate temporary board");
-        exit(EXIT_FAILURE);
+    // Listen
+    if (listen(listen_fd, SOMAXCONN) == -1) {
+        fprintf(stderr, "[Server] listen() failed for %s: %s\n", role, strerror(errno));
+        close(listen_fd);
+        return -1;
     }
+    return listen_fd;
+}
 
-    // Validate each piece
-    for (int i = 0; i < num_pieces; i++) {
-        int parsed = sscanf(packet + offset, "%d %d %d %d", &piece_type, &rotation, &ref_row, &ref_col);
+void start_match(struct shard *shard, struct conn *conn1, struct conn *conn2) {
+    struct conn *pair[2] = {conn1, conn2};
 
-        if (parsed != 4) {
-            if (lowest_error == 0 || lowest_error > 201) {
-                lowest_error = 201;
-            }
-            continue;
+    struct match *match = match_create(shard, conn1, conn2);
+    if (!match) {
+        perror("[Server] Failed to allocate match");
+        for (int i = 0; i < 2; i++) {
+            close(pair[i]->fd);
+            conn_free(pair[i]);
         }
+        return;
+    }
 
-        if (piece_type < 1 || piece_type > 7) {
-            if (lowest_error == 0 || lowest_error > 300) {
-                lowest_error = 300;
-            }
+    // The match is pinned to this shard from now on. With io_uring, the
+    // receives are posted to this shard's ring by the first flush.
+    for (int i = 0; i < 2; i++) {
+        pair[i]->shard = shard;
+        struct epoll_event event = { .events = 0, .data.ptr = pair[i] };
+        if (io_backend == IO_EPOLL && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, pair[i]->fd, &event) == -1) {
+            perror("[Server] epoll_ctl() failed");
+            pair[i]->broken = true;
         }
-
-        if (rotation < 1 || rotation > 4) {
-            if (lowest_error == 0 || lowest_error > 301) {
-                lowest_error = 301;
-            }
+        pair[i]->events = 0;
+        if (pair[i]->lobby != LOBBY_NONE) {
+            pair[i]->lobby = LOBBY_PLAYING;
+            reply_seat(pair[i], i);
         }
+    }
+    log_info("[Server] Match started on shard %d (%lu active)", shard->id, atomic_load_explicit(&shard->active_matches, memory_order_relaxed));
+    log_info("[Server] Waiting for valid Begin or Forfeit packet from Player 1...");
+    match_mark_dirty(match);
+}
 
-        piece_type -= 1;
-        rotation -= 1;
-
-        // Validate placement on the temporary board
-        int error_code = place_piece(temp_board, board_width, board_height, piece_type, rotation, ref_row, ref_col, i + 1);
-        if (error_code && (lowest_error == 0 || lowest_error > error_code)) {
-            lowest_error = error_code;
+// Queues a freshly accepted connection, or takes the oldest connection
+// waiting for the other seat and starts a match with it on this shard.
+void pair_connection(struct shard *shard, struct conn *conn) {
+    int seat = conn->player;
+    struct conn *opponent;
+
+    pthread_mutex_lock(&pairing.lock);
+    opponent = pairing.head[1 - seat];
+    if (opponent) {
+        pairing.head[1 - seat] = opponent->next;
+        if (!pairing.head[1 - seat]) {
+            pairing.tail[1 - seat] = NULL;
         }
-
-        offset += snprintf(NULL, 0, "%d %d %d %d ", piece_type + 1, rotation + 1, ref_row, ref_col);
+        opponent->next = NULL;
+    } else {
+        if (pairing.tail[seat]) {
+            pairing.tail[seat]->next = conn;
+        } else {
+            pairing.head[seat] = conn;
+        }
+        pairing.tail[seat] = conn;
     }
+    pthread_mutex_unlock(&pairing.lock);
 
-    free_board(temp_board, board_height);
-
-    // If any validation error occurred, send the lowest error code
-    if (lowest_error != 0) {
-        char error_msg[BUFFER_SIZE];
-        snprintf(error_msg, sizeof(error_msg), "E %d", lowest_error);
-        send(conn_fd, error_msg, strlen(error_msg), 0);
-        return -1;
+    if (!opponent) {
+        return;
     }
+    if (seat == 0) {
+        start_match(shard, conn, opponent);
+    } else {
+        start_match(shard, opponent, conn);
+    }
+}
 
-    // Place the pieces on the actual game board
-    offset = 2;
-    for (int i = 0; i < num_pieces; i++) {
-        sscanf(packet + offset, "%d %d %d %d", &piece_type, &rotation, &ref_row, &ref_col);
-        piece_type -= 1;
-        rotation -= 1;
-
-        place_piece(board, board_width, board_height, piece_type, rotation, ref_row, ref_col, i + 1);
+// Whether a waiting lobby client is still connected. Nothing watches its
+// socket while it waits, since whichever shard pairs it takes it over, so the
+// client that would pair with it looks: a hangup peeks as end of file, while
+// packets sent ahead, like the B a client pipelines after its hello, peek as
+// data.
+static bool lobby_waiter_alive(struct conn *conn) {
+    char byte;
 
-        offset += snprintf(NULL, 0, "%d %d %d %d ", piece_type + 1, rotation + 1, ref_row, ref_col);
+    if (conn->eof) {
+        return false;
     }
-
-    send(conn_fd, "A", strlen("A"), 0);
-    return 0;
+    ssize_t peeked = recv(conn->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    return peeked > 0 || (peeked == -1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
 }
 
-int is_ship_sunk(int **board, int width, int height, int piece_id) {
-    for (int i = 0; i < height; i++) {
-        for (int j = 0; j < width; j++) {
-            if (board[i][j] == piece_id) {
-                return 0;  // Ship is not yet sunk
-            }
+// Pairs a lobby client with the one waiting in its class, or leaves it
+// waiting there. A client either takes the waiting one or waits itself, so
+// at most one client of a class ever waits and nobody queues behind it. The
+// slot of a class is only ever swapped between empty and one connection, so
+// a CAS loop is all the synchronization it needs. A waiting client that hung
+// up is dropped and the slot tried again. The client that waited becomes
+// Player 1.
+void lobby_pair(struct shard *shard, struct conn *conn) {
+    _Atomic(struct conn *) *slot = &lobby_waiting[conn->lobby_class];
+    struct conn *waiting = atomic_load_explicit(slot, memory_order_acquire);
+
+    conn->lobby = LOBBY_QUEUED;
+    while (1) {
+        struct conn *desired = waiting ? NULL : conn;
+        if (!atomic_compare_exchange_weak_explicit(slot, &waiting, desired, memory_order_acq_rel, memory_order_acquire)) {
+            continue;
+        }
+        if (!waiting) {
+            return;
+        }
+        if (lobby_waiter_alive(waiting)) {
+            break;
         }
+        log_info("[Server] Lobby client left while waiting");
+        close(waiting->fd);
+        conn_free(waiting);
+        waiting = atomic_load_explicit(slot, memory_order_acquire);
     }
-    return 1;  // Ship is fully sunk
+    log_info("[Server] Lobby clients paired");
+    start_match(shard, waiting, conn);
 }
 
-int count_remaining_ships(int **opponent_board, int board_width, int board_height) {
-    int ship_counts[5] = {0};
-    int remaining_ships = 0;
-
-    for (int i = 0; i < board_height; i++) {
-        for (int j = 0; j < board_width; j++) {
-            int cell = opponent_board[i][j];
-            if (cell >= 1 && cell <= 5) {
-                ship_counts[cell - 1] = 1;
+// Hands a lobby client that sent its hello over to matchmaking. The shard
+// that accepted it lets go of it first, since the match may start on another
+// shard. With io_uring that takes the last completion of its receive, which
+// brings the connection back here.
+void lobby_enqueue(struct shard *shard, struct conn *conn) {
+    if (io_backend == IO_URING) {
+        if (conn->recv_armed) {
+            if (!conn->recv_cancelled) {
+                uring_cancel(conn, URING_RECV);
             }
+            return;
         }
+    } else if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL) == -1) {
+        perror("[Server] epoll_ctl() failed");
+        conn_close(conn);
+        return;
     }
+    conn->events = 0;
+    lobby_pair(shard, conn);
+}
 
-    for (int i = 0; i < 5; i++) {
-        remaining_ships += ship_counts[i];
+void accept_connection(struct shard *shard, struct listener *listener, int conn_fd) {
+    struct conn *conn = calloc(1, sizeof(struct conn));
+    if (!conn) {
+        perror("[Server] Failed to allocate connection");
+        close(conn_fd);
+        return;
+    }
+    conn->kind = ENDPOINT_CONN;
+    conn->fd = conn_fd;
+    conn->shard = shard;
+    metrics_add(&shard->connections, 1);
+
+    if (listener->player != SEAT_LOBBY) {
+        conn->player = listener->player;
+        log_info("[Server] Player %d connected!", listener->player + 1);
+        pair_connection(shard, conn);
+        return;
     }
 
-    return remaining_ships;
+    // Lobby clients are read right away for their hello, which has usually
+    // arrived with the connection
+    conn->lobby = LOBBY_HELLO;
+    if (io_backend == IO_URING) {
+        log_info("[Server] Lobby client connected");
+        conn_mark_dirty(conn);
+        return;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = conn };
+    if (epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, conn_fd, &event) == -1) {
+        perror("[Server] epoll_ctl() failed");
+        close(conn_fd);
+        free(conn);
+        return;
+    }
+    conn->events = EPOLLIN;
+    log_info("[Server] Lobby client connected");
+    conn_handle_readable(conn);
 }
 
-char **initialize_shot_history(int width, int height) {
-    char **history = malloc(height * sizeof(char *));
-    if (!history){
-        return NULL;
-    }
-    for (int i = 0; i < height; i++) {
-        history[i] = malloc(width * sizeof(char));
-        if (!history[i]) {
-            for (int j = 0; j < i; j++) {
-                free(history[j]);
+void accept_connections(struct shard *shard, struct listener *listener) {
+    // A bounded batch keeps a connection storm from holding up the packets of
+    // running matches; the listener stays readable until the backlog is empty
+    for (int accepted = 0; accepted < ACCEPT_BATCH; accepted++) {
+        int conn_fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK);
+        if (conn_fd == -1) {
+            if (errno == EINTR) {
+                continue;
             }
-            free(history);
-            return NULL;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("[Server] accept() failed");
+            }
+            break;
         }
-        memset(history[i], 0, width * sizeof(char));
+        accept_connection(shard, listener, conn_fd);
     }
-    return history;
 }
 
-void free_shot_history(char **history, int height) {
-    for (int i = 0; i < height; i++) {
-        free(history[i]);
+// Handles the buffered packets and flushes the replies of every connection
+// touched during the last batch of events, then releases the connections
+// closed during it. Handling a packet can give the turn to the opponent, whose
+// connection is then marked dirty and processed in the same pass.
+void flush_dirty_connections(struct shard *shard) {
+    while (shard->dirty) {
+        struct conn *conn = shard->dirty;
+        shard->dirty = conn->dirty_next;
+        conn->dirty = false;
+
+        if (conn->fd == -1) {
+            continue;
+        }
+        if (!conn->broken) {
+            conn_process_input(conn);
+        }
+        if (conn->fd == -1) {
+            continue;
+        }
+        if (!conn->broken) {
+            conn_flush(conn);
+        }
+        // A connection listed again during the pass is handed over on its last visit
+        if (conn->lobby == LOBBY_READY && !conn->dirty && !conn->broken && conn_out_pending(conn) == 0) {
+            lobby_enqueue(shard, conn);
+            continue;
+        }
+        if (!conn->broken) {
+            conn_update_events(conn);
+        }
+        if (conn->broken) {
+            conn_close(conn);
+        }
     }
-    free(history);
-}
-
-int handle_shoot_packet(int conn_fd, int **opponent_board, char **shot_history, int board_width, int board_height, int *remaining_ships, int conn_fd_opponent, char *packet) {
-    int row, col;
-    char extra;
 
-    // Parse the "Shoot" packet and validate the format
-    if (sscanf(packet, "S %d %d %c", &row, &col, &extra) != 2) {
-        printf("[Server] Invalid shoot packet format: '%s'\n", packet);
-        send(conn_fd, "E 202", strlen("E 202"), 0);  // Invalid number of parameters
-        return -1;
+    while (shard->graveyard) {
+        struct conn *conn = shard->graveyard;
+        shard->graveyard = conn->graveyard_next;
+        if (conn->recv_armed || conn->send_busy) {
+            conn->released = true;  // Freed by the last completion of its requests
+            continue;
+        }
+        conn_free(conn);
     }
+}
 
-    // Check if the coordinates are out of bounds
-    if (row < 0 || row >= board_height || col < 0 || col >= board_width) {
-        printf("[Server] Out-of-bounds coordinates: row=%d, col=%d (board: %dx%d)\n", row, col, board_width, board_height);
-        send(conn_fd, "E 400", strlen("E 400"), 0);  // Shot is out of bounds
-        return -1;
-    }
+void *run_event_loop(void *arg) {
+    struct shard *shard = arg;
+    struct epoll_event events[MAX_EVENTS];
 
-    // Check if the cell has already been shot at
-    if (shot_history[row][col] != EMPTY) {
-        printf("[Server] Cell already shot at: row=%d, col=%d\n", row, col);
-        send(conn_fd, "E 401", strlen("E 401"), 0);  // Shot already taken
-        return -1;
-    }
+    while (1) {
+        int ready = epoll_wait(shard->epoll_fd, events, MAX_EVENTS, -1);
+        if (ready == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("[Server] epoll_wait() failed");
+            exit(EXIT_FAILURE);
+        }
 
-    // Determine the result of the shot
-    char shot_result;
-    int piece_id = opponent_board[row][col];
-    if (piece_id != 0) {
-        // It's a hit
-        shot_result = 'H';
-        shot_history[row][col] = HIT;
-        opponent_board[row][col] = 'H';  // Mark the hit on the opponent's board
-        printf("[Server] Hit detected at row=%d, col=%d (Piece ID: %d)\n", row, col, piece_id);
+        for (int i = 0; i < ready; i++) {
+            enum endpoint_kind kind = *(enum endpoint_kind *)events[i].data.ptr;
 
-        // Check if the hit ship is sunk
-        if (is_ship_sunk(opponent_board, board_width, board_height, piece_id)) {
-            (*remaining_ships)--;  // Decrement remaining ships if the ship is sunk
-            printf("[Server] Ship with ID %d is sunk! Remaining ships: %d\n", piece_id, *remaining_ships);
-        }
-    } else {
-        // It's a miss
-        shot_result = 'M';
-        shot_history[row][col] = MISS;
-        printf("[Server] Miss at row=%d, col=%d\n", row, col);
-    }
+            if (kind == ENDPOINT_LISTENER) {
+                accept_connections(shard, events[i].data.ptr);
+                continue;
+            }
 
-    // Respond to the shooter with the result of the shot
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "R %d %c", *remaining_ships, shot_result);
-    send(conn_fd, response, strlen(response), 0);
-    printf("[Server] Shot result sent: %s\n", response);
+            struct conn *conn = events[i].data.ptr;
+            if (conn->fd == -1) {
+                continue;  // Closed earlier in this batch
+            }
+            if (events[i].events & EPOLLOUT) {
+                conn_mark_dirty(conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                conn_handle_readable(conn);
+            }
+        }
 
-    // Check if all ships are sunk, and send game halt if necessary
-    if (*remaining_ships == 0) {
-        printf("[Server] All ships sunk. Ending game.\n");
-        send(conn_fd_opponent, "H 0", strlen("H 0"), 0);
-        recv(conn_fd_opponent, response, BUFFER_SIZE, 0);  // Wait for acknowledgment
-        send(conn_fd, "H 1", strlen("H 1"), 0);
-        return 1;  // Game over
+        flush_dirty_connections(shard);
     }
+}
 
-    return 0;
+/*
+ * The io_uring event loop. Each listener has a multishot accept and each
+ * connection a multishot receive posted, so a pass of the loop makes a single
+ * system call: the requests and sends queued during the previous pass are
+ * submitted with the wait for the next completions. Completions are handled
+ * like epoll events, then the same flush answers the packets they brought.
+ */
+
+// Frees a closed connection whose last request just completed.
+static void uring_retire(struct conn *conn) {
+    if (conn->released && !conn->recv_armed && !conn->send_busy) {
+        conn_free(conn);
+    }
 }
 
-void handle_query_packet(int conn_fd, char **shot_history, int **opponent_board, int board_width, int board_height) {
-    int remaining_ships = count_remaining_ships(opponent_board, board_width, board_height);
+void uring_accept(struct shard *shard, struct listener *listener) {
+    struct io_uring_sqe *sqe = uring_get_sqe(&shard->ring);
 
-    char response[BUFFER_SIZE];
-    snprintf(response, sizeof(response), "G %d", remaining_ships);
-
-    for (int i = 0; i < board_height; i++) {
-        for (int j = 0; j < board_width; j++) {
-            if (shot_history[i][j] == 'H' || shot_history[i][j] == 'M') {
-                char shot_entry[16];
-                snprintf(shot_entry, sizeof(shot_entry), " %c %d %d", shot_history[i][j], i, j);
-                strncat(response, shot_entry, sizeof(response) - strlen(response) - 1);
-            }
-        }
+    if (!sqe) {
+        perror("[Server] io_uring_enter() failed");
+        exit(EXIT_FAILURE);
     }
-
-    send(conn_fd, response, strlen(response), 0);
+    uring_prep_accept_multishot(sqe, listener->fd, SOCK_NONBLOCK, uring_data(listener, URING_ACCEPT));
 }
 
-void handle_forfeit_packet(int conn_fd, int conn_fd_opponent) {
-    send(conn_fd, "H 0", strlen("H 0"), 0);
-    char buffer[BUFFER_SIZE];
-    recv(conn_fd, buffer, BUFFER_SIZE, 0);
-    send(conn_fd_opponent, "H 1", strlen("H 1"), 0);
+void uring_accepted(struct shard *shard, struct listener *listener, const struct io_uring_cqe *cqe) {
+    if (cqe->res >= 0) {
+        accept_connection(shard, listener, cqe->res);
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        errno = -cqe->res;
+        perror("[Server] accept() failed");
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_accept(shard, listener);
+    }
 }
 
-void game_loop(int conn_fd1, int conn_fd2) {
-    char buffer[BUFFER_SIZE];
-    int board_width, board_height;
-    int **player1_board = NULL;
-    int **player2_board = NULL;
-    char **player1_shot_history = NULL;
-    char **player2_shot_history = NULL;
+void uring_received(struct conn *conn, const struct io_uring_cqe *cqe) {
+    struct uring_buffers *buffers = &conn->shard->recv_buffers;
 
-    // Phase 1: Waiting for "Begin" or "Forfeit" packets from both players
-    printf("[Server] Waiting for valid Begin or Forfeit packet from Player 1...\n");
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            perror("Failed to receive Begin or Forfeit packet from Player 1");
-            exit(EXIT_FAILURE);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        uint16_t id = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && conn->fd != -1) {
+            conn_received(conn, uring_buffer(buffers, id), cqe->res);
         }
+        uring_buffers_put(buffers, id);
+    }
+    if (cqe->flags & IORING_CQE_F_MORE) {
+        return;
+    }
 
-        // Ensure null-termination for safety
-        buffer[bytes_received] = '\0';
-
-        // Check if the packet starts with 'B'
-        if (strncmp(buffer, "B", 1) == 0) {
-            char remaining_chars;
-            int parsed = sscanf(buffer, "B %d %d%c", &board_width, &board_height, &remaining_chars);
-            
-            if (parsed == 2) {  // Valid format with exactly two parameters
-                if (board_width >= 10 && board_height >= 10) {
-                    send(conn_fd1, "A", strlen("A"), 0);
-                    printf("[Server] Board initialized with size %dx%d\n", board_width, board_height);
-                    break;
-                } else {  // Invalid dimensions
-                    send(conn_fd1, "E 200", strlen("E 200"), 0);
-                    fprintf(stderr, "[Server] Invalid board dimensions received from Player 1\n");
-                }
-            } else {  // Malformed "B" packet
-                send(conn_fd1, "E 200", strlen("E 200"), 0);
-                fprintf(stderr, "[Server] Malformed Begin packet received from Player 1\n");
-            }
-        }
-        // Check if the packet is a "Forfeit" packet
-        else if (strcmp(buffer, "F") == 0 || strcmp(buffer, "F\n") == 0) {
-            send(conn_fd1, "H 0", strlen("H 0"), 0);
-            send(conn_fd2, "H 1", strlen("H 1"), 0);
-            printf("[Server] Player 1 forfeited during Begin phase. Game halted.\n");
-            exit(EXIT_SUCCESS);
+    // The receive ended: the peer hung up, it was cancelled, or it ran out of
+    // buffers and is posted again by the flush
+    conn->recv_armed = false;
+    conn->recv_cancelled = false;
+    if (conn->fd == -1) {
+        uring_retire(conn);
+        return;
+    }
+    if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        if (conn->closing) {
+            conn_close(conn);
+            return;
         }
-        // If the packet is neither "B" nor "F", it is an invalid command
-        else {
-            send(conn_fd1, "E 100", strlen("E 100"), 0);
-            fprintf(stderr, "[Server] Invalid packet type received from Player 1\n");
+        if (cqe->res < 0) {
+            errno = -cqe->res;
+            perror("[Server] recv() failed");
+            conn_close(conn);
+            return;
         }
+        // Packets already received are still answered before the hangup counts
+        conn->eof = true;
     }
+    conn_mark_dirty(conn);
+}
 
-    printf("[Server] Waiting for valid Begin or Forfeit packet from Player 2...\n");
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            perror("Failed to receive Begin or Forfeit packet from Player 2");
-            exit(EXIT_FAILURE);
-        }
-
-        // Ensure null-termination for safety
-        buffer[bytes_received] = '\0';
+void uring_sent(struct conn *conn, const struct io_uring_cqe *cqe) {
+    conn->send_busy = false;
+    if (conn->fd == -1) {
+        uring_retire(conn);
+        return;
+    }
+    if (cqe->res >= 0) {
+        conn_consume_output(conn, cqe->res);
+        metrics_add(&conn->shard->metrics.bytes_out, cqe->res);
+    } else if (cqe->res != -EAGAIN && cqe->res != -EINTR) {
+        conn->broken = true;
+    }
+    conn_mark_dirty(conn);  // Sends the rest, or lets held back packets through
+}
 
-        // Validate Player 2's packet strictly
-        if (strcmp(buffer, "B") == 0 || strcmp(buffer, "B\n") == 0) {  // Accept "B" or "B\n" only
-            send(conn_fd2, "A", strlen("A"), 0);
-            printf("[Server] Valid Begin packet received from Player 2\n");
-            break;
-        } 
-        else if (strncmp(buffer, "B ", 2) == 0) {  // Reject "B" with parameters
-            send(conn_fd2, "E 200", strlen("E 200"), 0);
-            fprintf(stderr, "[Server] Invalid Begin packet format for Player 2: extra parameters\n");
-        }
-        else if (strcmp(buffer, "F") == 0 || strcmp(buffer, "F\n") == 0) {  // Check for "Forfeit"
-            send(conn_fd2, "H 0", strlen("H 0"), 0);
-            send(conn_fd1, "H 1", strlen("H 1"), 0);
-            printf("[Server] Player 2 forfeited during Begin phase. Game halted.\n");
-            exit(EXIT_SUCCESS);
-        } 
-        else {  // Any other invalid format
-            send(conn_fd2, "E 100", strlen("E 100"), 0);
-            fprintf(stderr, "[Server] Invalid packet type received from Player 2 during Begin phase\n");
-        }
-    }
-
-    // Initialize the boards after both players send valid Begin packets
-    player1_board = initialize_board(board_width, board_height);
-    player2_board = initialize_board(board_width, board_height);
-    if (player1_board == NULL || player2_board == NULL) {
-        perror("Failed to allocate memory for player boards");
+// Sets up the ring of a worker. That is done by the worker itself, since
+// only the thread that created a ring may submit to it.
+void uring_shard_start(struct shard *shard) {
+    if (uring_init(&shard->ring, URING_ENTRIES) == -1) {
+        perror("[Server] io_uring_setup() failed");
         exit(EXIT_FAILURE);
     }
+    if (uring_buffers_init(&shard->ring, &shard->recv_buffers, URING_RECV_GROUP, URING_RECV_BUFFERS, URING_RECV_BUFFER_SIZE) == -1) {
+        perror("[Server] Failed to register receive buffers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < 3; i++) {
+        uring_accept(shard, &shard->listeners[i]);
+    }
+}
 
-    // Phase 2: Waiting for "Initialize" packets from both players
-    printf("[Server] Waiting for valid Initialize or Forfeit packet from Player 1...\n");
+void *run_uring_loop(void *arg) {
+    struct shard *shard = arg;
+
+    uring_shard_start(shard);
     while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            perror("Failed to receive Initialize or Forfeit packet from Player 1");
+        if (uring_submit(&shard->ring, 1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("[Server] io_uring_enter() failed");
             exit(EXIT_FAILURE);
         }
 
-        buffer[bytes_received] = '\0';
+        struct io_uring_cqe *next;
+        for (int handled = 0; handled < MAX_EVENTS && (next = uring_peek(&shard->ring)); handled++) {
+            struct io_uring_cqe cqe = *next;
+            void *target = (void *)(uintptr_t)(cqe.user_data & ~(uint64_t)URING_OP_MASK);
 
-        // Check for "Forfeit" packet from Player 1
-        if (strcmp(buffer, "F\n") == 0 || strcmp(buffer, "F") == 0) {
-            send(conn_fd1, "H 0", strlen("H 0"), 0);
-            send(conn_fd2, "H 1", strlen("H 1"), 0);
-            printf("[Server] Player 1 forfeited during Initialize phase. Game halted.\n");
-            exit(EXIT_SUCCESS);
+            uring_advance(&shard->ring);
+            switch (cqe.user_data & URING_OP_MASK) {
+            case URING_ACCEPT:
+                uring_accepted(shard, target, &cqe);
+                break;
+            case URING_RECV:
+                uring_received(target, &cqe);
+                break;
+            case URING_SEND:
+                uring_sent(target, &cqe);
+                break;
+            default:
+                break;  // Cancellations are seen through the cancelled request
+            }
         }
 
-        if (handle_initialize_packet(conn_fd1, player1_board, board_width, board_height, buffer) == 0) {
-            printf("[Server] Player 1's board initialized successfully.\n");
-            print_board(player1_board, board_width, board_height);
-            break;
-        }
+        flush_dirty_connections(shard);
     }
+}
 
-    printf("[Server] Waiting for valid Initialize or Forfeit packet from Player 2...\n");
-    while (1) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            perror("Failed to receive Initialize or Forfeit packet from Player 2");
-            exit(EXIT_FAILURE);
-        }
+// Lifts the soft descriptor limit to the hard one so that thousands of
+// matches can be hosted by a single process.
+void raise_file_limit(void) {
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
 
-        buffer[bytes_received] = '\0';
+int shard_init(struct shard *shard, int id) {
+    static const int ports[3] = {PORT_PLAYER1, PORT_PLAYER2, PORT_LOBBY};
+    static const int seats[3] = {0, 1, SEAT_LOBBY};
+    static const char *const roles[3] = {"Player 1", "Player 2", "the lobby"};
+
+    shard->id = id;
+    object_pool_init(&shard->matches, sizeof(struct match));
+    shard->epoll_fd = -1;
+    shard->ring.fd = -1;
+    if (io_backend == IO_EPOLL && (shard->epoll_fd = epoll_create1(0)) == -1) {
+        perror("[Server] epoll_create1() failed");
+        return -1;
+    }
 
-        // Check for "Forfeit" packet from Player 2
-        if (strcmp(buffer, "F\n") == 0 || strcmp(buffer, "F") == 0) {
-            send(conn_fd2, "H 0", strlen("H 0"), 0);
-            send(conn_fd1, "H 1", strlen("H 1"), 0);
-            printf("[Server] Player 2 forfeited during Initialize phase. Game halted.\n");
-            exit(EXIT_SUCCESS);
+    for (int i = 0; i < 3; i++) {
+        struct listener *listener = &shard->listeners[i];
+        listener->kind = ENDPOINT_LISTENER;
+        listener->player = seats[i];
+        listener->fd = create_listener(ports[i], roles[i]);
+        if (listener->fd == -1) {
+            return -1;
+        }
+        if (seats[i] == SEAT_LOBBY) {
+            // Lobby clients speak first, so they are accepted with their hello
+            int defer_seconds = 1;
+            setsockopt(listener->fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer_seconds, sizeof(defer_seconds));
         }
 
-        if (handle_initialize_packet(conn_fd2, player2_board, board_width, board_height, buffer) == 0) {
-            printf("[Server] Player 2's board initialized successfully.\n");
-            print_board(player2_board, board_width, board_height);
-            break;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = listener };
+        if (io_backend == IO_EPOLL && epoll_ctl(shard->epoll_fd, EPOLL_CTL_ADD, listener->fd, &event) == -1) {
+            perror("[Server] epoll_ctl() failed for listener");
+            return -1;
         }
     }
+    return 0;
+}
 
-    printf("[Server] Both players have successfully initialized their boards.\n");
-
-    // Initialize shot histories for both players
-    player1_shot_history = initialize_shot_history(board_width, board_height);
-    player2_shot_history = initialize_shot_history(board_width, board_height);
+// Pins a worker to one core so that its matches keep a warm cache.
+void pin_to_core(pthread_t thread, int core) {
+    cpu_set_t cpus;
 
-    int player1_remaining_ships = count_remaining_ships(player2_board, board_width, board_height);
-    int player2_remaining_ships = count_remaining_ships(player1_board, board_width, board_height);
-    int game_is_active = 1;
+    CPU_ZERO(&cpus);
+    CPU_SET(core, &cpus);
+    pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+}
 
-    while (game_is_active) {
-        // Player 1's turn
-        while (1) {
-            memset(buffer, 0, BUFFER_SIZE);
-            int bytes_received = recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-            if (bytes_received <= 0) {
-                perror("Failed to receive packet from Player 1");
-                game_is_active = 0;
-                break;
-            }
+void report_shard_load(struct shard *shards, int num_shards) {
+    for (int i = 0; i < num_shards; i++) {
+        printf("[Server] Shard %d: %lu active matches, %lu matches total, %lu connections, %lu packets\n", i,
+               atomic_load_explicit(&shards[i].active_matches, memory_order_relaxed),
+               atomic_load_explicit(&shards[i].total_matches, memory_order_relaxed),
+               atomic_load_explicit(&shards[i].connections, memory_order_relaxed),
+               atomic_load_explicit(&shards[i].packets, memory_order_relaxed));
+    }
+    fflush(stdout);
+}
 
-            if (strncmp(buffer, "S ", 2) == 0) {
-                int result = handle_shoot_packet(conn_fd1, player2_board, player1_shot_history, board_width, board_height, &player2_remaining_ships, conn_fd2, buffer);
-                if (result == 1) {
-                    recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-                    send(conn_fd2, "H 0", strlen("H 0"), 0);
-                    recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-                    send(conn_fd1, "H 1", strlen("H 1"), 0);
-                    game_is_active = 0;
-                }
-                if (result == 0) {
-                    break;
-                }
-                continue;
-            } 
-            else if (strcmp(buffer, "Q\n") == 0 || strcmp(buffer, "Q") == 0) {
-                handle_query_packet(conn_fd1, player1_shot_history, player2_board, board_width, board_height);
-                continue;
-            } 
-            else if (strcmp(buffer, "F\n") == 0 || strcmp(buffer, "F") == 0) {
-                send(conn_fd1, "H 0", strlen("H 0"), 0);
-                recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-                send(conn_fd2, "H 1", strlen("H 1"), 0);
-                game_is_active = 0;
-                break;
-            } else {
-                send(conn_fd1, "E 102", strlen("E 102"), 0);
-            }
-        }
+static const char *const phase_names[PHASE_HALT + 1] = {
+    "begin_p1", "begin_p2", "init_p1", "init_p2", "turn_p1", "turn_p2", "halt",
+};
 
-        if (!game_is_active) {
-            break;
-        }
+static const char *const packet_names[PACKET_KINDS] = {"B", "I", "S", "V", "Q", "F", "other"};
 
-        // Player 2's turn
-        while (1) {
-            memset(buffer, 0, BUFFER_SIZE);
-            int bytes_received = recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-            if (bytes_received <= 0) {
-                perror("Failed to receive packet from Player 2");
-                game_is_active = 0;
-                break;
-            }
+static void write_histogram(FILE *out, const char *name, const char *labels, const struct histogram *histogram) {
+    static const double quantiles[] = {50, 90, 99, 99.9};
+    const char *sep = labels[0] ? "," : "";
 
-            if (strncmp(buffer, "S ", 2) == 0) {
-                int result = handle_shoot_packet(conn_fd2, player1_board, player2_shot_history, board_width, board_height, &player1_remaining_ships, conn_fd1, buffer);
-                if (result == 1) {
-                    recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-                    send(conn_fd1, "H 0", strlen("H 0"), 0);
-                    recv(conn_fd2, buffer, BUFFER_SIZE, 0);
-                    send(conn_fd2, "H 1", strlen("H 1"), 0);
-                    game_is_active = 0;
-                }
-                if (result == 0) {
-                    break;
-                }
-                continue;
-            } 
-            else if (strcmp(buffer, "Q\n") == 0 || strcmp(buffer, "Q") == 0) {
-                handle_query_packet(conn_fd2, player2_shot_history, player1_board, board_width, board_height);
-                continue;
-            } 
-            else if (strcmp(buffer, "F\n") == 0 || strcmp(buffer, "F") == 0) {
-                send(conn_fd2, "H 0", strlen("H 0"), 0);
-                recv(conn_fd1, buffer, BUFFER_SIZE, 0);
-                send(conn_fd1, "H 1", strlen("H 1"), 0);
-                game_is_active = 0;
-                break;
-            } else {
-                send(conn_fd2, "E 102", strlen("E 102"), 0);
-            }
-        }
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+        fprintf(out, "%s{%s%squantile=\"%g\"} %llu\n", name, labels, sep, quantiles[i] / 100,
+                (unsigned long long)histogram_percentile(histogram, quantiles[i]));
     }
-
-    // Free allocated boards and histories after the game ends
-    free_board(player1_board, board_height);
-    free_board(player2_board, board_height);
-    free_shot_history(player1_shot_history, board_height);
-    free_shot_history(player2_shot_history, board_height);
+    fprintf(out, "%s_max{%s} %llu\n", name, labels, (unsigned long long)histogram->max);
+    fprintf(out, "%s_sum{%s} %llu\n", name, labels, (unsigned long long)histogram->sum);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long)histogram->count);
 }
 
-int main() {
-    int listen_fd1, listen_fd2, conn_fd1, conn_fd2;
-    struct sockaddr_in address1, address2;
-    int opt = 1;
-    socklen_t addrlen = sizeof(struct sockaddr_in);
-    char buffer[BUFFER_SIZE] = {0};
+static unsigned long sum_counter(struct shard *shards, int num_shards, size_t offset) {
+    unsigned long total = 0;
 
-    // Socket creation for Player 1
-    if ((listen_fd1 = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("[Server] socket() failed for Player 1");
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < num_shards; i++) {
+        total += atomic_load_explicit((atomic_ulong *)((char *)&shards[i] + offset), memory_order_relaxed);
     }
+    return total;
+}
 
-    // Set socket options for Player 1
-    if (setsockopt(listen_fd1, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
-        perror("[Server] setsockopt() failed for Player 1");
-        close(listen_fd1);
-        exit(EXIT_FAILURE);
-    }
+#define SHARD_TOTAL(field) sum_counter(shards, num_shards, offsetof(struct shard, field))
 
-    // Initialize address structure for Player 1
-    memset(&address1, 0, sizeof(address1));
-    address1.sin_family = AF_INET;
-    address1.sin_addr.s_addr = INADDR_ANY;
-    address1.sin_port = htons(PORT_PLAYER1);
+// Writes the metrics of all shards in the Prometheus text format. The file is
+// written under a temporary name and renamed over the old one, so readers
+// never see a partial file. Returns 0 on success, -1 with errno set otherwise.
+int write_stats_file(const char *path, struct shard *shards, int num_shards) {
+    char temp_path[PATH_MAX];
+    char labels[64];
+    struct histogram *histogram = malloc(sizeof(struct histogram));
+    FILE *out;
 
-    // Bind socket to port for Player 1
-    if (bind(listen_fd1, (struct sockaddr *)&address1, sizeof(address1)) == -1) {
-        perror("[Server] bind() failed for Player 1");
-        close(listen_fd1);
-        exit(EXIT_FAILURE);
+    if (!histogram) {
+        return -1;
+    }
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    if (!(out = fopen(temp_path, "w"))) {
+        free(histogram);
+        return -1;
     }
 
-    // Listen for Player 1
-    if (listen(listen_fd1, 1) == -1) {
-        perror("[Server] listen() failed for Player 1");
-        close(listen_fd1);
-        exit(EXIT_FAILURE);
+    fprintf(out, "shards %d\n", num_shards);
+    fprintf(out, "connections_total %lu\n", SHARD_TOTAL(connections));
+    fprintf(out, "packets_total %lu\n", SHARD_TOTAL(packets));
+    fprintf(out, "bytes_in_total %lu\n", SHARD_TOTAL(metrics.bytes_in));
+    fprintf(out, "bytes_out_total %lu\n", SHARD_TOTAL(metrics.bytes_out));
+    fprintf(out, "matches_total %lu\n", SHARD_TOTAL(total_matches));
+    for (int phase = 0; phase <= PHASE_HALT; phase++) {
+        fprintf(out, "matches_active{phase=\"%s\"} %lu\n", phase_names[phase], SHARD_TOTAL(metrics.phase_matches[phase]));
+    }
+    for (int phase = 0; phase < PHASE_HALT; phase++) {
+        fprintf(out, "matches_ended{phase=\"%s\"} %lu\n", phase_names[phase], SHARD_TOTAL(metrics.ended_in[phase]));
+    }
+    for (int class = 0; class < ERROR_CLASSES; class++) {
+        for (int detail = 0; detail < ERROR_DETAILS; detail++) {
+            unsigned long count = SHARD_TOTAL(metrics.errors[class][detail]);
+            if (count > 0) {
+                fprintf(out, "errors_total{code=\"%d\"} %lu\n", (class + 1) * 100 + detail, count);
+            }
+        }
+    }
+    fprintf(out, "slow_readers_dropped_total %lu\n", SHARD_TOTAL(metrics.slow_readers));
+    fprintf(out, "pool_matches_in_use %lu\n", SHARD_TOTAL(matches.in_use));
+    fprintf(out, "pool_matches_capacity %lu\n", SHARD_TOTAL(matches.capacity));
+    for (int class = 0; class < POOL_CLASSES; class++) {
+        unsigned long in_use = SHARD_TOTAL(buffers.in_use[class]);
+        unsigned long cached = SHARD_TOTAL(buffers.cached[class]);
+        if (in_use > 0 || cached > 0) {
+            fprintf(out, "pool_buffers_in_use{size=\"%zu\"} %lu\n", (size_t)1 << (class + POOL_MIN_CLASS), in_use);
+            fprintf(out, "pool_buffers_cached{size=\"%zu\"} %lu\n", (size_t)1 << (class + POOL_MIN_CLASS), cached);
+        }
     }
-    printf("[Server] Listening for Player 1 on port %d...\n", PORT_PLAYER1);
+    fprintf(out, "pool_buffers_oversize %lu\n", SHARD_TOTAL(buffers.oversize));
 
-    // Socket creation for Player 2
-    if ((listen_fd2 = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("[Server] socket() failed for Player 2");
-        close(listen_fd1);
-        exit(EXIT_FAILURE);
+    for (int kind = 0; kind < PACKET_KINDS; kind++) {
+        histogram_reset(histogram);
+        for (int i = 0; i < num_shards; i++) {
+            metrics_snapshot(histogram, &shards[i].metrics.packet_ns[kind]);
+        }
+        snprintf(labels, sizeof(labels), "type=\"%s\"", packet_names[kind]);
+        write_histogram(out, "packet_handle_ns", labels, histogram);
     }
+    histogram_reset(histogram);
+    for (int i = 0; i < num_shards; i++) {
+        metrics_snapshot(histogram, &shards[i].metrics.match_us);
+    }
+    write_histogram(out, "match_duration_us", "", histogram);
+    free(histogram);
 
-    // Set socket options for Player 2
-    if (setsockopt(listen_fd2, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT, &opt, sizeof(opt)) == -1) {
-        perror("[Server] setsockopt() failed for Player 2");
-        close(listen_fd1);
-        close(listen_fd2);
-        exit(EXIT_FAILURE);
+    if (fclose(out) != 0) {
+        return -1;
     }
+    return rename(temp_path, path);
+}
 
-    // Initialize address structure for Player 2
-    memset(&address2, 0, sizeof(address2));
-    address2.sin_family = AF_INET;
-    address2.sin_addr.s_addr = INADDR_ANY;
-    address2.sin_port = htons(PORT_PLAYER2);
+void print_usage(const char *program) {
+    fprintf(stderr, "Usage: %s [-w workers] [-r report_seconds] [-m stats_file] [-R record_file] [-P pairing] [-i backend] [-b] [-s sparse_cells] [-l level]\n", program);
+    fprintf(stderr, "  -w workers         Worker threads, 0 for one per core (default 1)\n");
+    fprintf(stderr, "  -r report_seconds  Per-shard load report interval, 0 to disable\n");
+    fprintf(stderr, "                     (default 10 with several workers, 0 otherwise)\n");
+    fprintf(stderr, "  -m stats_file      Rewrite this file with counters and latency percentiles\n");
+    fprintf(stderr, "                     every second\n");
+    fprintf(stderr, "  -R record_file     Append every match to this recording (see replay)\n");
+    fprintf(stderr, "  -P pairing         Lobby pairing: any, or size to pair clients preferring\n");
+    fprintf(stderr, "                     boards of a similar size (default any)\n");
+    fprintf(stderr, "  -i backend         Network I/O: epoll, or uring for io_uring, which falls\n");
+    fprintf(stderr, "                     back to epoll on kernels without it (default epoll)\n");
+    fprintf(stderr, "  -b                 Store boards as bitboards (%s kernels)\n", BITBOARD_KERNEL);
+    fprintf(stderr, "  -s sparse_cells    Store boards with more cells than this sparsely\n");
+    fprintf(stderr, "                     (default %lld)\n", SPARSE_AREA_THRESHOLD);
+    fprintf(stderr, "  -l level           Log level: off, error, warn, info or debug (default info)\n");
+}
 
-    // Bind socket to port for Player 2
-    if (bind(listen_fd2, (struct sockaddr *)&address2, sizeof(address2)) == -1) {
-        perror("[Server] bind() failed for Player 2");
-        close(listen_fd1);
-        close(listen_fd2);
-        exit(EXIT_FAILURE);
+#ifndef HW4_NO_MAIN
+int main(int argc, char **argv) {
+    int num_shards = 1;
+    int report_interval = -1;
+    const char *stats_path = NULL;
+    const char *record_path = NULL;
+    bool stats_failing = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "w:r:m:R:P:i:bs:l:")) != -1) {
+        switch (opt) {
+        case 'b':
+            board_storage = BOARD_BITS;
+            break;
+        case 's':
+            sparse_area_threshold = atoll(optarg);
+            break;
+        case 'l':
+            if (log_parse_level(optarg) < LOG_OFF) {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            log_set_level(log_parse_level(optarg));
+            break;
+        case 'w':
+            num_shards = atoi(optarg);
+            break;
+        case 'r':
+            report_interval = atoi(optarg);
+            break;
+        case 'm':
+            stats_path = optarg;
+            break;
+        case 'R':
+            record_path = optarg;
+            break;
+        case 'P':
+            if (strcmp(optarg, "any") == 0) {
+                lobby_pairing = LOBBY_PAIR_ANY;
+            } else if (strcmp(optarg, "size") == 0) {
+                lobby_pairing = LOBBY_PAIR_SIZE;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            if (strcmp(optarg, "epoll") == 0) {
+                io_backend = IO_EPOLL;
+            } else if (strcmp(optarg, "uring") == 0) {
+                io_backend = IO_URING;
+            } else {
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
     }
 
-    // Listen for Player 2
-    if (listen(listen_fd2, 1) == -1) {
-        perror("[Server] listen() failed for Player 2");
-        close(listen_fd1);
-        close(listen_fd2);
-        exit(EXIT_FAILURE);
+    int num_cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_shards <= 0) {
+        num_shards = num_cores > 0 ? num_cores : 1;
+    }
+    if (report_interval < 0) {
+        report_interval = num_shards > 1 ? 10 : 0;
     }
-    printf("[Server] Listening for Player 2 on port %d...\n", PORT_PLAYER2);
 
-    // Accept connection from Player 1
-    if ((conn_fd1 = accept(listen_fd1, (struct sockaddr *)&address1, &addrlen)) == -1) {
-        perror("[Server] accept() failed for Player 1");
-        close(listen_fd1);
-        close(listen_fd2);
-        exit(EXIT_FAILURE);
+    raise_file_limit();
+    if (log_start() != 0) {
+        perror("[Server] Failed to start the log thread");
+    }
+    if (io_backend == IO_URING && !uring_supported()) {
+        log_warn("[Server] io_uring is not fully supported by this kernel, using epoll");
+        io_backend = IO_EPOLL;
     }
-    printf("[Server] Player 1 connected!\n");
 
-    // Accept connection from Player 2
-    if ((conn_fd2 = accept(listen_fd2, (struct sockaddr *)&address2, &addrlen)) == -1) {
-        perror("[Server] accept() failed for Player 2");
-        close(listen_fd1);
-        close(listen_fd2);
-        close(conn_fd1);
+    struct shard *shards = calloc(num_shards, sizeof(struct shard));
+    if (!shards) {
+        perror("[Server] Failed to allocate shards");
         exit(EXIT_FAILURE);
     }
-    printf("[Server] Player 2 connected!\n");
+    for (int i = 0; i < num_shards; i++) {
+        if (shard_init(&shards[i], i) == -1) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (record_path) {
+        if (recorder_start(&recorder, record_path, num_shards) != 0) {
+            fprintf(stderr, "[Server] Failed to open %s: %s\n", record_path, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < num_shards; i++) {
+            shards[i].record = &recorder.rings[i];
+        }
+    }
+    log_info("[Server] Listening for Player 1 on port %d...", PORT_PLAYER1);
+    log_info("[Server] Listening for Player 2 on port %d...", PORT_PLAYER2);
+    log_info("[Server] Listening for lobby clients on port %d...", PORT_LOBBY);
+    if (num_shards > 1) {
+        log_info("[Server] Running %d worker shards", num_shards);
+    }
+    if (io_backend == IO_URING) {
+        log_info("[Server] Network I/O through io_uring");
+    }
 
-    // Start the game loop
-    game_loop(conn_fd1, conn_fd2);
+    for (int i = 0; i < num_shards; i++) {
+        if (pthread_create(&shards[i].thread, NULL, io_backend == IO_URING ? run_uring_loop : run_event_loop, &shards[i]) != 0) {
+            perror("[Server] pthread_create() failed");
+            exit(EXIT_FAILURE);
+        }
+        if (num_shards > 1 && num_cores > 0) {
+            pin_to_core(shards[i].thread, i % num_cores);
+        }
+    }
 
-    close(conn_fd1);
-    close(conn_fd2);
-    close(listen_fd1);
-    close(listen_fd2);
+    for (unsigned long tick = 1; report_interval > 0 || stats_path; tick++) {
+        sleep(1);
+        if (stats_path) {
+            // Only the first of a run of failures is reported
+            bool failed = write_stats_file(stats_path, shards, num_shards) != 0;
+            if (failed && !stats_failing) {
+                fprintf(stderr, "[Server] Failed to write %s: %s\n", stats_path, strerror(errno));
+            }
+            stats_failing = failed;
+        }
+        if (report_interval > 0 && tick % report_interval == 0) {
+            report_shard_load(shards, num_shards);
+        }
+    }
+    for (int i = 0; i < num_shards; i++) {
+        pthread_join(shards[i].thread, NULL);
+    }
+    if (record_path) {
+        recorder_stop(&recorder);
+    }
+    log_stop();
 
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,578 @@
+// Drives many concurrent games against the server from one process and
+// reports throughput and reply latency per packet type.
+//
+// Every game connects a Player 1 and a Player 2. A game either replays a
+// scenario from the scripts directory (p1_<name> with p2_<name>) or plays a
+// random legal game. Each connection sends a packet, waits for the reply and
+// sends the next, like player_automated. The server pairs players in the
+// order it accepts them, so with several server workers the two halves of a
+// game can meet other games' players. No player relies on anything but its
+// own side of the game, so any pairing plays out.
+//
+// Latency runs from sending a packet to receiving its reply, so a packet sent
+// during the opponent's turn also waits for the opponent.
+//
+// With -L, players connect to the lobby port instead of their seat's port and
+// open with a lobby hello for their game's board size. They play whichever
+// seat the server pairs them into, and the L row reports the wait from the
+// hello to the seat assignment.
+//
+// Random games draw the board size from the -b range. Their fleets and shots
+// stay in the 10x10 corner every legal board has, since Player 2 never
+// learns the board size.
+//
+// Build: gcc -O2 -pthread -o loadgen src/loadgen.c -lm
+#define HW4_NO_MAIN
+#include "hw4.c"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+
+#include "histogram.h"
+
+#define LOADGEN_CORNER 10            // Fleets and shots of random games
+#define LOADGEN_INPUT_SIZE 16384
+#define LOADGEN_MAX_SCRIPTS 64
+#define LOADGEN_MAX_EVENTS 256
+
+struct script {
+    char name[64];
+    char **lines[2];                 // Packets of Player 1 and Player 2
+    int count[2];
+};
+
+struct game;
+
+struct agent {
+    int fd;
+    int player;
+    struct game *game;
+    bool connected;
+    bool seated;                     // Knows its seat; lobby players learn it from the server
+    bool done;
+    const struct script *script;     // NULL for a random game
+    int next_line;
+    int step;                        // Random games: 0 Begin, 1 Initialize, then shots
+    bool queried;                    // A query went out since the last shot
+    char fleet[128];                 // Parameters of the Initialize packet
+    uint8_t shots[LOADGEN_CORNER * LOADGEN_CORNER];
+    int shots_fired;
+    int pending;                     // Packet type awaiting a reply, or -1
+    uint64_t sent_at;
+    char input[LOADGEN_INPUT_SIZE];
+    size_t input_len;
+};
+
+struct game {
+    struct agent agents[2];
+    int width;
+    int height;
+    int agents_done;
+    bool failed;
+    struct game *graveyard_next;
+};
+
+// Packet types reported on, by opcode
+static const char packet_types[] = "BISVQFL?";
+#define PACKET_TYPES (int)(sizeof(packet_types) - 1)
+
+struct loadgen {
+    const char *host;
+    int games;
+    int concurrency;
+    double rate;                     // Games started per second, 0 for no limit
+    int script_percent;
+    int query_percent;
+    int min_size;
+    int max_size;
+    int time_limit;
+    bool lobby;
+    uint64_t rng;
+
+    struct script scripts[LOADGEN_MAX_SCRIPTS];
+    int script_count;
+    struct sockaddr_in addresses[3];  // Player 1, Player 2 and the lobby
+    int epoll_fd;
+    struct game *graveyard;          // Finished games, freed after each batch
+
+    int started;
+    int active;
+    int completed;
+    int failed;
+    unsigned long packets;
+    unsigned long errors;            // E replies
+    struct histogram latency[PACKET_TYPES];
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_random(struct loadgen *lg) {
+    lg->rng ^= lg->rng << 13;
+    lg->rng ^= lg->rng >> 7;
+    lg->rng ^= lg->rng << 17;
+    return lg->rng;
+}
+
+static int random_below(struct loadgen *lg, int bound) {
+    return (int)(next_random(lg) % bound);
+}
+
+static int packet_type_index(char opcode) {
+    const char *slot = strchr(packet_types, opcode);
+    return slot && opcode != '\0' ? (int)(slot - packet_types) : PACKET_TYPES - 1;
+}
+
+// Reads the packets of one script file, one per non-empty line.
+static int load_script_file(const char *path, char ***lines, int *count) {
+    FILE *fp = fopen(path, "r");
+    char buffer[BUFFER_SIZE];
+
+    if (!fp) {
+        return -1;
+    }
+    *lines = NULL;
+    *count = 0;
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        buffer[strcspn(buffer, "\r\n")] = 0;
+        if (buffer[0] == '\0') {
+            continue;
+        }
+        *lines = realloc(*lines, (*count + 1) * sizeof(char *));
+        (*lines)[(*count)++] = strdup(buffer);
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Loads every p1_<name> script that has a matching p2_<name>.
+static void load_scripts(struct loadgen *lg, const char *dir) {
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+    char path[2][PATH_MAX];
+
+    if (!d) {
+        perror("[Loadgen] Cannot open the scripts directory");
+        return;
+    }
+    while ((entry = readdir(d)) != NULL && lg->script_count < LOADGEN_MAX_SCRIPTS) {
+        struct script *script = &lg->scripts[lg->script_count];
+
+        if (strncmp(entry->d_name, "p1_", 3) != 0 || strlen(entry->d_name + 3) >= sizeof(script->name)) {
+            continue;
+        }
+        strcpy(script->name, entry->d_name + 3);
+        snprintf(path[0], sizeof(path[0]), "%s/p1_%s", dir, script->name);
+        snprintf(path[1], sizeof(path[1]), "%s/p2_%s", dir, script->name);
+        if (load_script_file(path[0], &script->lines[0], &script->count[0]) != 0) {
+            continue;
+        }
+        if (load_script_file(path[1], &script->lines[1], &script->count[1]) != 0) {
+            continue;
+        }
+        lg->script_count++;
+    }
+    closedir(d);
+}
+
+// Builds a random legal fleet inside the corner and a random shot order.
+static void plan_random_agent(struct loadgen *lg, struct agent *agent) {
+    struct board board;
+    char *out = agent->fleet;
+
+    initialize_boards(&board, 1, LOADGEN_CORNER, LOADGEN_CORNER, BOARD_BYTES);
+    for (int id = 1; id <= FLEET_SIZE; id++) {
+        int type, rotation, row, col;
+        do {
+            type = random_below(lg, 7);
+            rotation = random_below(lg, 4);
+            row = random_below(lg, LOADGEN_CORNER);
+            col = random_below(lg, LOADGEN_CORNER);
+        } while (place_piece(&board, type, rotation, row, col, id) != 0);
+        out += sprintf(out, " %d %d %d %d", type + 1, rotation + 1, row, col);
+    }
+    free_board(&board);
+
+    for (int i = 0; i < LOADGEN_CORNER * LOADGEN_CORNER; i++) {
+        agent->shots[i] = i;
+    }
+    for (int i = LOADGEN_CORNER * LOADGEN_CORNER - 1; i > 0; i--) {
+        int j = random_below(lg, i + 1);
+        uint8_t cell = agent->shots[i];
+        agent->shots[i] = agent->shots[j];
+        agent->shots[j] = cell;
+    }
+}
+
+// Writes the agent's next packet into `packet`. Returns false once a script
+// has run out.
+static bool next_packet(struct loadgen *lg, struct agent *agent, char *packet, size_t size) {
+    if (!agent->seated) {
+        snprintf(packet, size, "L %d %d", agent->game->width, agent->game->height);
+        return true;
+    }
+    if (agent->script) {
+        if (agent->next_line == agent->script->count[agent->player]) {
+            return false;
+        }
+        snprintf(packet, size, "%s", agent->script->lines[agent->player][agent->next_line++]);
+        return true;
+    }
+
+    switch (agent->step) {
+    case 0:
+        if (agent->player == 0) {
+            snprintf(packet, size, "B %d %d", agent->game->width, agent->game->height);
+        } else {
+            snprintf(packet, size, "B");
+        }
+        break;
+    case 1:
+        snprintf(packet, size, "I%s", agent->fleet);
+        break;
+    default:
+        if (!agent->queried && random_below(lg, 100) < lg->query_percent) {
+            snprintf(packet, size, "Q");
+            agent->queried = true;
+        } else if (agent->shots_fired < LOADGEN_CORNER * LOADGEN_CORNER) {
+            int cell = agent->shots[agent->shots_fired++];
+            snprintf(packet, size, "S %d %d", cell / LOADGEN_CORNER, cell % LOADGEN_CORNER);
+            agent->queried = false;
+        } else {
+            snprintf(packet, size, "F");
+        }
+        break;
+    }
+    agent->step++;
+    return true;
+}
+
+static void finish_agent(struct loadgen *lg, struct agent *agent, bool failed) {
+    struct game *game = agent->game;
+
+    if (agent->done) {
+        return;
+    }
+    agent->done = true;
+    if (agent->fd != -1) {
+        epoll_ctl(lg->epoll_fd, EPOLL_CTL_DEL, agent->fd, NULL);
+        close(agent->fd);
+        agent->fd = -1;
+    }
+    game->failed |= failed;
+    if (++game->agents_done < 2) {
+        return;
+    }
+    lg->active--;
+    if (game->failed) {
+        lg->failed++;
+    } else {
+        lg->completed++;
+    }
+    game->graveyard_next = lg->graveyard;
+    lg->graveyard = game;
+}
+
+static void send_next(struct loadgen *lg, struct agent *agent) {
+    char packet[BUFFER_SIZE + 1];
+
+    if (!next_packet(lg, agent, packet, sizeof(packet) - 1)) {
+        finish_agent(lg, agent, false);
+        return;
+    }
+    size_t length = strlen(packet);
+    packet[length++] = '\n';
+
+    agent->pending = packet_type_index(packet[0]);
+    agent->sent_at = now_ns();
+    if (send(agent->fd, packet, length, MSG_NOSIGNAL) != (ssize_t)length) {
+        perror("[Loadgen] send() failed");
+        finish_agent(lg, agent, true);
+        return;
+    }
+    lg->packets++;
+}
+
+static void handle_reply(struct loadgen *lg, struct agent *agent, const char *line) {
+    if (agent->pending >= 0) {
+        histogram_record(&lg->latency[agent->pending], now_ns() - agent->sent_at);
+        agent->pending = -1;
+    }
+    if (line[0] == 'E') {
+        lg->errors++;
+    }
+    if (line[0] == 'H') {
+        finish_agent(lg, agent, false);
+        return;
+    }
+    if (line[0] == 'P' && !agent->seated) {
+        agent->player = line[2] == '2';
+        agent->seated = true;
+    }
+    send_next(lg, agent);
+}
+
+static void handle_agent_event(struct loadgen *lg, struct agent *agent, uint32_t events) {
+    if (agent->done) {
+        return;
+    }
+    if (!agent->connected) {
+        int error = 0;
+        socklen_t length = sizeof(error);
+
+        getsockopt(agent->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+        if (error != 0) {
+            fprintf(stderr, "[Loadgen] connect() failed: %s\n", strerror(error));
+            finish_agent(lg, agent, true);
+            return;
+        }
+        agent->connected = true;
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = agent };
+        epoll_ctl(lg->epoll_fd, EPOLL_CTL_MOD, agent->fd, &event);
+        send_next(lg, agent);
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        return;
+    }
+
+    ssize_t received = recv(agent->fd, agent->input + agent->input_len, sizeof(agent->input) - agent->input_len - 1, 0);
+    if (received == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    if (received <= 0) {
+        // The server hung up before halting this player
+        finish_agent(lg, agent, true);
+        return;
+    }
+    agent->input_len += received;
+    agent->input[agent->input_len] = '\0';
+
+    char *line = agent->input;
+    char *newline;
+    while (!agent->done && (newline = strchr(line, '\n')) != NULL) {
+        *newline = '\0';
+        handle_reply(lg, agent, line);
+        line = newline + 1;
+    }
+    if (agent->done) {
+        return;
+    }
+    agent->input_len -= line - agent->input;
+    memmove(agent->input, line, agent->input_len);
+    if (agent->input_len == sizeof(agent->input) - 1) {
+        fprintf(stderr, "[Loadgen] Reply longer than %zu bytes\n", sizeof(agent->input) - 1);
+        finish_agent(lg, agent, true);
+    }
+}
+
+static int connect_agent(struct loadgen *lg, struct agent *agent) {
+    agent->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (agent->fd == -1) {
+        perror("[Loadgen] socket() failed");
+        return -1;
+    }
+    const struct sockaddr_in *address = &lg->addresses[agent->seated ? agent->player : 2];
+    if (connect(agent->fd, (const struct sockaddr *)address, sizeof(*address)) == -1 && errno != EINPROGRESS) {
+        perror("[Loadgen] connect() failed");
+        return -1;
+    }
+    struct epoll_event event = { .events = EPOLLOUT, .data.ptr = agent };
+    if (epoll_ctl(lg->epoll_fd, EPOLL_CTL_ADD, agent->fd, &event) == -1) {
+        perror("[Loadgen] epoll_ctl() failed");
+        return -1;
+    }
+    return 0;
+}
+
+static void start_game(struct loadgen *lg) {
+    struct game *game = calloc(1, sizeof(struct game));
+    const struct script *script = NULL;
+
+    if (!game) {
+        perror("[Loadgen] Failed to allocate a game");
+        exit(EXIT_FAILURE);
+    }
+    if (lg->script_count > 0 && random_below(lg, 100) < lg->script_percent) {
+        script = &lg->scripts[random_below(lg, lg->script_count)];
+    }
+    game->width = lg->min_size + random_below(lg, lg->max_size - lg->min_size + 1);
+    game->height = lg->min_size + random_below(lg, lg->max_size - lg->min_size + 1);
+    lg->started++;
+    lg->active++;
+
+    for (int player = 0; player < 2; player++) {
+        struct agent *agent = &game->agents[player];
+        agent->fd = -1;
+        agent->player = player;
+        agent->game = game;
+        agent->script = script;
+        agent->pending = -1;
+        agent->seated = !lg->lobby;
+        if (!script) {
+            plan_random_agent(lg, agent);
+        }
+    }
+    // Player 1 connects first so that a single server worker pairs the two
+    for (int player = 0; player < 2; player++) {
+        if (connect_agent(lg, &game->agents[player]) != 0) {
+            finish_agent(lg, &game->agents[player], true);
+        }
+    }
+}
+
+static void report(struct loadgen *lg, double seconds) {
+    unsigned long replies = 0;
+
+    for (int i = 0; i < PACKET_TYPES; i++) {
+        replies += lg->latency[i].count;
+    }
+    printf("[Loadgen] %d games (%d completed, %d failed) in %.3f s: %.1f games/s, %.1f packets/s, %lu error replies\n",
+           lg->completed + lg->failed, lg->completed, lg->failed, seconds,
+           (lg->completed + lg->failed) / seconds, replies / seconds, lg->errors);
+    printf("%-6s %10s %10s %10s %10s %10s\n", "type", "count", "p50_us", "p99_us", "p999_us", "max_us");
+    for (int i = 0; i < PACKET_TYPES; i++) {
+        const struct histogram *h = &lg->latency[i];
+        if (h->count == 0) {
+            continue;
+        }
+        printf("%-6c %10lu %10.1f %10.1f %10.1f %10.1f\n", packet_types[i], (unsigned long)h->count,
+               histogram_percentile(h, 50) / 1e3, histogram_percentile(h, 99) / 1e3,
+               histogram_percentile(h, 99.9) / 1e3, h->max / 1e3);
+    }
+}
+
+int main(int argc, char **argv) {
+    static struct loadgen lg = {
+        .host = "127.0.0.1",
+        .games = 1000,
+        .concurrency = 100,
+        .script_percent = 50,
+        .query_percent = 10,
+        .min_size = 10,
+        .max_size = 10,
+        .rng = 0x9E3779B97F4A7C15ull,
+    };
+    const char *scripts_dir = "scripts";
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:c:r:m:q:b:d:s:h:t:L")) != -1) {
+        switch (opt) {
+        case 'g':
+            lg.games = atoi(optarg);
+            break;
+        case 'c':
+            lg.concurrency = atoi(optarg);
+            break;
+        case 'r':
+            lg.rate = atof(optarg);
+            break;
+        case 'm':
+            lg.script_percent = atoi(optarg);
+            break;
+        case 'q':
+            lg.query_percent = atoi(optarg);
+            break;
+        case 'b':
+            if (sscanf(optarg, "%d:%d", &lg.min_size, &lg.max_size) == 1) {
+                lg.max_size = lg.min_size;
+            }
+            break;
+        case 'd':
+            scripts_dir = optarg;
+            break;
+        case 's':
+            lg.rng = strtoull(optarg, NULL, 0) | 1;
+            break;
+        case 'h':
+            lg.host = optarg;
+            break;
+        case 't':
+            lg.time_limit = atoi(optarg);
+            break;
+        case 'L':
+            lg.lobby = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-g games] [-c concurrent] [-r games_per_second] [-m script_percent] "
+                            "[-q query_percent] [-b min_size:max_size] [-d scripts_dir] [-s seed] [-h host] [-t seconds] [-L]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (lg.games <= 0 || lg.concurrency <= 0 || lg.min_size < 10 || lg.max_size < lg.min_size) {
+        fprintf(stderr, "[Loadgen] Invalid options\n");
+        exit(EXIT_FAILURE);
+    }
+    log_set_level(LOG_OFF);  // place_piece() logs at debug level
+
+    for (int i = 0; i < 3; i++) {
+        static const int ports[3] = {PORT_PLAYER1, PORT_PLAYER2, PORT_LOBBY};
+        lg.addresses[i].sin_family = AF_INET;
+        lg.addresses[i].sin_port = htons(ports[i]);
+        if (inet_pton(AF_INET, lg.host, &lg.addresses[i].sin_addr) <= 0) {
+            fprintf(stderr, "[Loadgen] Invalid address %s\n", lg.host);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (lg.script_percent > 0) {
+        load_scripts(&lg, scripts_dir);
+    }
+    raise_file_limit();
+    lg.epoll_fd = epoll_create1(0);
+    if (lg.epoll_fd == -1) {
+        perror("[Loadgen] epoll_create1() failed");
+        exit(EXIT_FAILURE);
+    }
+    printf("[Loadgen] %d games, %d at a time, %d%% scripted from %d scenarios, boards %d to %d\n",
+           lg.games, lg.concurrency, lg.script_count > 0 ? lg.script_percent : 0, lg.script_count, lg.min_size, lg.max_size);
+
+    uint64_t start = now_ns();
+    uint64_t next_arrival = start;
+    uint64_t deadline = lg.time_limit > 0 ? start + lg.time_limit * 1000000000ull : UINT64_MAX;
+    struct epoll_event events[LOADGEN_MAX_EVENTS];
+
+    while (lg.completed + lg.failed < lg.started || lg.started < lg.games) {
+        uint64_t now = now_ns();
+        if (now >= deadline) {
+            fprintf(stderr, "[Loadgen] Time limit reached with %d games in flight\n", lg.active);
+            break;
+        }
+
+        // Start games as they arrive, while there is room for them
+        while (lg.started < lg.games && lg.active < lg.concurrency && now >= next_arrival) {
+            start_game(&lg);
+            if (lg.rate > 0) {
+                double uniform = (next_random(&lg) >> 11) * 0x1.0p-53;
+                next_arrival += (uint64_t)(-log(1.0 - uniform) / lg.rate * 1e9);
+            }
+        }
+
+        int timeout = 100;
+        if (lg.started < lg.games && lg.active < lg.concurrency && next_arrival > now) {
+            uint64_t wait_ms = (next_arrival - now) / 1000000;
+            timeout = wait_ms < 100 ? (int)wait_ms : 100;
+        }
+        int count = epoll_wait(lg.epoll_fd, events, LOADGEN_MAX_EVENTS, timeout);
+        if (count == -1 && errno != EINTR) {
+            perror("[Loadgen] epoll_wait() failed");
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            struct agent *agent = events[i].data.ptr;
+            handle_agent_event(&lg, agent, events[i].events);
+        }
+        while (lg.graveyard) {
+            struct game *game = lg.graveyard;
+            lg.graveyard = game->graveyard_next;
+            free(game);
+        }
+    }
+
+    report(&lg, (now_ns() - start) / 1e9);
+    return lg.failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
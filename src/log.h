@@ -0,0 +1,219 @@
+#ifndef LOG_H
+#define LOG_H
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Level-gated logging. Messages above LOG_COMPILE_LEVEL are compiled out, and
+ * release builds (-DNDEBUG) compile every message out unless LOG_COMPILE_LEVEL
+ * is set explicitly. Messages above the runtime level are skipped before they
+ * are formatted.
+ *
+ * Once log_start() has run, each thread formats its messages into its own
+ * single-producer ring, and a background thread drains every ring to stdout
+ * (info and debug) or stderr (warnings and errors). A full ring drops the
+ * message and counts it rather than blocking the caller. Before log_start(),
+ * messages are written directly.
+ */
+
+enum log_level {
+    LOG_OFF = -1,
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_OFF
+#else
+#define LOG_COMPILE_LEVEL LOG_DEBUG
+#endif
+#endif
+
+#define LOG_RING_RECORDS 1024     // Per thread, must be a power of two
+#define LOG_MESSAGE_SIZE 244      // Longer messages are truncated
+#define LOG_IDLE_SLEEP_NS 1000000
+
+struct log_record {
+    int8_t level;
+    uint8_t unused;
+    uint16_t length;
+    char text[LOG_MESSAGE_SIZE];
+};
+
+struct log_ring {
+    struct log_ring *next;        // Registry link, set before publishing
+    _Atomic uint32_t head;        // Advanced by the drain thread only
+    _Atomic uint32_t tail;        // Advanced by the owning thread only
+    atomic_ulong dropped;
+    unsigned long reported_drops; // Drain thread only
+    struct log_record records[LOG_RING_RECORDS];
+};
+
+static atomic_int log_level = LOG_INFO;
+static _Atomic(struct log_ring *) log_rings;
+static atomic_bool log_running;
+static pthread_t log_thread;
+static _Thread_local struct log_ring *log_thread_ring;
+
+#define log_enabled(level) \
+    ((level) <= LOG_COMPILE_LEVEL && (level) <= atomic_load_explicit(&log_level, memory_order_relaxed))
+
+#define log_at(level, ...) do { \
+    if (log_enabled(level)) { \
+        log_write(level, __VA_ARGS__); \
+    } \
+} while (0)
+
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+
+static inline FILE *log_stream(int level) {
+    return level <= LOG_WARN ? stderr : stdout;
+}
+
+// Parses a level name ("error", "warn", "info", "debug" or "off") or number.
+static inline int log_parse_level(const char *name) {
+    static const char *const names[] = {"error", "warn", "info", "debug"};
+
+    if (strcmp(name, "off") == 0) {
+        return LOG_OFF;
+    }
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(name, names[i]) == 0) {
+            return i;
+        }
+    }
+    if (name[0] >= '0' && name[0] <= '3' && name[1] == '\0') {
+        return name[0] - '0';
+    }
+    return -2;
+}
+
+static inline void log_set_level(int level) {
+    atomic_store_explicit(&log_level, level, memory_order_relaxed);
+}
+
+// Returns the calling thread's ring, registering it on first use.
+static inline struct log_ring *log_ring_for_thread(void) {
+    if (!log_thread_ring) {
+        struct log_ring *ring = calloc(1, sizeof(struct log_ring));
+        if (!ring) {
+            return NULL;
+        }
+        ring->next = atomic_load_explicit(&log_rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(&log_rings, &ring->next, ring, memory_order_release, memory_order_relaxed)) {
+        }
+        log_thread_ring = ring;
+    }
+    return log_thread_ring;
+}
+
+__attribute__((format(printf, 2, 3)))
+static void log_write(int level, const char *format, ...) {
+    va_list args;
+
+    if (!atomic_load_explicit(&log_running, memory_order_acquire)) {
+        FILE *stream = log_stream(level);
+        va_start(args, format);
+        vfprintf(stream, format, args);
+        va_end(args);
+        fputc('\n', stream);
+        return;
+    }
+
+    struct log_ring *ring = log_ring_for_thread();
+    if (!ring) {
+        return;
+    }
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_RECORDS) {
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+
+    struct log_record *record = &ring->records[tail & (LOG_RING_RECORDS - 1)];
+    va_start(args, format);
+    int length = vsnprintf(record->text, sizeof(record->text), format, args);
+    va_end(args);
+    record->level = level;
+    record->length = length < 0 ? 0 : length < LOG_MESSAGE_SIZE ? length : LOG_MESSAGE_SIZE - 1;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+// Writes out everything queued so far. Returns the number of records written.
+static size_t log_drain(void) {
+    size_t written = 0;
+
+    for (struct log_ring *ring = atomic_load_explicit(&log_rings, memory_order_acquire); ring; ring = ring->next) {
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        for (; head != tail; head++) {
+            struct log_record *record = &ring->records[head & (LOG_RING_RECORDS - 1)];
+            FILE *stream = log_stream(record->level);
+            fwrite(record->text, 1, record->length, stream);
+            fputc('\n', stream);
+            written++;
+        }
+        atomic_store_explicit(&ring->head, head, memory_order_release);
+
+        unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        if (dropped != ring->reported_drops) {
+            fprintf(stderr, "[Server] Log buffer full, dropped %lu messages\n", dropped - ring->reported_drops);
+            ring->reported_drops = dropped;
+        }
+    }
+    return written;
+}
+
+static void *log_run(void *arg) {
+    (void)arg;
+    while (atomic_load_explicit(&log_running, memory_order_acquire)) {
+        if (log_drain() == 0) {
+            fflush(stdout);
+            fflush(stderr);
+            struct timespec idle = {0, LOG_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    log_drain();
+    fflush(stdout);
+    fflush(stderr);
+    return NULL;
+}
+
+// Starts the drain thread. Returns 0 on success; on failure messages keep
+// being written directly.
+static inline int log_start(void) {
+    if (LOG_COMPILE_LEVEL == LOG_OFF) {
+        return 0;
+    }
+    atomic_store_explicit(&log_running, true, memory_order_release);
+    if (pthread_create(&log_thread, NULL, log_run, NULL) != 0) {
+        atomic_store_explicit(&log_running, false, memory_order_release);
+        return -1;
+    }
+    return 0;
+}
+
+// Stops the drain thread after it has written out every queued message.
+static inline void log_stop(void) {
+    if (atomic_exchange_explicit(&log_running, false, memory_order_acq_rel)) {
+        pthread_join(log_thread, NULL);
+    }
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "histogram.h"
+
+/*
+ * Counters and latency histograms that one thread writes and any thread may
+ * read. Each value is a relaxed atomic updated with a plain load and store, so
+ * recording costs no more than on a private histogram and never takes a lock
+ * or a locked instruction. Readers take a snapshot into a struct histogram; a
+ * snapshot taken during a burst may miss the latest few values, never more.
+ */
+
+struct metrics_histogram {
+    atomic_ulong sum;
+    atomic_ulong max;
+    atomic_ulong buckets[HISTOGRAM_BUCKETS];
+};
+
+static inline uint64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline void metrics_add(atomic_ulong *counter, long delta) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + delta, memory_order_relaxed);
+}
+
+// Only the owning thread may record.
+static inline void metrics_record(struct metrics_histogram *histogram, uint64_t value) {
+    metrics_add(&histogram->buckets[histogram_index(value)], 1);
+    metrics_add(&histogram->sum, value);
+    if (value > atomic_load_explicit(&histogram->max, memory_order_relaxed)) {
+        atomic_store_explicit(&histogram->max, value, memory_order_relaxed);
+    }
+}
+
+// Adds the values recorded so far to `into`. The count is taken from the
+// buckets so that percentiles stay consistent with them.
+static inline void metrics_snapshot(struct histogram *into, struct metrics_histogram *from) {
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        uint64_t count = atomic_load_explicit(&from->buckets[i], memory_order_relaxed);
+        into->buckets[i] += count;
+        into->count += count;
+    }
+    into->sum += atomic_load_explicit(&from->sum, memory_order_relaxed);
+    if (max > into->max) {
+        into->max = max;
+    }
+}
+
+#endif
@@ -14,9 +14,66 @@ void getInput(char* prompt, char* buffer) {
     fgets(buffer, BUFFER_SIZE, stdin);
 }
 
+// Sends the whole script in a single write using newline framing, then reads
+// the newline-terminated replies until the game is halted.
+void run_pipelined(int client_fd, FILE *fp, char player) {
+    char buffer[BUFFER_SIZE] = {0};
+    char *script = NULL;
+    size_t script_len = 0;
+
+    while (fgets(buffer, sizeof(buffer), fp) != NULL) {
+        buffer[strcspn(buffer, "\r\n")] = 0;
+        size_t len = strlen(buffer);
+        char *grown = realloc(script, script_len + len + 1);
+        if (!grown) {
+            perror("[Client] realloc() failed.");
+            exit(EXIT_FAILURE);
+        }
+        script = grown;
+        memcpy(script + script_len, buffer, len);
+        script[script_len + len] = '\n';
+        script_len += len + 1;
+    }
+    if (send(client_fd, script, script_len, 0) != (ssize_t)script_len) {
+        perror("[Client] send() failed.");
+        exit(EXIT_FAILURE);
+    }
+    free(script);
+
+    size_t pending = 0;
+    while (1) {
+        int nbytes = read(client_fd, buffer + pending, BUFFER_SIZE - 1 - pending);
+        if (nbytes <= 0) {
+            perror("[Client] read() failed.");
+            exit(EXIT_FAILURE);
+        }
+        pending += nbytes;
+        buffer[pending] = '\0';
+
+        char *line = buffer;
+        char *newline;
+        while ((newline = strchr(line, '\n')) != NULL) {
+            *newline = '\0';
+            printf("[Client%c] Received from server: %s\n", player, line);
+            if (strcmp(line, "H 1") == 0) {
+                printf("[Client%c] We have Won!\n", player);
+                return;
+            }
+            if (strcmp(line, "H 0") == 0) {
+                printf("[Client%c] We have Lost!\n", player);
+                return;
+            }
+            line = newline + 1;
+        }
+        pending = strlen(line);
+        memmove(buffer, line, pending);
+    }
+}
+
 int main(int argc, char **argv) {
     FILE *fp;
     fp = fopen(argv[1], "r");
+    int pipelined = argc > 2 && strcmp(argv[2], "-p") == 0;
     char player_number[2];
     getInput("Which player are you? (1 or 2)", player_number);
     int client_fd = 0;
@@ -43,6 +100,12 @@ int main(int argc, char **argv) {
         perror("[Client] connect() failed.");
         exit(EXIT_FAILURE);
     }
+    if (pipelined) {
+        run_pipelined(client_fd, fp, player_number[0]);
+        printf("[Client%c] Shutting down.\n",player_number[0]);
+        close(client_fd);
+        return 0;
+    }
     while (fgets(buffer, sizeof(buffer), fp) != NULL) {
         buffer[strcspn(buffer, "\r\n")] = 0;
         send(client_fd, buffer, strlen(buffer), 0);
@@ -0,0 +1,143 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+/*
+ * Per-worker memory pools. An object pool hands out fixed-size objects carved
+ * from slabs, and a buffer pool hands out zeroed buffers in power-of-two size
+ * classes. Both keep what is given back for the next request instead of
+ * returning it to the system, so a worker stops calling malloc once it has
+ * seen its peak load. Each buffer class keeps at most POOL_CLASS_CACHE bytes,
+ * so a burst of large boards is not held on to for good. Only the owning
+ * thread takes and gives back; the occupancy counters are relaxed atomics that
+ * any thread may read.
+ */
+
+#define POOL_SLAB_OBJECTS 64
+#define POOL_ALIGN 16
+#define POOL_MIN_CLASS 6             // 64-byte buffers
+#define POOL_MAX_CLASS 24            // 16 MiB; larger buffers bypass the pool
+#define POOL_CLASSES (POOL_MAX_CLASS - POOL_MIN_CLASS + 1)
+#define POOL_CLASS_CACHE (64u << 20)
+
+struct pool_free {
+    struct pool_free *next;
+};
+
+struct object_pool {
+    size_t object_size;
+    struct pool_free *free;
+    void *slabs;                     // Each slab starts with a link to the next
+    atomic_ulong in_use;
+    atomic_ulong capacity;           // Objects carved so far
+};
+
+struct buffer_pool {
+    struct pool_free *free[POOL_CLASSES];
+    atomic_ulong in_use[POOL_CLASSES];
+    atomic_ulong cached[POOL_CLASSES];  // Given back and waiting for reuse
+    atomic_ulong oversize;           // In use, straight from the heap
+};
+
+static inline void object_pool_init(struct object_pool *pool, size_t object_size) {
+    memset(pool, 0, sizeof(*pool));
+    pool->object_size = (object_size + POOL_ALIGN - 1) / POOL_ALIGN * POOL_ALIGN;
+}
+
+// Hands out an object. A new one is zeroed; a recycled one is as it was given
+// back, so it can carry buffers over from its last use. Returns NULL if out
+// of memory.
+static inline void *object_pool_get(struct object_pool *pool) {
+    if (!pool->free) {
+        uint8_t *slab = calloc(1, POOL_ALIGN + POOL_SLAB_OBJECTS * pool->object_size);
+        if (!slab) {
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+            struct pool_free *object = (struct pool_free *)(slab + POOL_ALIGN + i * pool->object_size);
+            object->next = pool->free;
+            pool->free = object;
+        }
+        metrics_add(&pool->capacity, POOL_SLAB_OBJECTS);
+    }
+
+    struct pool_free *object = pool->free;
+    pool->free = object->next;
+    object->next = NULL;
+    metrics_add(&pool->in_use, 1);
+    return object;
+}
+
+static inline void object_pool_put(struct object_pool *pool, void *object) {
+    struct pool_free *entry = object;
+
+    entry->next = pool->free;
+    pool->free = entry;
+    metrics_add(&pool->in_use, -1);
+}
+
+// The size class of a buffer of `size` bytes, or -1 if it bypasses the pool.
+static inline int buffer_pool_class(size_t size) {
+    int class = POOL_MIN_CLASS;
+
+    while (class <= POOL_MAX_CLASS && ((size_t)1 << class) < size) {
+        class++;
+    }
+    return class <= POOL_MAX_CLASS ? class - POOL_MIN_CLASS : -1;
+}
+
+// Hands out a zeroed buffer of at least `size` bytes. Returns NULL if out of
+// memory.
+static inline void *buffer_pool_get(struct buffer_pool *pool, size_t size) {
+    int class = buffer_pool_class(size);
+
+    if (class < 0) {
+        void *buffer = calloc(1, size);
+        if (buffer) {
+            metrics_add(&pool->oversize, 1);
+        }
+        return buffer;
+    }
+
+    struct pool_free *buffer = pool->free[class];
+    if (buffer) {
+        pool->free[class] = buffer->next;
+        buffer->next = NULL;
+        metrics_add(&pool->cached[class], -1);
+    } else if (!(buffer = calloc(1, (size_t)1 << (class + POOL_MIN_CLASS)))) {
+        return NULL;
+    }
+    metrics_add(&pool->in_use[class], 1);
+    return buffer;
+}
+
+// Takes back a buffer of `size` bytes, which the caller has zeroed again. That
+// lets the owner clear only what it wrote instead of the whole buffer.
+static inline void buffer_pool_put(struct buffer_pool *pool, void *buffer, size_t size) {
+    int class = buffer_pool_class(size);
+
+    if (class < 0) {
+        free(buffer);
+        metrics_add(&pool->oversize, -1);
+        return;
+    }
+    metrics_add(&pool->in_use[class], -1);
+    if ((atomic_load_explicit(&pool->cached[class], memory_order_relaxed) + 1) << (class + POOL_MIN_CLASS) > POOL_CLASS_CACHE) {
+        free(buffer);
+        return;
+    }
+    struct pool_free *entry = buffer;
+    entry->next = pool->free[class];
+    pool->free[class] = entry;
+    metrics_add(&pool->cached[class], 1);
+}
+
+#endif
@@ -0,0 +1,267 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "wire.h"
+
+/*
+ * Match recording. Every match is logged to an append-only file as a stream
+ * of records, each a 16-byte header and a payload. Integers are
+ * little-endian, as on the wire.
+ *
+ *   header   u8 type, u8 flags, u16 error, u32 match id, u32 microseconds
+ *            since the match started, u32 payload length
+ *
+ * Records:
+ *   R   Recording started: u32 RECORD_MAGIC, u32 RECORD_VERSION, u64 wall
+ *       clock in ns. Written once per server run; matches still open from an
+ *       earlier run were cut short.
+ *   M   Match started: u32 shard, u64 wall clock in ns
+ *   B   Begin: i32 width, i32 height
+ *   I   Initialize: 5 x (i32 piece type, i32 rotation, i32 row, i32 col)
+ *   S   Shoot: i32 row, i32 col, u8 'H', 'M', or 0 if no shot was taken
+ *   V   Volley: u32 count, count x (i32 row, i32 col), u32 shots fired,
+ *       then one bit per shot fired, least significant first, set for a hit
+ *   F   Forfeit: empty
+ *   D   The player's connection went away: empty
+ *   X   Match freed: u8 phase it was in
+ *   G   Records were dropped: u32 shard, u32 records lost. Matches open on
+ *       that shard are incomplete.
+ *
+ * Packet records (B, I, S, V, F) carry the packet as the match engine saw
+ * it and its outcome: flags hold RECORD_PLAYER2 and the packet's parse
+ * flags, error is the code the player was answered with (0 if none), and
+ * the fields of a malformed packet are zero. Packets that cannot change a
+ * match (queries, packets out of phase, packets after the halt) are not
+ * recorded.
+ *
+ * Each shard writes into its own ring and never waits: a record that does
+ * not fit is dropped and counted. A background thread drains the rings to
+ * the file. A shard's records are in order, and the records of a match all
+ * come from the one shard that hosts it.
+ */
+
+#define RECORD_MAGIC 0x43525342u       // "BSRC"
+#define RECORD_VERSION 1
+#define RECORD_HEADER_SIZE 16
+#define RECORD_RING_SIZE (1u << 22)     // Per shard, must be a power of two
+#define RECORD_IDLE_SLEEP_NS 5000000
+
+#define RECORD_PLAYER2 0x01
+#define RECORD_BARE 0x02
+#define RECORD_HAS_PARAMETERS 0x04
+#define RECORD_WELL_FORMED 0x08
+
+struct record_header {
+    char type;
+    uint8_t flags;
+    uint16_t error;
+    uint32_t match_id;
+    uint32_t time_us;
+    uint32_t length;
+};
+
+struct record_ring {
+    _Atomic uint32_t head;             // Advanced by the drain thread only
+    _Atomic uint32_t tail;             // Advanced by the owning shard only
+    atomic_ulong dropped;
+    uint32_t unreported;               // Drops not yet marked by a G record
+    uint32_t shard;
+    uint8_t data[RECORD_RING_SIZE];
+};
+
+struct recorder {
+    int fd;
+    int num_rings;
+    struct record_ring *rings;
+    atomic_bool running;
+    bool failed;                       // A write failed; records are discarded
+    pthread_t thread;
+};
+
+static inline size_t record_put_header(uint8_t *p, char type, uint8_t flags, uint16_t error, uint32_t match_id,
+                                       uint32_t time_us, uint32_t length) {
+    p[0] = (uint8_t)type;
+    p[1] = flags;
+    wire_put_u16(p + 2, error);
+    wire_put_u32(p + 4, match_id);
+    wire_put_u32(p + 8, time_us);
+    wire_put_u32(p + 12, length);
+    return RECORD_HEADER_SIZE;
+}
+
+static inline void record_get_header(const uint8_t *p, struct record_header *header) {
+    header->type = (char)p[0];
+    header->flags = p[1];
+    header->error = wire_get_u16(p + 2);
+    header->match_id = wire_get_u32(p + 4);
+    header->time_us = wire_get_u32(p + 8);
+    header->length = wire_get_u32(p + 12);
+}
+
+static inline void record_put_u64(uint8_t *p, uint64_t value) {
+    wire_put_u32(p, (uint32_t)value);
+    wire_put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+static inline uint64_t record_get_u64(const uint8_t *p) {
+    return wire_get_u32(p) | (uint64_t)wire_get_u32(p + 4) << 32;
+}
+
+static inline uint64_t record_wall_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static inline uint32_t record_ring_used(struct record_ring *ring) {
+    return atomic_load_explicit(&ring->tail, memory_order_relaxed) - atomic_load_explicit(&ring->head, memory_order_acquire);
+}
+
+static inline void record_ring_copy(struct record_ring *ring, uint32_t tail, const uint8_t *data, uint32_t length) {
+    uint32_t start = tail & (RECORD_RING_SIZE - 1);
+    uint32_t first = RECORD_RING_SIZE - start < length ? RECORD_RING_SIZE - start : length;
+
+    memcpy(ring->data + start, data, first);
+    memcpy(ring->data, data + first, length - first);
+}
+
+// Appends a complete record, preceded by a G record if earlier ones were
+// dropped. Called by the owning shard only; never blocks.
+static inline void record_ring_put(struct record_ring *ring, const uint8_t *record, uint32_t length) {
+    uint8_t gap[RECORD_HEADER_SIZE + 8];
+    uint32_t gap_length = ring->unreported ? sizeof(gap) : 0;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+    if (RECORD_RING_SIZE - record_ring_used(ring) < gap_length + length) {
+        ring->unreported++;
+        atomic_store_explicit(&ring->dropped, atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1, memory_order_relaxed);
+        return;
+    }
+    if (gap_length) {
+        record_put_header(gap, 'G', 0, 0, 0, 0, 8);
+        wire_put_u32(gap + RECORD_HEADER_SIZE, ring->shard);
+        wire_put_u32(gap + RECORD_HEADER_SIZE + 4, ring->unreported);
+        record_ring_copy(ring, tail, gap, gap_length);
+        ring->unreported = 0;
+    }
+    record_ring_copy(ring, tail + gap_length, record, length);
+    atomic_store_explicit(&ring->tail, tail + gap_length + length, memory_order_release);
+}
+
+static inline int record_write_all(int fd, const uint8_t *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, data, length);
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+// Writes out everything the shards have recorded so far. Returns the number
+// of bytes taken from the rings.
+static size_t recorder_drain(struct recorder *recorder) {
+    size_t drained = 0;
+
+    for (int i = 0; i < recorder->num_rings; i++) {
+        struct record_ring *ring = &recorder->rings[i];
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        uint32_t start = head & (RECORD_RING_SIZE - 1);
+        uint32_t length = tail - head;
+        uint32_t first = RECORD_RING_SIZE - start < length ? RECORD_RING_SIZE - start : length;
+
+        if (length == 0) {
+            continue;
+        }
+        if (!recorder->failed && (record_write_all(recorder->fd, ring->data + start, first) != 0 ||
+                                  record_write_all(recorder->fd, ring->data, length - first) != 0)) {
+            perror("[Server] Failed to write the match recording, recording stopped");
+            recorder->failed = true;
+        }
+        atomic_store_explicit(&ring->head, tail, memory_order_release);
+        drained += length;
+    }
+    return drained;
+}
+
+static void *recorder_run(void *arg) {
+    struct recorder *recorder = arg;
+
+    while (atomic_load_explicit(&recorder->running, memory_order_acquire)) {
+        if (recorder_drain(recorder) == 0) {
+            struct timespec idle = {0, RECORD_IDLE_SLEEP_NS};
+            nanosleep(&idle, NULL);
+        }
+    }
+    recorder_drain(recorder);
+    return NULL;
+}
+
+// Opens the recording for appending, marks the start of this run in it and
+// starts the drain thread. Returns 0 on success, -1 with errno set otherwise.
+static inline int recorder_start(struct recorder *recorder, const char *path, int num_rings) {
+    uint8_t start[RECORD_HEADER_SIZE + 16];
+
+    recorder->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (recorder->fd == -1) {
+        return -1;
+    }
+    recorder->rings = calloc(num_rings, sizeof(struct record_ring));
+    if (!recorder->rings) {
+        close(recorder->fd);
+        return -1;
+    }
+    recorder->num_rings = num_rings;
+    for (int i = 0; i < num_rings; i++) {
+        recorder->rings[i].shard = i;
+    }
+
+    record_put_header(start, 'R', 0, 0, 0, 0, 16);
+    wire_put_u32(start + RECORD_HEADER_SIZE, RECORD_MAGIC);
+    wire_put_u32(start + RECORD_HEADER_SIZE + 4, RECORD_VERSION);
+    record_put_u64(start + RECORD_HEADER_SIZE + 8, record_wall_clock_ns());
+    if (record_write_all(recorder->fd, start, sizeof(start)) != 0) {
+        goto fail;
+    }
+
+    atomic_store_explicit(&recorder->running, true, memory_order_release);
+    if (pthread_create(&recorder->thread, NULL, recorder_run, recorder) != 0) {
+        atomic_store_explicit(&recorder->running, false, memory_order_release);
+        errno = EAGAIN;
+        goto fail;
+    }
+    return 0;
+
+fail:
+    free(recorder->rings);
+    close(recorder->fd);
+    return -1;
+}
+
+// Stops the drain thread after everything recorded so far is written.
+static inline void recorder_stop(struct recorder *recorder) {
+    if (atomic_exchange_explicit(&recorder->running, false, memory_order_acq_rel)) {
+        pthread_join(recorder->thread, NULL);
+    }
+    close(recorder->fd);
+}
+
+#endif
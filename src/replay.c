@@ -0,0 +1,496 @@
+// Replays match recordings made with `server -R` through the server's own
+// match engine and the frontend that answers for it, and checks that every
+// packet gets the outcome it got when it was recorded: the same error code,
+// and the same hits and misses for shots. The replayed matches record
+// themselves into an in-memory ring the way the server does, and each packet
+// record is compared with the original byte for byte, apart from the match
+// id and the time.
+//
+// Matches cut short by a restart or by dropped records are skipped. With -d,
+// the records of one match are printed as they are replayed.
+//
+// Build: gcc -O2 -pthread -o replay src/replay.c
+// Usage: replay [-d match_id] [-n passes] [-v] record_file...
+#define HW4_NO_MAIN
+#include "hw4.c"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+struct replay_match {
+    struct conn conns[2];
+    uint32_t shard;
+};
+
+struct replay_stats {
+    unsigned long sessions;
+    unsigned long matches;
+    unsigned long complete;
+    unsigned long cut_short;
+    unsigned long mismatched;
+    unsigned long records;
+    unsigned long packets;
+};
+
+static struct shard replay_shard;
+static struct replay_match **open_matches;   // Indexed by match id
+static uint32_t open_capacity;
+static int devnull = -1;
+static bool verbose;
+static long dump_id = -1;
+static struct replay_stats stats;
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static const char *const phase_labels[PHASE_HALT + 1] = {
+    "begin_p1", "begin_p2", "init_p1", "init_p2", "turn_p1", "turn_p2", "halt",
+};
+
+// Prints a record as one line of text.
+void print_record(FILE *out, const struct record_header *header, const uint8_t *payload) {
+    fprintf(out, "%10.3f ms  match %u  ", header->time_us / 1000.0, header->match_id);
+    switch (header->type) {
+    case 'M':
+        fprintf(out, "started on shard %u\n", wire_get_u32(payload));
+        return;
+    case 'X':
+        fprintf(out, "freed in phase %s\n", payload[0] <= PHASE_HALT ? phase_labels[payload[0]] : "?");
+        return;
+    case 'D':
+        fprintf(out, "Player %d disconnected\n", header->flags & RECORD_PLAYER2 ? 2 : 1);
+        return;
+    }
+
+    fprintf(out, "Player %d  %c", header->flags & RECORD_PLAYER2 ? 2 : 1, header->type);
+    if (!(header->flags & (RECORD_WELL_FORMED | RECORD_BARE))) {
+        fprintf(out, " (malformed)");
+    }
+    switch (header->type) {
+    case 'B':
+        if (header->flags & RECORD_WELL_FORMED) {
+            fprintf(out, " %d %d", wire_get_i32(payload), wire_get_i32(payload + 4));
+        }
+        break;
+    case 'I':
+        for (int i = 0; i < FLEET_SIZE * 4 && (header->flags & RECORD_WELL_FORMED); i++) {
+            fprintf(out, " %d", wire_get_i32(payload + i * 4));
+        }
+        break;
+    case 'S':
+        fprintf(out, " %d %d -> %c", wire_get_i32(payload), wire_get_i32(payload + 4), payload[8] ? payload[8] : '-');
+        break;
+    case 'V': {
+        uint32_t count = wire_get_u32(payload);
+        const uint8_t *fired = payload + 4 + count * 8;
+
+        fprintf(out, " %u shots ->%s", count, wire_get_u32(fired) ? " " : "");
+        for (uint32_t i = 0; i < wire_get_u32(fired); i++) {
+            fputc(fired[4 + i / 8] & (1u << (i % 8)) ? 'H' : 'M', out);
+        }
+        break;
+    }
+    }
+    if (header->error) {
+        fprintf(out, "  E %d", header->error);
+    }
+    fputc('\n', out);
+}
+
+// Whether a record's payload has the size its type calls for.
+bool valid_payload(const struct record_header *header, const uint8_t *payload) {
+    switch (header->type) {
+    case 'R':
+        return header->length >= 16;
+    case 'M':
+        return header->length >= 12;
+    case 'G':
+        return header->length >= 8;
+    case 'X':
+        return header->length >= 1;
+    case 'B':
+        return header->length == 8;
+    case 'I':
+        return header->length == FLEET_SIZE * 16;
+    case 'S':
+        return header->length == 9;
+    case 'V': {
+        if (header->length < 8) {
+            return false;
+        }
+        uint32_t count = wire_get_u32(payload);
+        if (count > VOLLEY_MAX_SHOTS || header->length < 8 + count * 8) {
+            return false;
+        }
+        uint32_t fired = wire_get_u32(payload + 4 + count * 8);
+        return fired <= count && header->length == 8 + count * 8 + (fired + 7) / 8;
+    }
+    default:
+        return true;
+    }
+}
+
+// Rebuilds the packet a record was made from.
+void decode_record_packet(const struct record_header *header, const uint8_t *payload, struct packet *packet) {
+    static const enum packet_kind kinds[128] = {
+        ['B'] = PACKET_BEGIN, ['I'] = PACKET_INITIALIZE, ['S'] = PACKET_SHOOT,
+        ['V'] = PACKET_VOLLEY, ['F'] = PACKET_FORFEIT,
+    };
+
+    packet->kind = kinds[(uint8_t)header->type];
+    packet->text = "(replay)";
+    packet->bare = header->flags & RECORD_BARE;
+    packet->has_parameters = header->flags & RECORD_HAS_PARAMETERS;
+    packet->well_formed = header->flags & RECORD_WELL_FORMED;
+    switch (packet->kind) {
+    case PACKET_BEGIN:
+        packet->begin.width = wire_get_i32(payload);
+        packet->begin.height = wire_get_i32(payload + 4);
+        break;
+    case PACKET_INITIALIZE:
+        for (int i = 0; i < FLEET_SIZE; i++) {
+            packet->pieces[i].piece_type = wire_get_i32(payload + i * 16);
+            packet->pieces[i].rotation = wire_get_i32(payload + i * 16 + 4);
+            packet->pieces[i].ref_row = wire_get_i32(payload + i * 16 + 8);
+            packet->pieces[i].ref_col = wire_get_i32(payload + i * 16 + 12);
+        }
+        break;
+    case PACKET_SHOOT:
+        packet->shot.row = wire_get_i32(payload);
+        packet->shot.col = wire_get_i32(payload + 4);
+        break;
+    case PACKET_VOLLEY:
+        packet->volley.count = wire_get_u32(payload);
+        for (int i = 0; i < packet->volley.count; i++) {
+            packet->volley.cells[i][0] = wire_get_i32(payload + 4 + i * 8);
+            packet->volley.cells[i][1] = wire_get_i32(payload + 8 + i * 8);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// Drops the replies of the last event and what it marked for flushing or
+// freeing; nothing is ever sent.
+void reset_outputs(struct replay_match *replay) {
+    for (int i = 0; i < 2; i++) {
+        struct conn *conn = &replay->conns[i];
+        conn_discard_output(conn);
+        conn->dirty = false;
+    }
+    replay_shard.dirty = NULL;
+    replay_shard.graveyard = NULL;
+}
+
+// Finds the record of type `type` the last event wrote to the replay ring.
+const uint8_t *take_replayed(char type) {
+    struct record_ring *ring = replay_shard.record;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    const uint8_t *found = NULL;
+
+    for (uint32_t offset = 0; offset < tail && !found;) {
+        struct record_header header;
+        record_get_header(ring->data + offset, &header);
+        if (header.type == type) {
+            found = ring->data + offset;
+        }
+        offset += RECORD_HEADER_SIZE + header.length;
+    }
+    return found;
+}
+
+// Every record an event writes fits in the ring, so it starts at offset 0.
+void clear_replayed(void) {
+    atomic_store_explicit(&replay_shard.record->head, 0, memory_order_relaxed);
+    atomic_store_explicit(&replay_shard.record->tail, 0, memory_order_relaxed);
+}
+
+struct replay_match *find_match(uint32_t id) {
+    return id < open_capacity ? open_matches[id] : NULL;
+}
+
+void release_match(uint32_t id) {
+    struct replay_match *replay = open_matches[id];
+
+    for (int i = 0; i < 2; i++) {
+        struct match *match = replay->conns[i].match;
+        if (match) {
+            // The match outlived the recording; detach both players first
+            for (int j = 0; j < 2; j++) {
+                match->players[j] = NULL;
+                replay->conns[j].match = NULL;
+            }
+            match_free(match);
+        }
+    }
+    reset_outputs(replay);
+    clear_replayed();
+    free(replay);
+    open_matches[id] = NULL;
+}
+
+// Drops every open match, or only those of one shard.
+void cut_short(bool all, uint32_t shard) {
+    for (uint32_t id = 0; id < open_capacity; id++) {
+        if (open_matches[id] && (all || open_matches[id]->shard == shard)) {
+            release_match(id);
+            stats.cut_short++;
+        }
+    }
+}
+
+int open_match(const struct record_header *header, const uint8_t *payload) {
+    uint32_t id = header->match_id;
+
+    if (id >= open_capacity) {
+        uint32_t capacity = open_capacity ? open_capacity : 1024;
+        while (capacity <= id) {
+            capacity *= 2;
+        }
+        struct replay_match **grown = realloc(open_matches, capacity * sizeof(*grown));
+        if (!grown) {
+            return -1;
+        }
+        memset(grown + open_capacity, 0, (capacity - open_capacity) * sizeof(*grown));
+        open_matches = grown;
+        open_capacity = capacity;
+    }
+    if (open_matches[id]) {
+        release_match(id);
+        stats.cut_short++;
+    }
+
+    struct replay_match *replay = calloc(1, sizeof(struct replay_match));
+    if (!replay) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct conn *conn = &replay->conns[i];
+        conn->kind = ENDPOINT_CONN;
+        conn->fd = devnull;
+        conn->shard = &replay_shard;
+        conn->wire = WIRE_BINARY;  // Cheapest replies to format
+    }
+    replay->shard = wire_get_u32(payload);
+    if (!match_create(&replay_shard, &replay->conns[0], &replay->conns[1])) {
+        free(replay);
+        return -1;
+    }
+    open_matches[id] = replay;
+    stats.matches++;
+    clear_replayed();
+    return 0;
+}
+
+void report_mismatch(const struct record_header *header, const uint8_t *payload, const uint8_t *replayed) {
+    stats.mismatched++;
+    if (!verbose) {
+        return;
+    }
+    fprintf(stderr, "[Replay] Match %u diverged\n  recorded: ", header->match_id);
+    print_record(stderr, header, payload);
+    fprintf(stderr, "  replayed: ");
+    if (replayed) {
+        struct record_header replayed_header;
+        record_get_header(replayed, &replayed_header);
+        replayed_header.match_id = header->match_id;
+        replayed_header.time_us = header->time_us;
+        print_record(stderr, &replayed_header, replayed + RECORD_HEADER_SIZE);
+    } else {
+        fprintf(stderr, "nothing\n");
+    }
+}
+
+// Whether the last event wrote the same record, apart from the match id
+// and the time.
+bool same_record(const uint8_t *recorded, const uint8_t *replayed, uint32_t length) {
+    return replayed && memcmp(recorded, replayed, 4) == 0 &&
+           memcmp(recorded + 12, replayed + 12, RECORD_HEADER_SIZE - 12 + length) == 0;
+}
+
+// Replays one event of a match. Returns false once the match diverged.
+bool replay_event(struct replay_match *replay, const struct record_header *header, const uint8_t *record) {
+    const uint8_t *payload = record + RECORD_HEADER_SIZE;
+    int player = header->flags & RECORD_PLAYER2 ? 1 : 0;
+    struct conn *conn = &replay->conns[player];
+    const uint8_t *replayed;
+
+    if (header->type == 'X') {
+        // Packets after the halt are not recorded, so the replayed match may
+        // still wait for them; it must have reached the same phase
+        struct match *match = conn->match ? conn->match : replay->conns[1 - player].match;
+        return !match || match->game.phase == payload[0];
+    }
+    if (!conn->match) {
+        report_mismatch(header, payload, NULL);
+        return false;
+    }
+    if (header->type == 'D') {
+        conn->fd = dup(devnull);
+        conn_close(conn);
+    } else {
+        struct packet packet;
+        decode_record_packet(header, payload, &packet);
+        match_handle_packet(conn->match, player, &packet);
+        stats.packets++;
+    }
+    replayed = take_replayed(header->type);
+    reset_outputs(replay);
+    clear_replayed();
+    if (!same_record(record, replayed, header->length)) {
+        report_mismatch(header, payload, replayed);
+        return false;
+    }
+    return true;
+}
+
+// Replays every match of a recording. Returns -1 if the file is malformed.
+int replay_file(const char *path, const uint8_t *data, size_t size) {
+    size_t offset = 0;
+
+    while (offset + RECORD_HEADER_SIZE <= size) {
+        struct record_header header;
+        record_get_header(data + offset, &header);
+        const uint8_t *record = data + offset;
+        const uint8_t *payload = record + RECORD_HEADER_SIZE;
+
+        if (header.length > size - offset - RECORD_HEADER_SIZE) {
+            break;
+        }
+        if (!valid_payload(&header, payload)) {
+            fprintf(stderr, "[Replay] %s: malformed %c record at offset %zu\n", path, header.type, offset);
+            return -1;
+        }
+        offset += RECORD_HEADER_SIZE + header.length;
+        stats.records++;
+        if ((long)header.match_id == dump_id) {
+            print_record(stdout, &header, payload);
+        }
+
+        switch (header.type) {
+        case 'R':
+            if (wire_get_u32(payload) != RECORD_MAGIC || wire_get_u32(payload + 4) != RECORD_VERSION) {
+                fprintf(stderr, "[Replay] %s: not a version %d recording\n", path, RECORD_VERSION);
+                return -1;
+            }
+            cut_short(true, 0);
+            stats.sessions++;
+            break;
+        case 'G':
+            cut_short(false, wire_get_u32(payload));
+            break;
+        case 'M':
+            if (open_match(&header, payload) != 0) {
+                perror("[Replay] Failed to allocate a match");
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'B':
+        case 'I':
+        case 'S':
+        case 'V':
+        case 'F':
+        case 'D':
+        case 'X': {
+            struct replay_match *replay = find_match(header.match_id);
+            if (!replay) {
+                break;  // Its start was lost
+            }
+            bool same = replay_event(replay, &header, record);
+            if (!same || header.type == 'X') {
+                if (same) {
+                    stats.complete++;
+                } else if (header.type == 'X') {
+                    report_mismatch(&header, payload, NULL);
+                }
+                release_match(header.match_id);
+            }
+            break;
+        }
+        default:
+            break;  // From a later version
+        }
+    }
+    if (offset != size) {
+        fprintf(stderr, "[Replay] %s: ignoring a partial record at offset %zu\n", path, offset);
+    }
+    cut_short(true, 0);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    int passes = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "d:n:v")) != -1) {
+        switch (opt) {
+        case 'd':
+            dump_id = atol(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-d match_id] [-n passes] [-v] record_file...\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "Usage: %s [-d match_id] [-n passes] [-v] record_file...\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    log_set_level(LOG_OFF);
+
+    devnull = open("/dev/null", O_WRONLY);
+    replay_shard.epoll_fd = -1;
+    object_pool_init(&replay_shard.matches, sizeof(struct match));
+    replay_shard.record = calloc(1, sizeof(struct record_ring));
+    if (devnull == -1 || !replay_shard.record) {
+        perror("[Replay] Setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    double elapsed = 0;
+    for (int i = optind; i < argc; i++) {
+        int fd = open(argv[i], O_RDONLY);
+        struct stat st;
+
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "[Replay] Cannot open %s: %s\n", argv[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (st.st_size == 0) {
+            close(fd);
+            continue;
+        }
+        uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "[Replay] Cannot map %s: %s\n", argv[i], strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        for (int pass = 0; pass < passes; pass++) {
+            double start = now_seconds();
+            if (replay_file(argv[i], data, st.st_size) != 0) {
+                exit(EXIT_FAILURE);
+            }
+            elapsed += now_seconds() - start;
+            dump_id = -1;  // Printed once is enough
+        }
+        munmap(data, st.st_size);
+    }
+
+    printf("[Replay] %lu sessions, %lu matches: %lu complete, %lu cut short, %lu diverged\n", stats.sessions,
+           stats.matches, stats.complete, stats.cut_short, stats.mismatched);
+    printf("[Replay] %lu records, %lu packets in %.3f s (%.0f records/s)\n", stats.records, stats.packets, elapsed,
+           elapsed > 0 ? stats.records / elapsed : 0);
+    return stats.mismatched ? EXIT_FAILURE : EXIT_SUCCESS;
+}
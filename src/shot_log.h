@@ -0,0 +1,102 @@
+#ifndef SHOT_LOG_H
+#define SHOT_LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "wire.h"
+
+/*
+ * Append-only log of the shots fired at one board, in the order they were
+ * fired. A shot's sequence number is its index in the log. Each shot is
+ * stored as the 8 bytes a binary G reply carries, so a binary reply is a
+ * single copy of a range of the log. The text form of the log is encoded on
+ * demand, once per shot, and kept for the next full query.
+ */
+
+#define SHOT_LOG_MIN_CAPACITY 64
+#define SHOT_LOG_ENTRY_TEXT 32       // Room for " H <row> <col>" and a terminator
+
+struct shot_log {
+    uint8_t *records;                // WIRE_SHOT_SIZE bytes per shot
+    uint32_t count;
+    uint32_t capacity;
+    char *text;                      // " H <row> <col>" per encoded shot
+    size_t text_length;
+    size_t text_capacity;
+    uint32_t text_count;             // Shots encoded into text so far
+};
+
+static inline void shot_log_free(struct shot_log *log) {
+    free(log->records);
+    free(log->text);
+    *log = (struct shot_log){0};
+}
+
+// Makes room for `shots` more shots. Returns 0 on success, -1 if out of memory.
+static inline int shot_log_reserve(struct shot_log *log, uint32_t shots) {
+    uint64_t needed = (uint64_t)log->count + shots;
+    uint64_t capacity = log->capacity ? log->capacity : SHOT_LOG_MIN_CAPACITY;
+
+    if (needed <= log->capacity) {
+        return 0;
+    }
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+    if (capacity > UINT32_MAX) {
+        return -1;
+    }
+    uint8_t *records = realloc(log->records, capacity * WIRE_SHOT_SIZE);
+    if (!records) {
+        return -1;
+    }
+    log->records = records;
+    log->capacity = capacity;
+    return 0;
+}
+
+// Appends a shot. The caller reserves room first.
+static inline void shot_log_append(struct shot_log *log, int row, int col, bool hit) {
+    uint8_t *record = log->records + (size_t)log->count++ * WIRE_SHOT_SIZE;
+
+    wire_put_u32(record, (uint32_t)row | (hit ? WIRE_SHOT_HIT : 0));
+    wire_put_u32(record + 4, (uint32_t)col);
+}
+
+// Writes the text entry of shot `seq` into `out`, which holds at least
+// SHOT_LOG_ENTRY_TEXT bytes, and returns its length.
+static inline int shot_log_format(const struct shot_log *log, uint32_t seq, char *out) {
+    const uint8_t *record = log->records + (size_t)seq * WIRE_SHOT_SIZE;
+    uint32_t row = wire_get_u32(record);
+
+    return snprintf(out, SHOT_LOG_ENTRY_TEXT, " %c %d %d", row & WIRE_SHOT_HIT ? 'H' : 'M',
+                    (int)(row & ~WIRE_SHOT_HIT), wire_get_i32(record + 4));
+}
+
+// Encodes the shots fired since the last call into the text form. Returns 0
+// on success, -1 if out of memory.
+static inline int shot_log_encode_text(struct shot_log *log) {
+    size_t needed = log->text_length + (size_t)(log->count - log->text_count) * SHOT_LOG_ENTRY_TEXT;
+
+    if (!log->text || needed > log->text_capacity) {
+        size_t capacity = log->text ? log->text_capacity : SHOT_LOG_MIN_CAPACITY * SHOT_LOG_ENTRY_TEXT;
+        while (capacity < needed) {
+            capacity *= 2;
+        }
+        char *text = realloc(log->text, capacity);
+        if (!text) {
+            return -1;
+        }
+        log->text = text;
+        log->text_capacity = capacity;
+    }
+    for (; log->text_count < log->count; log->text_count++) {
+        log->text_length += shot_log_format(log, log->text_count, log->text + log->text_length);
+    }
+    return 0;
+}
+
+#endif
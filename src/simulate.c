@@ -0,0 +1,229 @@
+// Plays random games straight through the match engine, with no server and
+// no sockets, and reports how many games and shots per second it sustains.
+// Every thread plays its own games. Fleets are random and legal, and each
+// player fires at the cells of the opponent's corner in a random order, one
+// shot at a time or in volleys, until a fleet is sunk.
+//
+// Fleets and shots stay inside the top-left 10x10 corner, as in loadgen, so
+// larger boards (-b) exercise the same storage without longer games.
+//
+// Build: gcc -O2 -pthread -o simulate src/simulate.c
+// Usage: simulate [-g games] [-t threads] [-b board_size] [-v volley_size] [-s seed]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "engine.h"
+
+#define SIMULATE_CORNER 10
+#define SIMULATE_CELLS (SIMULATE_CORNER * SIMULATE_CORNER)
+
+struct simulator {
+    pthread_t thread;
+    uint64_t rng;
+    long games;
+    int board_size;
+    int volley_size;                 // 0 to shoot one cell at a time
+
+    // Results
+    long played;
+    long shots;
+    long wins[2];
+    long unexpected;                 // Replies a legal game should never get
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t next_random(struct simulator *sim) {
+    sim->rng ^= sim->rng << 13;
+    sim->rng ^= sim->rng >> 7;
+    sim->rng ^= sim->rng << 17;
+    return sim->rng;
+}
+
+static int random_below(struct simulator *sim, int bound) {
+    return (int)(next_random(sim) % bound);
+}
+
+// Draws a random legal fleet inside the corner.
+static void plan_fleet(struct simulator *sim, struct board *scratch, struct piece_placement pieces[FLEET_SIZE]) {
+    for (int id = 1; id <= FLEET_SIZE; id++) {
+        int type, rotation, row, col;
+        do {
+            type = random_below(sim, 7);
+            rotation = random_below(sim, 4);
+            row = random_below(sim, SIMULATE_CORNER);
+            col = random_below(sim, SIMULATE_CORNER);
+        } while (place_piece(scratch, type, rotation, row, col, id) != 0);
+        pieces[id - 1] = (struct piece_placement){type + 1, rotation + 1, row, col};
+    }
+    for (int id = 1; id <= FLEET_SIZE; id++) {
+        remove_piece(scratch, id);
+    }
+}
+
+static void shuffle_cells(struct simulator *sim, uint8_t cells[SIMULATE_CELLS]) {
+    for (int i = 0; i < SIMULATE_CELLS; i++) {
+        cells[i] = i;
+    }
+    for (int i = SIMULATE_CELLS - 1; i > 0; i--) {
+        int j = random_below(sim, i + 1);
+        uint8_t cell = cells[i];
+        cells[i] = cells[j];
+        cells[j] = cell;
+    }
+}
+
+// Plays one game to the end in `match`, whose boards are reused from the last
+// game. Returns the player who won.
+static int play_game(struct simulator *sim, struct engine_match *match, struct board *scratch) {
+    struct engine_result result;
+    struct piece_placement pieces[FLEET_SIZE];
+    uint8_t order[2][SIMULATE_CELLS];
+    int next[2] = {0, 0};
+
+    engine_match_reset(match);
+    engine_begin(match, 0, sim->board_size, sim->board_size, &result);
+    sim->unexpected += result.reply != ENGINE_REPLY_ACK;
+    engine_begin(match, 1, 0, 0, &result);
+    sim->unexpected += result.reply != ENGINE_REPLY_ACK;
+    for (int player = 0; player < 2; player++) {
+        plan_fleet(sim, scratch, pieces);
+        engine_initialize(match, player, pieces, &result);
+        sim->unexpected += result.reply != ENGINE_REPLY_ACK;
+        shuffle_cells(sim, order[player]);
+    }
+
+    while (match->phase != PHASE_HALT) {
+        int player = engine_expected_player(match);
+        const uint8_t *cells = order[player] + next[player];
+
+        if (next[player] == SIMULATE_CELLS) {
+            sim->unexpected++;  // The corner is exhausted, yet the fleet afloat
+            engine_forfeit(match, player, &result);
+            break;
+        }
+        if (sim->volley_size == 0) {
+            engine_shoot(match, player, cells[0] / SIMULATE_CORNER, cells[0] % SIMULATE_CORNER, &result);
+            sim->unexpected += result.reply != ENGINE_REPLY_SHOT;
+            next[player]++;
+            sim->shots++;
+            continue;
+        }
+
+        int volley[VOLLEY_MAX_SHOTS][2];
+        int count = SIMULATE_CELLS - next[player] < sim->volley_size ? SIMULATE_CELLS - next[player] : sim->volley_size;
+        for (int i = 0; i < count; i++) {
+            volley[i][0] = cells[i] / SIMULATE_CORNER;
+            volley[i][1] = cells[i] % SIMULATE_CORNER;
+        }
+        engine_volley(match, player, (const int (*)[2])volley, count, &result);
+        sim->unexpected += result.reply != ENGINE_REPLY_VOLLEY || result.error != 0;
+        next[player] += result.fired;
+        sim->shots += result.fired;
+    }
+
+    return 1 - result.loser;
+}
+
+static void *simulator_run(void *arg) {
+    struct simulator *sim = arg;
+    struct engine_match match;
+    struct board scratch;
+
+    if (initialize_board(&scratch, SIMULATE_CORNER, SIMULATE_CORNER, BOARD_BYTES) != 0) {
+        perror("[Simulate] Failed to allocate a board");
+        exit(EXIT_FAILURE);
+    }
+    engine_match_init(&match);
+    for (sim->played = 0; sim->played < sim->games; sim->played++) {
+        sim->wins[play_game(sim, &match, &scratch)]++;
+    }
+    engine_match_free(&match);
+    free_board(&scratch);
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    long games = 1000000;
+    int threads = 1;
+    int board_size = 10;
+    int volley_size = 0;
+    uint64_t seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:t:b:v:s:")) != -1) {
+        switch (opt) {
+        case 'g':
+            games = atol(optarg);
+            break;
+        case 't':
+            threads = atoi(optarg);
+            break;
+        case 'b':
+            board_size = atoi(optarg);
+            break;
+        case 'v':
+            volley_size = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-g games] [-t threads] [-b board_size] [-v volley_size] [-s seed]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (threads < 1 || games < 1 || board_size < SIMULATE_CORNER || volley_size < 0 || volley_size > VOLLEY_MAX_SHOTS) {
+        fprintf(stderr, "[Simulate] Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    log_set_level(LOG_OFF);
+
+    struct simulator *sims = calloc(threads, sizeof(struct simulator));
+    if (!sims) {
+        perror("[Simulate] Failed to allocate simulators");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) {
+        sims[i].rng = (seed + i) * 0x9E3779B97F4A7C15ull | 1;
+        sims[i].games = games / threads + (i < games % threads);
+        sims[i].board_size = board_size;
+        sims[i].volley_size = volley_size;
+        if (pthread_create(&sims[i].thread, NULL, simulator_run, &sims[i]) != 0) {
+            perror("[Simulate] pthread_create() failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    long played = 0, shots = 0, wins[2] = {0, 0}, unexpected = 0;
+    for (int i = 0; i < threads; i++) {
+        pthread_join(sims[i].thread, NULL);
+        played += sims[i].played;
+        shots += sims[i].shots;
+        wins[0] += sims[i].wins[0];
+        wins[1] += sims[i].wins[1];
+        unexpected += sims[i].unexpected;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    printf("games      %ld (Player 1 won %ld, Player 2 won %ld)\n", played, wins[0], wins[1]);
+    printf("shots      %ld (%.1f per game)\n", shots, (double)shots / played);
+    printf("elapsed    %.3f s on %d thread%s\n", seconds, threads, threads == 1 ? "" : "s");
+    printf("games/s    %.0f\n", played / seconds);
+    printf("shots/s    %.0f\n", shots / seconds);
+    if (unexpected > 0) {
+        printf("unexpected %ld replies\n", unexpected);
+    }
+    free(sims);
+    return unexpected > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
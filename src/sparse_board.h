@@ -0,0 +1,153 @@
+#ifndef SPARSE_BOARD_H
+#define SPARSE_BOARD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define SPARSE_BOARD_MIN_CAPACITY 64  // Holds a whole fleet without growing
+
+/*
+ * Only the cells that hold a piece or were shot at, in an open-addressing
+ * hash table keyed by (row, col) with linear probing. Memory follows the
+ * number of pieces and shots instead of the board area. The table is kept at
+ * most half full and its capacity is a power of two.
+ */
+struct sparse_cell {
+    int row;                     // -1 marks an empty slot
+    int col;
+    uint8_t ship;                // Piece id 1-5, or 0
+    uint8_t shot;                // HIT, MISS, or 0
+};
+
+struct sparse_board {
+    struct sparse_cell *cells;
+    size_t capacity;
+    size_t count;
+};
+
+static inline size_t sparse_board_hash(int row, int col) {
+    uint64_t key = (uint64_t)(uint32_t)row << 32 | (uint32_t)col;
+
+    // splitmix64 finalizer
+    key = (key ^ (key >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    key = (key ^ (key >> 27)) * 0x94d049bb133111ebULL;
+    return (size_t)(key ^ (key >> 31));
+}
+
+static inline int sparse_board_init(struct sparse_board *board, size_t capacity) {
+    board->cells = malloc(capacity * sizeof(struct sparse_cell));
+    if (!board->cells) {
+        return -1;
+    }
+    for (size_t i = 0; i < capacity; i++) {
+        board->cells[i].row = -1;
+    }
+    board->capacity = capacity;
+    board->count = 0;
+    return 0;
+}
+
+static inline void sparse_board_free(struct sparse_board *board) {
+    free(board->cells);
+    board->cells = NULL;
+    board->capacity = 0;
+    board->count = 0;
+}
+
+// Empties the table and keeps its capacity.
+static inline void sparse_board_clear(struct sparse_board *board) {
+    for (size_t i = 0; i < board->capacity; i++) {
+        board->cells[i].row = -1;
+    }
+    board->count = 0;
+}
+
+// Returns the slot holding (row, col), or the empty slot where it belongs.
+static inline struct sparse_cell *sparse_board_slot(const struct sparse_board *board, int row, int col) {
+    size_t mask = board->capacity - 1;
+    size_t i = sparse_board_hash(row, col) & mask;
+
+    while (board->cells[i].row != -1 && (board->cells[i].row != row || board->cells[i].col != col)) {
+        i = (i + 1) & mask;
+    }
+    return &board->cells[i];
+}
+
+static inline const struct sparse_cell *sparse_board_find(const struct sparse_board *board, int row, int col) {
+    const struct sparse_cell *cell = sparse_board_slot(board, row, col);
+    return cell->row == -1 ? NULL : cell;
+}
+
+// Makes sure `extra` more cells can be inserted without growing the table.
+static inline int sparse_board_reserve(struct sparse_board *board, size_t extra) {
+    if (2 * (board->count + extra) <= board->capacity) {
+        return 0;
+    }
+
+    size_t capacity = board->capacity;
+    while (2 * (board->count + extra) > capacity) {
+        capacity *= 2;
+    }
+
+    struct sparse_board grown;
+    if (sparse_board_init(&grown, capacity) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < board->capacity; i++) {
+        if (board->cells[i].row != -1) {
+            *sparse_board_slot(&grown, board->cells[i].row, board->cells[i].col) = board->cells[i];
+        }
+    }
+    grown.count = board->count;
+    free(board->cells);
+    *board = grown;
+    return 0;
+}
+
+// Removes (row, col) if it is stored. The cells after it in its probe run are
+// shifted back into the gap, so the table needs no tombstones.
+static inline void sparse_board_erase(struct sparse_board *board, int row, int col) {
+    size_t mask = board->capacity - 1;
+    struct sparse_cell *cell = sparse_board_slot(board, row, col);
+
+    if (cell->row == -1) {
+        return;
+    }
+    size_t hole = (size_t)(cell - board->cells);
+    for (size_t i = (hole + 1) & mask; board->cells[i].row != -1; i = (i + 1) & mask) {
+        size_t home = sparse_board_hash(board->cells[i].row, board->cells[i].col) & mask;
+
+        // A cell can fill the gap unless its home slot lies after the gap
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            board->cells[hole] = board->cells[i];
+            hole = i;
+        }
+    }
+    board->cells[hole].row = -1;
+    board->count--;
+}
+
+// Returns the cell for (row, col), adding a blank one if it is not stored yet.
+// Returns NULL only if the table had to grow and could not.
+static inline struct sparse_cell *sparse_board_insert(struct sparse_board *board, int row, int col) {
+    struct sparse_cell *cell = sparse_board_slot(board, row, col);
+
+    if (cell->row == -1) {
+        if (2 * (board->count + 1) > board->capacity) {
+            if (sparse_board_reserve(board, 1) != 0) {
+                return NULL;
+            }
+            cell = sparse_board_slot(board, row, col);
+        }
+        cell->row = row;
+        cell->col = col;
+        cell->ship = 0;
+        cell->shot = 0;
+        board->count++;
+    }
+    return cell;
+}
+
+#endif
@@ -0,0 +1,649 @@
+// Ranks bot strategies by playing every bot against every other in-process,
+// through the match engine, across all cores.
+//
+// A bot pairs a placement strategy with a targeting strategy. Every ordered
+// pair of different bots plays -g games, the first bot as Player 1. The games
+// of the whole tournament are numbered, and each game draws its fleets and
+// shots from a generator seeded with its number, so results depend only on
+// the seed and the game count, never on the thread count or the schedule.
+//
+// The games are spread over the threads by a work-stealing scheduler. A task
+// is a range of game numbers. A worker splits the range it runs in half for
+// as long as it is larger than the grain, keeping the lower half and pushing
+// the upper half onto its own deque, where idle workers steal it from the
+// other end. The whole tournament starts as a single task, so the ranges
+// spread out as fast as workers go idle, and the last ranges are small.
+//
+// Build: gcc -O2 -pthread -o tournament src/tournament.c
+// Usage: tournament [-g games_per_pairing] [-t threads] [-b board_size] [-s seed] [-G grain] [-v]
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "engine.h"
+
+#define DEQUE_SIZE 256                // Power of two; splitting never nests deeper
+#define DEFAULT_GRAIN 64              // Games below which a range is not split
+#define PLACEMENT_ATTEMPTS 200        // Before a placement strategy settles for any legal spot
+#define COMPACT_SIZE 6                // Side of the square compact fleets are packed into
+
+enum placement {
+    PLACE_RANDOM,
+    PLACE_EDGE,                       // Every piece touches the board edge
+    PLACE_SPREAD,                     // No two pieces touch, not even diagonally
+    PLACE_COMPACT,                    // The fleet packed into one corner
+    PLACEMENTS
+};
+
+enum targeting {
+    TARGET_RANDOM,                    // Unshot cells in random order
+    TARGET_HUNT,                      // Random until a hit, then its neighbours
+    TARGET_PARITY,                    // Like hunt, searching a checkerboard first
+    TARGETINGS
+};
+
+static const char *const placement_names[PLACEMENTS] = {"random", "edge", "spread", "compact"};
+static const char *const targeting_names[TARGETINGS] = {"random", "hunt", "parity"};
+
+#define BOTS (PLACEMENTS * TARGETINGS)
+#define PAIRINGS (BOTS * (BOTS - 1))
+
+struct task {
+    uint64_t first;                   // Game numbers [first, last)
+    uint64_t last;
+};
+
+// Chase-Lev deque. The owner pushes and takes at the bottom, thieves steal
+// from the top. Tasks are stored as two relaxed atomics so that a thief may
+// read a slot the owner is about to reuse; the CAS on top discards it then.
+struct deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    _Atomic uint64_t slots[DEQUE_SIZE][2];
+};
+
+// What one pairing produced: the first bot played Player 1.
+struct pairing_stats {
+    uint64_t games;
+    uint64_t wins[2];                 // By seat
+    uint64_t winning_shots[2];        // Shots the winner fired, by seat
+};
+
+// One player's view of the opponent's board while shooting.
+struct shooter {
+    enum targeting targeting;
+    uint8_t *known;                   // EMPTY, HIT or MISS per cell
+    uint32_t *order;                  // Cells to search, in the order to try them
+    uint32_t cells;
+    uint32_t next;
+    uint32_t *targets;                // Cells next to hits, tried first
+    uint32_t target_count;
+    uint32_t shots;
+};
+
+struct worker {
+    pthread_t thread;
+    int id;
+    struct tournament *tournament;
+    struct deque deque;
+    uint64_t rng;                     // Picks victims; games use their own generators
+    struct board scratch;             // For planning fleets
+    struct engine_match match;        // Reset for every game, keeping the boards
+    struct shooter shooters[2];
+    struct pairing_stats *stats;      // Per pairing
+    uint64_t games;
+    uint64_t steals;
+};
+
+struct tournament {
+    int threads;
+    int board_size;
+    uint64_t games_per_pairing;
+    uint64_t total_games;
+    uint64_t seed;
+    uint64_t grain;
+    _Atomic uint64_t remaining;
+    struct worker *workers;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t splitmix64(uint64_t x) {
+    x += 0x9E3779B97F4A7C15ull;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+    return x ^ (x >> 31);
+}
+
+static uint64_t next_random(uint64_t *rng) {
+    *rng ^= *rng << 13;
+    *rng ^= *rng >> 7;
+    *rng ^= *rng << 17;
+    return *rng;
+}
+
+static int random_below(uint64_t *rng, int bound) {
+    return (int)(next_random(rng) % bound);
+}
+
+/*
+ * Work-stealing deque.
+ */
+
+// Returns false if the deque is full; the caller runs the task itself then.
+static bool deque_push(struct deque *deque, struct task task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if (bottom - top >= DEQUE_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&deque->slots[bottom & (DEQUE_SIZE - 1)][0], task.first, memory_order_relaxed);
+    atomic_store_explicit(&deque->slots[bottom & (DEQUE_SIZE - 1)][1], task.last, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+static bool deque_take(struct deque *deque, struct task *task) {
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    int64_t top;
+    bool taken = true;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    task->first = atomic_load_explicit(&deque->slots[bottom & (DEQUE_SIZE - 1)][0], memory_order_relaxed);
+    task->last = atomic_load_explicit(&deque->slots[bottom & (DEQUE_SIZE - 1)][1], memory_order_relaxed);
+    if (top == bottom) {
+        // The last task: race the thieves for it
+        taken = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                        memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return taken;
+}
+
+static bool deque_steal(struct deque *deque, struct task *task) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+    if (top >= bottom) {
+        return false;
+    }
+    task->first = atomic_load_explicit(&deque->slots[top & (DEQUE_SIZE - 1)][0], memory_order_relaxed);
+    task->last = atomic_load_explicit(&deque->slots[top & (DEQUE_SIZE - 1)][1], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst,
+                                                   memory_order_relaxed);
+}
+
+/*
+ * Placement strategies. Each fills in a legal fleet, planned on a scratch
+ * board that is left empty again.
+ */
+
+static bool piece_touches_edge(int size, const int coords[4][2]) {
+    for (int i = 0; i < 4; i++) {
+        if (coords[i][0] == 0 || coords[i][1] == 0 || coords[i][0] == size - 1 || coords[i][1] == size - 1) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool piece_touches_fleet(const struct board *board, const int coords[4][2]) {
+    for (int i = 0; i < 4; i++) {
+        for (int dr = -1; dr <= 1; dr++) {
+            for (int dc = -1; dc <= 1; dc++) {
+                int row = coords[i][0] + dr;
+                int col = coords[i][1] + dc;
+                if (board_in_bounds(board, row, col) && board_is_occupied(board, row, col)) {
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
+// Whether a legal spot suits the strategy.
+static bool placement_suits(enum placement placement, const struct board *board, int type, int rotation, int row,
+                            int col) {
+    int coords[4][2];
+
+    get_piece_coordinates(type, rotation, row, col, coords);
+    switch (placement) {
+    case PLACE_EDGE:
+        return piece_touches_edge(board->width, coords);
+    case PLACE_SPREAD:
+        return !piece_touches_fleet(board, coords);
+    case PLACE_COMPACT:
+        return piece_in_bounds(type, rotation, row, col, COMPACT_SIZE, COMPACT_SIZE);
+    default:
+        return true;
+    }
+}
+
+static void plan_fleet(enum placement placement, struct board *scratch, uint64_t *rng,
+                       struct piece_placement pieces[FLEET_SIZE]) {
+    int size = scratch->width;
+
+    for (int id = 1; id <= FLEET_SIZE; id++) {
+        int type, rotation, row, col;
+        int attempts = 0;
+
+        do {
+            type = random_below(rng, 7);
+            rotation = random_below(rng, 4);
+            if (placement == PLACE_COMPACT && attempts < PLACEMENT_ATTEMPTS) {
+                row = random_below(rng, COMPACT_SIZE);
+                col = random_below(rng, COMPACT_SIZE);
+            } else {
+                row = random_below(rng, size);
+                col = random_below(rng, size);
+            }
+        } while (validate_piece_placement(scratch, type, rotation, row, col) != 0 ||
+                 (attempts++ < PLACEMENT_ATTEMPTS && !placement_suits(placement, scratch, type, rotation, row, col)));
+        place_piece(scratch, type, rotation, row, col, id);
+        pieces[id - 1] = (struct piece_placement){type + 1, rotation + 1, row, col};
+    }
+    for (int id = 1; id <= FLEET_SIZE; id++) {
+        remove_piece(scratch, id);
+    }
+}
+
+/*
+ * Targeting strategies.
+ */
+
+static void shooter_reset(struct shooter *shooter, enum targeting targeting, int size, uint64_t *rng) {
+    uint32_t cells = (uint32_t)size * size;
+    uint32_t searched_first = 0;
+
+    shooter->targeting = targeting;
+    shooter->cells = cells;
+    shooter->next = 0;
+    shooter->target_count = 0;
+    shooter->shots = 0;
+    memset(shooter->known, EMPTY, cells);
+
+    // Parity searches the cells of one colour of the checkerboard first: every
+    // piece covers at least one of them
+    if (targeting == TARGET_PARITY) {
+        for (uint32_t cell = 0; cell < cells; cell++) {
+            if ((cell / size + cell % size) % 2 == 0) {
+                shooter->order[searched_first++] = cell;
+            }
+        }
+        for (uint32_t cell = 0, rest = searched_first; cell < cells; cell++) {
+            if ((cell / size + cell % size) % 2 != 0) {
+                shooter->order[rest++] = cell;
+            }
+        }
+    } else {
+        for (uint32_t cell = 0; cell < cells; cell++) {
+            shooter->order[cell] = cell;
+        }
+        searched_first = cells;
+    }
+
+    // Shuffle the first group and the rest separately
+    for (uint32_t i = searched_first; i > 1; i--) {
+        uint32_t j = random_below(rng, i);
+        uint32_t cell = shooter->order[i - 1];
+        shooter->order[i - 1] = shooter->order[j];
+        shooter->order[j] = cell;
+    }
+    for (uint32_t i = cells - searched_first; i > 1; i--) {
+        uint32_t *rest = shooter->order + searched_first;
+        uint32_t j = random_below(rng, i);
+        uint32_t cell = rest[i - 1];
+        rest[i - 1] = rest[j];
+        rest[j] = cell;
+    }
+}
+
+// Picks the next cell to shoot, or returns false once every cell is known.
+static bool shooter_aim(struct shooter *shooter, uint32_t *cell) {
+    while (shooter->target_count > 0) {
+        *cell = shooter->targets[--shooter->target_count];
+        if (shooter->known[*cell] == EMPTY) {
+            return true;
+        }
+    }
+    while (shooter->next < shooter->cells) {
+        *cell = shooter->order[shooter->next++];
+        if (shooter->known[*cell] == EMPTY) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void shooter_learn(struct shooter *shooter, int size, uint32_t cell, char result) {
+    int row = cell / size;
+    int col = cell % size;
+
+    shooter->known[cell] = result;
+    shooter->shots++;
+    if (result != HIT || shooter->targeting == TARGET_RANDOM) {
+        return;
+    }
+    if (row > 0) {
+        shooter->targets[shooter->target_count++] = cell - size;
+    }
+    if (row < size - 1) {
+        shooter->targets[shooter->target_count++] = cell + size;
+    }
+    if (col > 0) {
+        shooter->targets[shooter->target_count++] = cell - 1;
+    }
+    if (col < size - 1) {
+        shooter->targets[shooter->target_count++] = cell + 1;
+    }
+}
+
+/*
+ * Games and workers.
+ */
+
+// Plays game number `game`: the pairing it belongs to and its seed follow
+// from the number alone.
+static void play_game(struct worker *worker, uint64_t game) {
+    struct tournament *tournament = worker->tournament;
+    uint64_t pairing = game / tournament->games_per_pairing;
+    int first = pairing / (BOTS - 1);
+    int second = pairing % (BOTS - 1);
+    int bots[2] = {first, second >= first ? second + 1 : second};
+    int size = tournament->board_size;
+    uint64_t rng = splitmix64(tournament->seed ^ splitmix64(game)) | 1;
+    struct engine_match *match = &worker->match;
+    struct engine_result result;
+    struct piece_placement pieces[FLEET_SIZE];
+
+    engine_match_reset(match);
+    engine_begin(match, 0, size, size, &result);
+    engine_begin(match, 1, 0, 0, &result);
+    for (int player = 0; player < 2; player++) {
+        plan_fleet(bots[player] / TARGETINGS, &worker->scratch, &rng, pieces);
+        engine_initialize(match, player, pieces, &result);
+        shooter_reset(&worker->shooters[player], bots[player] % TARGETINGS, size, &rng);
+    }
+
+    result.loser = -1;
+    while (match->phase != PHASE_HALT) {
+        int player = engine_expected_player(match);
+        struct shooter *shooter = &worker->shooters[player];
+        uint32_t cell;
+
+        if (!shooter_aim(shooter, &cell)) {
+            engine_forfeit(match, player, &result);  // Cannot happen with a legal fleet
+            break;
+        }
+        engine_shoot(match, player, cell / size, cell % size, &result);
+        if (result.reply != ENGINE_REPLY_SHOT) {
+            fprintf(stderr, "[Tournament] Game %llu: shot at %u answered with error %d\n",
+                    (unsigned long long)game, cell, result.error);
+            exit(EXIT_FAILURE);
+        }
+        shooter_learn(shooter, size, cell, result.shot);
+    }
+
+    int winner = 1 - result.loser;
+    struct pairing_stats *stats = &worker->stats[pairing];
+    stats->games++;
+    stats->wins[winner]++;
+    stats->winning_shots[winner] += worker->shooters[winner].shots;
+    worker->games++;
+}
+
+// Runs a range of games, first handing the upper halves of it to the deque
+// for other workers to steal.
+static void run_task(struct worker *worker, struct task task) {
+    while (task.last - task.first > worker->tournament->grain) {
+        uint64_t middle = task.first + (task.last - task.first) / 2;
+        if (!deque_push(&worker->deque, (struct task){middle, task.last})) {
+            break;
+        }
+        task.last = middle;
+    }
+    for (uint64_t game = task.first; game < task.last; game++) {
+        play_game(worker, game);
+    }
+    atomic_fetch_sub_explicit(&worker->tournament->remaining, task.last - task.first, memory_order_acq_rel);
+}
+
+static bool steal_task(struct worker *worker, struct task *task) {
+    struct tournament *tournament = worker->tournament;
+    int start = random_below(&worker->rng, tournament->threads);
+
+    for (int i = 0; i < tournament->threads; i++) {
+        struct worker *victim = &tournament->workers[(start + i) % tournament->threads];
+        if (victim != worker && deque_steal(&victim->deque, task)) {
+            worker->steals++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void *worker_run(void *arg) {
+    struct worker *worker = arg;
+    struct tournament *tournament = worker->tournament;
+    struct task task;
+
+    while (atomic_load_explicit(&tournament->remaining, memory_order_acquire) > 0) {
+        if (deque_take(&worker->deque, &task) || steal_task(worker, &task)) {
+            run_task(worker, task);
+        } else {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+static int worker_init(struct worker *worker, struct tournament *tournament, int id) {
+    size_t cells = (size_t)tournament->board_size * tournament->board_size;
+
+    worker->id = id;
+    worker->tournament = tournament;
+    worker->rng = splitmix64(tournament->seed + id) | 1;
+    engine_match_init(&worker->match);
+    worker->stats = calloc(PAIRINGS, sizeof(struct pairing_stats));
+    if (!worker->stats || initialize_board(&worker->scratch, tournament->board_size, tournament->board_size,
+                                           board_kind_for(tournament->board_size, tournament->board_size)) != 0) {
+        return -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        struct shooter *shooter = &worker->shooters[i];
+        shooter->known = malloc(cells);
+        shooter->order = malloc(cells * sizeof(uint32_t));
+        shooter->targets = malloc(4 * cells * sizeof(uint32_t));
+        if (!shooter->known || !shooter->order || !shooter->targets) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Results.
+ */
+
+struct bot_stats {
+    int bot;
+    uint64_t games;
+    uint64_t wins;
+    uint64_t wins_as[2];
+    uint64_t games_as[2];
+    uint64_t winning_shots;
+};
+
+static int compare_bots(const void *a, const void *b) {
+    const struct bot_stats *x = a;
+    const struct bot_stats *y = b;
+    double rate_x = x->games ? (double)x->wins / x->games : 0;
+    double rate_y = y->games ? (double)y->wins / y->games : 0;
+
+    if (rate_x != rate_y) {
+        return rate_x < rate_y ? 1 : -1;
+    }
+    return x->bot - y->bot;
+}
+
+static void bot_name(int bot, char *name, size_t size) {
+    snprintf(name, size, "%s/%s", placement_names[bot / TARGETINGS], targeting_names[bot % TARGETINGS]);
+}
+
+static void print_results(const struct pairing_stats *totals, bool pairings) {
+    struct bot_stats bots[BOTS] = {0};
+    char name[2][32];
+
+    for (int bot = 0; bot < BOTS; bot++) {
+        bots[bot].bot = bot;
+    }
+    for (int pairing = 0; pairing < PAIRINGS; pairing++) {
+        const struct pairing_stats *stats = &totals[pairing];
+        int first = pairing / (BOTS - 1);
+        int second = pairing % (BOTS - 1);
+        int seats[2] = {first, second >= first ? second + 1 : second};
+
+        for (int seat = 0; seat < 2; seat++) {
+            struct bot_stats *bot = &bots[seats[seat]];
+            bot->games += stats->games;
+            bot->games_as[seat] += stats->games;
+            bot->wins += stats->wins[seat];
+            bot->wins_as[seat] += stats->wins[seat];
+            bot->winning_shots += stats->winning_shots[seat];
+        }
+        if (pairings && stats->games > 0) {
+            bot_name(seats[0], name[0], sizeof(name[0]));
+            bot_name(seats[1], name[1], sizeof(name[1]));
+            printf("pairing %-16s vs %-16s games %8llu  P1 wins %6.2f%%\n", name[0], name[1],
+                   (unsigned long long)stats->games, 100.0 * stats->wins[0] / stats->games);
+        }
+    }
+
+    qsort(bots, BOTS, sizeof(bots[0]), compare_bots);
+    printf("%-4s %-16s %10s %8s %8s %8s %14s\n", "rank", "bot", "games", "win%", "as P1", "as P2", "shots-to-win");
+    for (int i = 0; i < BOTS; i++) {
+        const struct bot_stats *bot = &bots[i];
+        bot_name(bot->bot, name[0], sizeof(name[0]));
+        printf("%-4d %-16s %10llu %7.2f%% %7.2f%% %7.2f%% %14.2f\n", i + 1, name[0], (unsigned long long)bot->games,
+               bot->games ? 100.0 * bot->wins / bot->games : 0,
+               bot->games_as[0] ? 100.0 * bot->wins_as[0] / bot->games_as[0] : 0,
+               bot->games_as[1] ? 100.0 * bot->wins_as[1] / bot->games_as[1] : 0,
+               bot->wins ? (double)bot->winning_shots / bot->wins : 0);
+    }
+}
+
+int main(int argc, char **argv) {
+    struct tournament tournament = {
+        .threads = (int)sysconf(_SC_NPROCESSORS_ONLN),
+        .board_size = 10,
+        .games_per_pairing = 1000,
+        .seed = 1,
+        .grain = DEFAULT_GRAIN,
+    };
+    bool pairings = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "g:t:b:s:G:v")) != -1) {
+        switch (opt) {
+        case 'g':
+            tournament.games_per_pairing = strtoull(optarg, NULL, 10);
+            break;
+        case 't':
+            tournament.threads = atoi(optarg);
+            break;
+        case 'b':
+            tournament.board_size = atoi(optarg);
+            break;
+        case 's':
+            tournament.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'G':
+            tournament.grain = strtoull(optarg, NULL, 10);
+            break;
+        case 'v':
+            pairings = true;
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-g games_per_pairing] [-t threads] [-b board_size] [-s seed] [-G grain] [-v]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (tournament.threads < 1 || tournament.games_per_pairing < 1 || tournament.grain < 1 ||
+        tournament.board_size < 10 || tournament.board_size > 1000) {
+        fprintf(stderr, "[Tournament] Invalid arguments\n");
+        exit(EXIT_FAILURE);
+    }
+    log_set_level(LOG_OFF);
+
+    tournament.total_games = tournament.games_per_pairing * PAIRINGS;
+    atomic_init(&tournament.remaining, tournament.total_games);
+    tournament.workers = calloc(tournament.threads, sizeof(struct worker));
+    if (!tournament.workers) {
+        perror("[Tournament] Failed to allocate workers");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < tournament.threads; i++) {
+        if (worker_init(&tournament.workers[i], &tournament, i) != 0) {
+            perror("[Tournament] Failed to allocate a worker");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The whole tournament starts as one task on the first worker
+    deque_push(&tournament.workers[0].deque, (struct task){0, tournament.total_games});
+    uint64_t start = now_ns();
+    for (int i = 0; i < tournament.threads; i++) {
+        if (pthread_create(&tournament.workers[i].thread, NULL, worker_run, &tournament.workers[i]) != 0) {
+            perror("[Tournament] pthread_create() failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    struct pairing_stats totals[PAIRINGS] = {0};
+    uint64_t steals = 0;
+    for (int i = 0; i < tournament.threads; i++) {
+        struct worker *worker = &tournament.workers[i];
+        pthread_join(worker->thread, NULL);
+        for (int pairing = 0; pairing < PAIRINGS; pairing++) {
+            totals[pairing].games += worker->stats[pairing].games;
+            for (int seat = 0; seat < 2; seat++) {
+                totals[pairing].wins[seat] += worker->stats[pairing].wins[seat];
+                totals[pairing].winning_shots[seat] += worker->stats[pairing].winning_shots[seat];
+            }
+        }
+        steals += worker->steals;
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    print_results(totals, pairings);
+    printf("\n%llu games in %.3f s on %d thread%s: %.0f games/s, %llu steals\n",
+           (unsigned long long)tournament.total_games, seconds, tournament.threads,
+           tournament.threads == 1 ? "" : "s", tournament.total_games / seconds, (unsigned long long)steals);
+    if (pairings) {
+        for (int i = 0; i < tournament.threads; i++) {
+            printf("worker %d played %llu games\n", i, (unsigned long long)tournament.workers[i].games);
+        }
+    }
+    return 0;
+}
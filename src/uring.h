@@ -0,0 +1,315 @@
+#ifndef URING_H
+#define URING_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+/*
+ * A minimal io_uring ring, driven through the raw system calls so the server
+ * needs nothing beyond the kernel headers. Requests are queued in the
+ * submission ring and only handed to the kernel by uring_submit(), which also
+ * waits for completions: a worker makes one system call per pass no matter
+ * how many sockets it reads and writes. Received data lands in a provided
+ * buffer ring registered with the kernel, from which multishot receives pick a
+ * buffer per completion; the owner copies the data out and gives the buffer
+ * straight back. A ring is used by the thread that created it only.
+ */
+
+#define URING_CQ_FACTOR 4            // Completion slots per submission slot
+
+struct uring {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_array;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sqe_tail;               // Requests queued, published by uring_submit()
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+// Buffers the kernel picks from for receives that select one.
+struct uring_buffers {
+    struct io_uring_buf_ring *ring;
+    size_t ring_size;
+    char *data;
+    unsigned entries;                // A power of two
+    unsigned size;                   // Bytes per buffer
+    uint16_t group;
+    uint16_t tail;
+};
+
+static inline int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static inline void uring_free(struct uring *ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+// Sets up a ring with `entries` submission slots. Task work is deferred to
+// the waiting call when the kernel supports it (6.1), which saves the
+// interrupts an idle worker would otherwise take for every completion.
+// Returns -1 with errno set on failure.
+static inline int uring_init(struct uring *ring, unsigned entries) {
+    static const unsigned setups[] = {
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+        IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL,
+    };
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+    for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]) && ring->fd < 0; i++) {
+        memset(&params, 0, sizeof(params));
+        params.flags = setups[i];
+        params.cq_entries = entries * URING_CQ_FACTOR;
+        ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if (ring->fd < 0 && errno != EINVAL) {
+            return -1;
+        }
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+        int saved = errno;
+        ring->sq_ring = ring->sq_ring == MAP_FAILED ? NULL : ring->sq_ring;
+        ring->cq_ring = ring->cq_ring == MAP_FAILED ? NULL : ring->cq_ring;
+        ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+        uring_free(ring);
+        errno = saved;
+        return -1;
+    }
+
+    char *sq = ring->sq_ring;
+    char *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sqe_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    // Submission slots map one to one onto the request array
+    for (unsigned i = 0; i < ring->sq_entries; i++) {
+        ring->sq_array[i] = i;
+    }
+    return 0;
+}
+
+// Hands the queued requests to the kernel and waits for `wait` completions.
+// Returns -1 with errno set on failure; EINTR leaves the requests queued.
+static inline int uring_submit(struct uring *ring, unsigned wait) {
+    unsigned pending;
+
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+    pending = ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && wait == 0) {
+        return 0;
+    }
+    return uring_enter(ring->fd, pending, wait, wait > 0 ? IORING_ENTER_GETEVENTS : 0) < 0 ? -1 : 0;
+}
+
+// A cleared request slot, or NULL if the ring is full and could not be
+// submitted to make room.
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+    while (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries) {
+        if (uring_submit(ring, 0) == -1 && errno != EINTR) {
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    ring->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+// The oldest completion not consumed yet, or NULL.
+static inline struct io_uring_cqe *uring_peek(struct uring *ring) {
+    unsigned head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    return &ring->cqes[head & ring->cq_mask];
+}
+
+static inline void uring_advance(struct uring *ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+// Accepts connections on `fd` until cancelled, one completion per connection.
+static inline void uring_prep_accept_multishot(struct io_uring_sqe *sqe, int fd, int flags, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = flags;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+// Receives on `fd` until cancelled or the peer hangs up, one completion per
+// buffer taken from group `group`.
+static inline void uring_prep_recv_multishot(struct io_uring_sqe *sqe, int fd, uint16_t group, uint64_t user_data) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data;
+}
+
+// `message` and its iovecs must stay put until the completion arrives.
+static inline void uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd, const struct msghdr *message, int flags, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)message;
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+}
+
+// Cancels the request submitted with `target` as its user data.
+static inline void uring_prep_cancel(struct io_uring_sqe *sqe, uint64_t target, uint64_t user_data) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+    sqe->user_data = user_data;
+}
+
+static inline char *uring_buffer(const struct uring_buffers *buffers, uint16_t id) {
+    return buffers->data + (size_t)id * buffers->size;
+}
+
+// Gives buffer `id` back to the kernel.
+static inline void uring_buffers_put(struct uring_buffers *buffers, uint16_t id) {
+    struct io_uring_buf *buf = &buffers->ring->bufs[buffers->tail & (buffers->entries - 1)];
+
+    buf->addr = (uintptr_t)uring_buffer(buffers, id);
+    buf->len = buffers->size;
+    buf->bid = id;
+    buffers->tail++;
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+}
+
+static inline void uring_buffers_free(struct uring_buffers *buffers) {
+    if (buffers->ring) {
+        munmap(buffers->ring, buffers->ring_size);
+    }
+    free(buffers->data);
+    memset(buffers, 0, sizeof(*buffers));
+}
+
+// Registers `entries` buffers of `size` bytes as group `group` of the ring
+// (kernel 5.19). Returns -1 with errno set on failure.
+static inline int uring_buffers_init(struct uring *ring, struct uring_buffers *buffers, uint16_t group, unsigned entries, unsigned size) {
+    struct io_uring_buf_reg reg;
+
+    memset(buffers, 0, sizeof(*buffers));
+    buffers->entries = entries;
+    buffers->size = size;
+    buffers->group = group;
+    buffers->ring_size = entries * sizeof(struct io_uring_buf);
+    buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buffers->ring == MAP_FAILED) {
+        buffers->ring = NULL;
+        return -1;
+    }
+    if (posix_memalign((void **)&buffers->data, 64, (size_t)entries * size) != 0) {
+        uring_buffers_free(buffers);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)buffers->ring;
+    reg.ring_entries = entries;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        int saved = errno;
+        uring_buffers_free(buffers);
+        errno = saved;
+        return -1;
+    }
+    for (unsigned i = 0; i < entries; i++) {
+        uring_buffers_put(buffers, i);
+    }
+    return 0;
+}
+
+// Whether the kernel runs everything the server's io_uring backend relies
+// on: a provided buffer ring and a multishot receive (6.0), checked end to
+// end on a socket pair. Multishot accept is older than both.
+static inline bool uring_supported(void) {
+    struct uring ring;
+    struct uring_buffers buffers;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int pair[2];
+    bool supported = false;
+
+    if (uring_init(&ring, 4) == -1) {
+        return false;
+    }
+    if (uring_buffers_init(&ring, &buffers, 0, 2, 64) == -1) {
+        uring_free(&ring);
+        return false;
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, pair) == 0) {
+        if ((sqe = uring_get_sqe(&ring))) {
+            uring_prep_recv_multishot(sqe, pair[0], 0, 1);
+            if (write(pair[1], "x", 1) == 1 && uring_submit(&ring, 1) == 0 && (cqe = uring_peek(&ring))) {
+                supported = cqe->res == 1 && (cqe->flags & IORING_CQE_F_BUFFER) && (cqe->flags & IORING_CQE_F_MORE);
+            }
+        }
+        close(pair[0]);
+        close(pair[1]);
+    }
+    uring_free(&ring);
+    uring_buffers_free(&buffers);
+    return supported;
+}
+
+#endif
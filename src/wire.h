@@ -0,0 +1,97 @@
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Binary protocol. A client selects it by sending the 4-byte hello as the
+ * first bytes on the connection. The server answers with its own hello, and
+ * every packet after that, in both directions, is a frame: an 8-byte header
+ * followed by `length` bytes of payload. Integers are little-endian.
+ *
+ *   header   u8 type, u8 flags (0), u16 reserved (0), u32 length
+ *
+ * Requests use the text opcodes as frame types:
+ *   B   Player 1: i32 width, i32 height. Player 2: empty.
+ *   I   5 x (i32 piece type, i32 rotation, i32 row, i32 col)
+ *   S   i32 row, i32 col
+ *   V   u32 count (1 to WIRE_VOLLEY_MAX), then count x (i32 row, i32 col)
+ *   Q   empty, or u32 sequence number of the first shot wanted
+ *   F   empty
+ *   L   Lobby hello, before pairing or after a match: empty, or i32 width,
+ *       i32 height of the preferred board
+ *   M   Rematch, after a match: empty
+ *
+ * Replies:
+ *   A   empty
+ *   E   u16 error code
+ *   R   u8 ships remaining, u8 'H' or 'M'
+ *   G   u8 ships remaining, u8 0, u16 0, u32 count, then count shots of
+ *       (u32 row, u32 col) in the order they were fired; bit 31 of the row
+ *       marks a hit
+ *   V   u8 ships remaining, u8 0, u16 error code that stopped the volley
+ *       (0 if none), u32 shots fired, then one bit per shot fired, least
+ *       significant first, set for a hit
+ *   H   u8 1 if the receiver won, 0 if it lost
+ *   P   u8 seat the lobby paired the receiver into: 1 or 2
+ *
+ * A connection whose first byte is anything other than WIRE_HELLO_BYTE
+ * speaks the text protocol. On the seat ports the server's hello, like any
+ * other reply, is only sent once both players are connected; on the lobby
+ * port it is sent right away. A hello for another version is answered with
+ * the server's hello and the connection is closed. A request frame longer
+ * than WIRE_FRAME_MAX bytes drops the connection.
+ *
+ * Lobby connections outlive their match. After H a client sends M to play the
+ * same opponent again, which starts once both asked and is announced with a
+ * fresh P, or L to be paired anew. Either also counts as the acknowledgment
+ * the server otherwise waits for after H. A client whose opponent left goes
+ * back to the lobby instead of getting its rematch.
+ */
+
+#define WIRE_HELLO_BYTE 0xB5         // Never starts a text packet
+#define WIRE_HELLO_SIZE 4
+#define WIRE_VERSION 1
+#define WIRE_HEADER_SIZE 8
+#define WIRE_SHOT_SIZE 8
+#define WIRE_SHOT_HIT 0x80000000u
+#define WIRE_VOLLEY_MAX 256          // Shots in a V request, as many as the engine takes
+#define WIRE_FRAME_MAX (WIRE_HEADER_SIZE + 4 + WIRE_VOLLEY_MAX * WIRE_SHOT_SIZE)  // A full V, the largest request
+
+static const uint8_t wire_hello[WIRE_HELLO_SIZE] = {WIRE_HELLO_BYTE, 'B', 'N', WIRE_VERSION};
+
+static inline void wire_put_u16(uint8_t *p, uint16_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+}
+
+static inline void wire_put_u32(uint8_t *p, uint32_t value) {
+    p[0] = value;
+    p[1] = value >> 8;
+    p[2] = value >> 16;
+    p[3] = value >> 24;
+}
+
+static inline uint16_t wire_get_u16(const uint8_t *p) {
+    return (uint16_t)(p[0] | p[1] << 8);
+}
+
+static inline uint32_t wire_get_u32(const uint8_t *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline int32_t wire_get_i32(const uint8_t *p) {
+    return (int32_t)wire_get_u32(p);
+}
+
+// Writes a frame header and returns its size.
+static inline size_t wire_put_header(uint8_t *p, char type, uint32_t length) {
+    p[0] = (uint8_t)type;
+    p[1] = 0;
+    wire_put_u16(p + 2, 0);
+    wire_put_u32(p + 4, length);
+    return WIRE_HEADER_SIZE;
+}
+
+#endif